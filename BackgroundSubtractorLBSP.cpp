@@ -20,8 +20,6 @@ BackgroundSubtractorLBSP::BackgroundSubtractorLBSP(float fRelLBSPThreshold, size
 		,m_nFrameIndex(SIZE_MAX)
 		,m_nFramesSinceLastReset(0)
 		,m_nModelResetCooldown(0)
-		,m_aPxIdxLUT(nullptr)
-		,m_aPxInfoLUT(nullptr)
 		,m_nDefaultMedianBlurKernelSize(DEFAULT_MEDIAN_BLUR_KERNEL_SIZE)
 		,m_bInitialized(false)
 		,m_bAutoModelResetEnabled(true)
@@ -59,3 +57,28 @@ void BackgroundSubtractorLBSP::setROI(cv::Mat& oROI) {
 void BackgroundSubtractorLBSP::setAutomaticModelReset(bool bVal) {
 	m_bAutoModelResetEnabled = bVal;
 }
+
+void BackgroundSubtractorLBSP::computeSpans(const cv::Mat& oMask, std::vector<PxSpan>& voSpans, std::vector<size_t>& vnRowSpanIdxs) {
+	CV_Assert(!oMask.empty() && oMask.type()==CV_8UC1);
+	voSpans.clear();
+	vnRowSpanIdxs.resize(oMask.rows+1);
+	for(int y=0; y<oMask.rows; ++y) {
+		vnRowSpanIdxs[y] = voSpans.size();
+		const uchar* const anMaskRow = oMask.ptr<uchar>(y);
+		int x = 0;
+		while(x<oMask.cols) {
+			while(x<oMask.cols && !anMaskRow[x])
+				++x;
+			if(x==oMask.cols)
+				break;
+			PxSpan oSpan;
+			oSpan.nY = y;
+			oSpan.nStartX = x;
+			while(x<oMask.cols && anMaskRow[x])
+				++x;
+			oSpan.nEndX = x;
+			voSpans.push_back(oSpan);
+		}
+	}
+	vnRowSpanIdxs[oMask.rows] = voSpans.size();
+}
@@ -35,11 +35,14 @@ public:
 	void setAutomaticModelReset(bool);
 
 protected:
-	struct PxInfoBase {
-		int nImgCoord_Y;
-		int nImgCoord_X;
-		size_t nModelIdx;
+	//! horizontal run of consecutive relevant pixels (covers [nStartX,nEndX) on row nY)
+	struct PxSpan {
+		int nY;
+		int nStartX;
+		int nEndX;
 	};
+	//! builds the run-length spans of the non-zero pixels of a CV_8UC1 mask (ordered by row, then column) and the index of the first span of each row (plus one end index)
+	static void computeSpans(const cv::Mat& oMask, std::vector<PxSpan>& voSpans, std::vector<size_t>& vnRowSpanIdxs);
 	//! background model ROI used for LBSP descriptor extraction (specific to the input image size)
 	cv::Mat m_oROI;
 	//! input image size
@@ -58,10 +61,10 @@ protected:
 	size_t m_nFrameIndex, m_nFramesSinceLastReset, m_nModelResetCooldown;
 	//! pre-allocated internal LBSP threshold values LUT for all possible 8-bit intensities
 	size_t m_anLBSPThreshold_8bitLUT[UCHAR_MAX+1];
-	//! internal pixel index LUT for all relevant analysis regions (based on the provided ROI)
-	size_t* m_aPxIdxLUT;
-	//! internal pixel info LUT for all possible pixel indexes
-	PxInfoBase* m_aPxInfoLUT;
+	//! run-length spans of all relevant analysis regions (based on the provided ROI); pixel coordinates are derived from the span iteration itself
+	std::vector<PxSpan> m_voROISpans;
+	//! index of the first ROI span of each row (row 'y' covers [m_vnROIRowSpanIdxs[y],m_vnROIRowSpanIdxs[y+1]) )
+	std::vector<size_t> m_vnROIRowSpanIdxs;
 	//! default kernel size for median blur post-proc filtering
 	const int m_nDefaultMedianBlurKernelSize;
 	//! specifies whether the algorithm is fully initialized or not
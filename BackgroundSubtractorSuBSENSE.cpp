@@ -2,8 +2,11 @@
 #include "DistanceUtils.h"
 #include "RandUtils.h"
 #include "graph.h"
+#include "Diagnostics.h"
 #include <iostream>
 #include <vector>
+#include <cstddef>
+#include <cfloat>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <iomanip>
@@ -37,6 +40,16 @@
 //! parameters used to define model reset/learning rate boosts in our frame-level component
 #define FRAMELEVEL_MIN_COLOR_DIFF_THRESHOLD  (m_nMinColorDistThreshold/2)
 #define FRAMELEVEL_ANALYSIS_DOWNSAMPLE_RATIO (8)
+//! parameters used to split the PatchMatch refinement in row tiles (each with its own random engine) and to cap its propagation jump (2^x)
+#define PATCHMATCH_TILE_ROWS (16)
+#define PATCHMATCH_MAX_JUMP_LOG2 (4)
+//! the PatchMatch refinement stops once a pass with a jump of 1 improves less than this fraction of the patches
+#define PATCHMATCH_CONVERGENCE_RATIO (0.002)
+//! propagation jump (2^x) a warm-started PatchMatch refinement restarts from, halved at every pass down to 1
+#define PATCHMATCH_WARM_MAX_JUMP_LOG2 (2)
+//! mean squared patch difference (summed over the channels) mapped to 255 in the patch match distance map; the former
+//! distance summed one pixel patch_w^2 times over patch_w2^2, so 52*patch_w2^2/patch_w^2 keeps its operating point
+#define PATCHMATCH_DIST_SATURATION (52.0*(patch_w2*patch_w2)/(patch_w*patch_w))
 
 // local define used to display debug information
 #define DISPLAY_SUBSENSE_DEBUG_INFO 0
@@ -52,40 +65,170 @@ static const size_t s_nDescMaxDataRange_1ch = LBSP::DESC_SIZE*8;
 static const size_t s_nColorMaxDataRange_3ch = s_nColorMaxDataRange_1ch*3;
 static const size_t s_nDescMaxDataRange_3ch = s_nDescMaxDataRange_1ch*3;
 
+//! returns whether a 3x3 (CV_64F) homography has no perspective component
+static inline bool isAffine(const double* h) {
+	return h[6]==0.0 && h[7]==0.0 && h[8]==1.0;
+}
+
+//! returns whether a 3x3 (CV_64F) homography is an exact integer translation
+static inline bool isIntegerShift(const double* h) {
+	return isAffine(h) && h[0]==1.0 && h[1]==0.0 && h[3]==0.0 && h[4]==1.0 && h[2]==std::floor(h[2]) && h[5]==std::floor(h[5]);
+}
+
+//! computes the footprint of a frame of the given size warped with a 3x3 (CV_64F) homography, i.e. the convex quad made of its
+//! transformed corner pixel centers; returns false for degenerate footprints (horizon crossing the frame, null area)
+static inline bool getWarpedQuad(const double* h, const cv::Size& oSrcSize, double* adQuadX, double* adQuadY, double& dOrientation) {
+	const double adCornersX[4] = {0.0,(double)(oSrcSize.width-1),(double)(oSrcSize.width-1),0.0};
+	const double adCornersY[4] = {0.0,0.0,(double)(oSrcSize.height-1),(double)(oSrcSize.height-1)};
+	for(size_t n=0; n<4; ++n) {
+		const double dW = h[6]*adCornersX[n]+h[7]*adCornersY[n]+h[8];
+		if(dW<=DBL_EPSILON)
+			return false;
+		adQuadX[n] = (h[0]*adCornersX[n]+h[1]*adCornersY[n]+h[2])/dW;
+		adQuadY[n] = (h[3]*adCornersX[n]+h[4]*adCornersY[n]+h[5])/dW;
+	}
+	double dQuadArea = 0.0;
+	for(size_t n=0; n<4; ++n)
+		dQuadArea += adQuadX[n]*adQuadY[(n+1)%4]-adQuadX[(n+1)%4]*adQuadY[n];
+	dOrientation = dQuadArea>0?1.0:-1.0;
+	return std::abs(dQuadArea)>DBL_EPSILON;
+}
+
+//! computes the [nStartX,nEndX[ pixel range of row y covered by a convex quad (clipped to [0,nWidth[); returns false if the row misses it
+static inline bool getQuadRowRange(const double* adQuadX, const double* adQuadY, double dOrientation, int y, int nWidth, int& nStartX, int& nEndX) {
+	// each quad edge is a half-plane, i.e. a linear bound on x for a given row
+	double dMinX = 0.0, dMaxX = nWidth-1;
+	for(size_t n=0; n<4 && dMinX<=dMaxX; ++n) {
+		const double dEdgeX = adQuadX[(n+1)%4]-adQuadX[n], dEdgeY = adQuadY[(n+1)%4]-adQuadY[n];
+		const double dSlope = -dOrientation*dEdgeY;
+		const double dOffset = dOrientation*(dEdgeX*(y-adQuadY[n])+dEdgeY*adQuadX[n]);
+		if(dSlope>0)
+			dMinX = std::max(dMinX,-dOffset/dSlope);
+		else if(dSlope<0)
+			dMaxX = std::min(dMaxX,-dOffset/dSlope);
+		else if(dOffset<0)
+			dMinX = dMaxX+1;
+	}
+	if(dMinX>dMaxX)
+		return false;
+	nStartX = (int)std::ceil(dMinX);
+	nEndX = (int)std::floor(dMaxX)+1;
+	return nStartX<nEndX;
+}
+
+//! returns the bitmask of the samples of a color prefilter group that actually exist in a model of 'nBGSamples' samples
+static inline unsigned int getSampleGroupValidMask(size_t nGroupIdx, size_t nBGSamples) {
+	const size_t nValidCount = nBGSamples-nGroupIdx;
+	return (nValidCount>=32)?0xFFFFFFFFu:((1u<<nValidCount)-1);
+}
+
+// fixed-point formats used by the lean per-pixel state records
+static const float s_fQ4_12Scale = 4096.0f;
+static const float s_fQ8_8Scale = 256.0f;
+static const float s_fQ9_7Scale = 128.0f;
+static const float s_fQ0_16Scale = 65535.0f;
+
+static inline ushort encodeFixedPoint(float fVal, float fScale) {
+	return cv::saturate_cast<ushort>(fVal*fScale);
+}
+
+//! encodes a value with stochastic rounding: for a dither uniform in [0,1), it is rounded up with a probability equal to its fractional part,
+//! so that steps smaller than half an LSB still move the stored value on average
+static inline ushort encodeFixedPointDithered(float fVal, float fScale, float fDither) {
+	return cv::saturate_cast<ushort>(cvFloor(fVal*fScale+fDither));
+}
+
+//! returns a dither value in [0,1) that only depends on the seed & pixel index (splitmix64 finalizer)
+static inline float getRoundingDither(uint64 nSeed, size_t nPxIter) {
+	uint64 x = nSeed+(uint64)nPxIter*0x9E3779B97F4A7C15ULL;
+	x = (x^(x>>30))*0xBF58476D1CE4E5B9ULL;
+	x = (x^(x>>27))*0x94D049BB133111EBULL;
+	x ^= x>>31;
+	return (float)(x>>40)*(1.0f/(1<<24));
+}
+
+static inline float decodeFixedPoint(ushort nVal, float fScale) {
+	return nVal/fScale;
+}
+
+static inline float decodeQ0_16(ushort nVal) {
+	return decodeFixedPoint(nVal,s_fQ0_16Scale);
+}
+
+inline void BackgroundSubtractorSuBSENSE::decodePxState(const PxStateLean& oLeanPxState, PxState& oPxState) {
+	oPxState.fDistThresholdFactor = decodeFixedPoint(oLeanPxState.nDistThresholdFactor,s_fQ4_12Scale);
+	oPxState.fVariationFactor = decodeFixedPoint(oLeanPxState.nVariationFactor,s_fQ8_8Scale);
+	oPxState.fLearningRate = decodeFixedPoint(oLeanPxState.nLearningRate,s_fQ9_7Scale);
+	oPxState.fMeanLastDist = decodeQ0_16(oLeanPxState.nMeanLastDist);
+	oPxState.fMeanMinDist_LT = decodeQ0_16(oLeanPxState.nMeanMinDist_LT);
+	oPxState.fMeanMinDist_ST = decodeQ0_16(oLeanPxState.nMeanMinDist_ST);
+	oPxState.fMeanRawSegmRes_LT = decodeQ0_16(oLeanPxState.nMeanRawSegmRes_LT);
+	oPxState.fMeanRawSegmRes_ST = decodeQ0_16(oLeanPxState.nMeanRawSegmRes_ST);
+	oPxState.fMeanFinalSegmRes_LT = decodeQ0_16(oLeanPxState.nMeanFinalSegmRes_LT);
+	oPxState.fMeanFinalSegmRes_ST = decodeQ0_16(oLeanPxState.nMeanFinalSegmRes_ST);
+}
+
+inline void BackgroundSubtractorSuBSENSE::encodePxState(const PxState& oPxState, PxStateLean& oLeanPxState, float fRDither) {
+	oLeanPxState.nDistThresholdFactor = encodeFixedPointDithered(oPxState.fDistThresholdFactor,s_fQ4_12Scale,fRDither);
+	oLeanPxState.nVariationFactor = encodeFixedPoint(oPxState.fVariationFactor,s_fQ8_8Scale);
+	oLeanPxState.nLearningRate = encodeFixedPoint(oPxState.fLearningRate,s_fQ9_7Scale);
+	oLeanPxState.nMeanLastDist = encodeFixedPoint(oPxState.fMeanLastDist,s_fQ0_16Scale);
+	oLeanPxState.nMeanMinDist_LT = encodeFixedPoint(oPxState.fMeanMinDist_LT,s_fQ0_16Scale);
+	oLeanPxState.nMeanMinDist_ST = encodeFixedPoint(oPxState.fMeanMinDist_ST,s_fQ0_16Scale);
+	oLeanPxState.nMeanRawSegmRes_LT = encodeFixedPoint(oPxState.fMeanRawSegmRes_LT,s_fQ0_16Scale);
+	oLeanPxState.nMeanRawSegmRes_ST = encodeFixedPoint(oPxState.fMeanRawSegmRes_ST,s_fQ0_16Scale);
+	oLeanPxState.nMeanFinalSegmRes_LT = encodeFixedPoint(oPxState.fMeanFinalSegmRes_LT,s_fQ0_16Scale);
+	oLeanPxState.nMeanFinalSegmRes_ST = encodeFixedPoint(oPxState.fMeanFinalSegmRes_ST,s_fQ0_16Scale);
+}
+
 BackgroundSubtractorSuBSENSE::BackgroundSubtractorSuBSENSE(	 float fRelLBSPThreshold
 															,size_t nDescDistThresholdOffset
 															,size_t nMinColorDistThreshold
 															,size_t nBGSamples
 															,size_t nRequiredBGSamples
-															,size_t nSamplesForMovingAvgs)
+															,size_t nSamplesForMovingAvgs
+															,size_t nThreads
+															,bool bLeanPxState)
 	:	 BackgroundSubtractorLBSP(fRelLBSPThreshold)
 		,m_nMinColorDistThreshold(nMinColorDistThreshold)
 		,m_nDescDistThresholdOffset(nDescDistThresholdOffset)
 		,m_nBGSamples(nBGSamples)
 		,m_nRequiredBGSamples(nRequiredBGSamples)
 		,m_nSamplesForMovingAvgs(nSamplesForMovingAvgs)
+		,m_nThreads(nThreads)
+		,m_bLeanPxState(bLeanPxState)
+		,m_nBands(1)
 		,m_fLastNonZeroDescRatio(0.0f)
 		,m_bLearningRateScalingEnabled(true)
 		,m_fCurrLearningRateLowerCap(FEEDBACK_T_LOWER)
 		,m_fCurrLearningRateUpperCap(FEEDBACK_T_UPPER)
 		,m_nMedianBlurKernelSize(m_nDefaultMedianBlurKernelSize)
-		,m_bUse3x3Spread(true) {
+		,m_bUse3x3Spread(true)
+		,m_bUseSIMDKernels(true)
+		,m_nBGSampleRecordSize(0)
+		,m_nBGSampleColorOffset(0)
+		,m_nValidPxCount(0)
+		,m_nRandSeed(RANDENGINE_DEFAULT_SEED)
+		,m_oRandEngine(m_nRandSeed)
+		,m_pDiagnostics(nullptr)
+		,m_nPatchMatchIters(pm_iters)
+		,m_dPatchMatchBudgetMs(0)
+		,m_nPatchMatchRadius(rs_max)
+		,m_nLastPatchMatchIters(0)
+		,m_nLastPatchMatchEvals(0) {
 	CV_Assert(m_nBGSamples>0 && m_nRequiredBGSamples<=m_nBGSamples);
+	CV_Assert(m_nThreads>0);
 	CV_Assert(m_nMinColorDistThreshold>=STAB_COLOR_DIST_OFFSET);
 }
 
-BackgroundSubtractorSuBSENSE::~BackgroundSubtractorSuBSENSE() {
-	if(m_aPxIdxLUT)
-		delete[] m_aPxIdxLUT;
-	if(m_aPxInfoLUT)
-	    delete[] m_aPxInfoLUT;
-}
+BackgroundSubtractorSuBSENSE::~BackgroundSubtractorSuBSENSE() {}
 
 void BackgroundSubtractorSuBSENSE::initialize(const cv::Mat& oInitImg, const cv::Mat& oROI) {
 	// == init
 	CV_Assert(!oInitImg.empty() && oInitImg.cols>0 && oInitImg.rows>0);
 	CV_Assert(oInitImg.isContinuous());
 	CV_Assert(oInitImg.type()==CV_8UC3 || oInitImg.type()==CV_8UC1);
+	m_oRandEngine.seed(m_nRandSeed);
 	if(oInitImg.type()==CV_8UC3) {
 		std::vector<cv::Mat> voInitImgChannels;
 		cv::split(oInitImg,voInitImgChannels);
@@ -119,6 +262,8 @@ void BackgroundSubtractorSuBSENSE::initialize(const cv::Mat& oInitImg, const cv:
 	m_nTotPxCount = m_oImgSize.area();
 	m_nTotRelevantPxCount = nFinalROIPxCount;
 	m_nFrameIndex = 0;
+	// the next patch match starts from scratch
+	m_voPatchNNF.clear();
 	m_nFramesSinceLastReset = 0;
 	m_nModelResetCooldown = 0;
 	m_fLastNonZeroDescRatio = 0.0f;
@@ -140,31 +285,23 @@ void BackgroundSubtractorSuBSENSE::initialize(const cv::Mat& oInitImg, const cv:
 		m_fCurrLearningRateLowerCap = FEEDBACK_T_LOWER*2;
 		m_fCurrLearningRateUpperCap = FEEDBACK_T_UPPER*2;
 	}
-	m_oUpdateRateFrame.create(m_oImgSize,CV_32FC1);
-	m_oUpdateRateFrame = cv::Scalar(m_fCurrLearningRateLowerCap);
-	m_oDistThresholdFrame.create(m_oImgSize,CV_32FC1);
-	m_oDistThresholdFrame = cv::Scalar(1.0f);
-	m_oVariationModulatorFrame.create(m_oImgSize,CV_32FC1);
-	m_oVariationModulatorFrame = cv::Scalar(10.0f); // should always be >= FEEDBACK_V_DECR
-	m_oMeanLastDistFrame.create(m_oImgSize,CV_32FC1);
-	m_oMeanLastDistFrame = cv::Scalar(0.0f);
-	m_oMeanMinDistFrame_LT.create(m_oImgSize,CV_32FC1);
-	m_oMeanMinDistFrame_LT = cv::Scalar(0.0f);
-	m_oMeanMinDistFrame_ST.create(m_oImgSize,CV_32FC1);
-	m_oMeanMinDistFrame_ST = cv::Scalar(0.0f);
+	const int nPxStateType = m_bLeanPxState?CV_16UC(s_nPxStateFields):CV_32FC(s_nPxStateFields);
+	m_oPxStateFrame.create(m_oImgSize,nPxStateType);
+	PxState oInitPxState;
+	oInitPxState.fDistThresholdFactor = 1.0f;
+	oInitPxState.fVariationFactor = 10.0f; // should always be >= FEEDBACK_V_DECR
+	oInitPxState.fLearningRate = m_fCurrLearningRateLowerCap;
+	oInitPxState.fMeanLastDist = 0.0f;
+	oInitPxState.fMeanMinDist_LT = oInitPxState.fMeanMinDist_ST = 0.0f;
+	oInitPxState.fMeanRawSegmRes_LT = oInitPxState.fMeanRawSegmRes_ST = 0.0f;
+	oInitPxState.fMeanFinalSegmRes_LT = oInitPxState.fMeanFinalSegmRes_ST = 0.0f;
+	for(size_t nPxIter=0; nPxIter<m_nTotPxCount; ++nPxIter)
+		storePxState(nPxIter,oInitPxState);
 	m_oDownSampledFrameSize = cv::Size(m_oImgSize.width/FRAMELEVEL_ANALYSIS_DOWNSAMPLE_RATIO,m_oImgSize.height/FRAMELEVEL_ANALYSIS_DOWNSAMPLE_RATIO);
 	m_oMeanDownSampledLastDistFrame_LT.create(m_oDownSampledFrameSize,CV_32FC((int)m_nImgChannels));
 	m_oMeanDownSampledLastDistFrame_LT = cv::Scalar(0.0f);
 	m_oMeanDownSampledLastDistFrame_ST.create(m_oDownSampledFrameSize,CV_32FC((int)m_nImgChannels));
 	m_oMeanDownSampledLastDistFrame_ST = cv::Scalar(0.0f);
-	m_oMeanRawSegmResFrame_LT.create(m_oImgSize,CV_32FC1);
-	m_oMeanRawSegmResFrame_LT = cv::Scalar(0.0f);
-	m_oMeanRawSegmResFrame_ST.create(m_oImgSize,CV_32FC1);
-	m_oMeanRawSegmResFrame_ST = cv::Scalar(0.0f);
-	m_oMeanFinalSegmResFrame_LT.create(m_oImgSize,CV_32FC1);
-	m_oMeanFinalSegmResFrame_LT = cv::Scalar(0.0f);
-	m_oMeanFinalSegmResFrame_ST.create(m_oImgSize,CV_32FC1);
-	m_oMeanFinalSegmResFrame_ST = cv::Scalar(0.0f);
 	m_oUnstableRegionMask.create(m_oImgSize,CV_8UC1);
 	m_oUnstableRegionMask = cv::Scalar_<uchar>(0);
 	m_oBlinksFrame.create(m_oImgSize,CV_8UC1);
@@ -191,35 +328,32 @@ void BackgroundSubtractorSuBSENSE::initialize(const cv::Mat& oInitImg, const cv:
 	m_oCurrRawFGBlinkMask = cv::Scalar_<uchar>(0);
 	m_oLastRawFGBlinkMask.create(m_oImgSize,CV_8UC1);
 	m_oLastRawFGBlinkMask = cv::Scalar_<uchar>(0);
-	m_voBGColorSamples.resize(m_nBGSamples);
-	m_voBGDescSamples.resize(m_nBGSamples);
-	for(size_t s=0; s<m_nBGSamples; ++s) {
-		m_voBGColorSamples[s].create(m_oImgSize,CV_8UC((int)m_nImgChannels));
-		m_voBGColorSamples[s] = cv::Scalar_<uchar>::all(0);
-		m_voBGDescSamples[s].create(m_oImgSize,CV_16UC((int)m_nImgChannels));
-		m_voBGDescSamples[s] = cv::Scalar_<ushort>::all(0);
-	}
-	if(m_aPxIdxLUT)
-		delete[] m_aPxIdxLUT;
-	if(m_aPxInfoLUT)
-	    delete[] m_aPxInfoLUT;
-	m_aPxIdxLUT = new size_t[m_nTotRelevantPxCount];
-	m_aPxInfoLUT = new PxInfoBase[m_nTotPxCount];
+	// both sections are padded to a whole number of prefilter groups so that SIMD loads never leave them
+	m_nBGSampleColorOffset = cv::alignSize(cv::alignSize(m_nBGSamples,L1DIST_MASK_GROUP_SIZE)*m_nImgChannels*2,16);
+	m_nBGSampleRecordSize = cv::alignSize(m_nBGSampleColorOffset+cv::alignSize(m_nBGSamples,L1DIST_MASK_GROUP_SIZE)*m_nImgChannels,16);
+	m_oBGSampleBank.create((int)m_nTotPxCount,(int)m_nBGSampleRecordSize,CV_8UC1);
+	m_oBGSampleBank = cv::Scalar_<uchar>(0);
+	m_oBGColorSumFrame.create(m_oImgSize,CV_32SC((int)m_nImgChannels));
+	m_oBGColorSumFrame = cv::Scalar_<int>::all(0);
+	m_oBGDescSumFrame.create(m_oImgSize,CV_32SC((int)m_nImgChannels));
+	m_oBGDescSumFrame = cv::Scalar_<int>::all(0);
+	computeSpans(m_oROI,m_voROISpans,m_vnROIRowSpanIdxs);
+	m_voValidSpans = m_voROISpans;
+	m_vnValidRowSpanIdxs = m_vnROIRowSpanIdxs;
+	m_nValidPxCount = m_nTotRelevantPxCount;
+	m_oValidBBox = cv::Rect(0,0,m_oImgSize.width,m_oImgSize.height);
 	if(m_nImgChannels==1) {
 		CV_Assert(m_oLastColorFrame.step.p[0]==(size_t)m_oImgSize.width && m_oLastColorFrame.step.p[1]==1);
 		CV_Assert(m_oLastDescFrame.step.p[0]==m_oLastColorFrame.step.p[0]*2 && m_oLastDescFrame.step.p[1]==m_oLastColorFrame.step.p[1]*2);
 		for(size_t t=0; t<=UCHAR_MAX; ++t)
 			m_anLBSPThreshold_8bitLUT[t] = cv::saturate_cast<uchar>((m_nLBSPThresholdOffset+t*m_fRelLBSPThreshold)/3);
-		for(size_t nPxIter=0, nModelIter=0; nPxIter<m_nTotPxCount; ++nPxIter) {
-			if(m_oROI.data[nPxIter]) {
-				m_aPxIdxLUT[nModelIter] = nPxIter;
-				m_aPxInfoLUT[nPxIter].nImgCoord_Y = (int)nPxIter/m_oImgSize.width;
-				m_aPxInfoLUT[nPxIter].nImgCoord_X = (int)nPxIter%m_oImgSize.width;
-				m_aPxInfoLUT[nPxIter].nModelIdx = nModelIter;
+		for(size_t nSpanIter=0; nSpanIter<m_voROISpans.size(); ++nSpanIter) {
+			const PxSpan& oSpan = m_voROISpans[nSpanIter];
+			for(int nCurrImgCoord_X=oSpan.nStartX; nCurrImgCoord_X<oSpan.nEndX; ++nCurrImgCoord_X) {
+				const size_t nPxIter = (size_t)oSpan.nY*m_oImgSize.width+nCurrImgCoord_X;
 				m_oLastColorFrame.data[nPxIter] = oInitImg.data[nPxIter];
 				const size_t nDescIter = nPxIter*2;
-				LBSP::computeGrayscaleDescriptor(oInitImg,oInitImg.data[nPxIter],m_aPxInfoLUT[nPxIter].nImgCoord_X,m_aPxInfoLUT[nPxIter].nImgCoord_Y,m_anLBSPThreshold_8bitLUT[oInitImg.data[nPxIter]],*((ushort*)(m_oLastDescFrame.data+nDescIter)));
-				++nModelIter;
+				LBSP::computeGrayscaleDescriptor(oInitImg,oInitImg.data[nPxIter],nCurrImgCoord_X,oSpan.nY,m_anLBSPThreshold_8bitLUT[oInitImg.data[nPxIter]],*((ushort*)(m_oLastDescFrame.data+nDescIter)));
 			}
 		}
 	}
@@ -228,62 +362,73 @@ void BackgroundSubtractorSuBSENSE::initialize(const cv::Mat& oInitImg, const cv:
 		CV_Assert(m_oLastDescFrame.step.p[0]==m_oLastColorFrame.step.p[0]*2 && m_oLastDescFrame.step.p[1]==m_oLastColorFrame.step.p[1]*2);
 		for(size_t t=0; t<=UCHAR_MAX; ++t)
 			m_anLBSPThreshold_8bitLUT[t] = cv::saturate_cast<uchar>(m_nLBSPThresholdOffset+t*m_fRelLBSPThreshold);
-		for(size_t nPxIter=0, nModelIter=0; nPxIter<m_nTotPxCount; ++nPxIter) {
-			if(m_oROI.data[nPxIter]) {
-				m_aPxIdxLUT[nModelIter] = nPxIter;
-				m_aPxInfoLUT[nPxIter].nImgCoord_Y = (int)nPxIter/m_oImgSize.width;
-				m_aPxInfoLUT[nPxIter].nImgCoord_X = (int)nPxIter%m_oImgSize.width;
-				m_aPxInfoLUT[nPxIter].nModelIdx = nModelIter;
+		for(size_t nSpanIter=0; nSpanIter<m_voROISpans.size(); ++nSpanIter) {
+			const PxSpan& oSpan = m_voROISpans[nSpanIter];
+			for(int nCurrImgCoord_X=oSpan.nStartX; nCurrImgCoord_X<oSpan.nEndX; ++nCurrImgCoord_X) {
+				const size_t nPxIter = (size_t)oSpan.nY*m_oImgSize.width+nCurrImgCoord_X;
 				const size_t nPxRGBIter = nPxIter*3;
 				const size_t nDescRGBIter = nPxRGBIter*2;
 				for(size_t c=0; c<3; ++c) {
 					m_oLastColorFrame.data[nPxRGBIter+c] = oInitImg.data[nPxRGBIter+c];
-					LBSP::computeSingleRGBDescriptor(oInitImg,oInitImg.data[nPxRGBIter+c],m_aPxInfoLUT[nPxIter].nImgCoord_X,m_aPxInfoLUT[nPxIter].nImgCoord_Y,c,m_anLBSPThreshold_8bitLUT[oInitImg.data[nPxRGBIter+c]],((ushort*)(m_oLastDescFrame.data+nDescRGBIter))[c]);
+					LBSP::computeSingleRGBDescriptor(oInitImg,oInitImg.data[nPxRGBIter+c],nCurrImgCoord_X,oSpan.nY,c,m_anLBSPThreshold_8bitLUT[oInitImg.data[nPxRGBIter+c]],((ushort*)(m_oLastDescFrame.data+nDescRGBIter))[c]);
 				}
-				++nModelIter;
 			}
 		}
 	}
+	initBands();
 	m_bInitialized = true;
 	refreshModel(1.0f);
 }
 
+void BackgroundSubtractorSuBSENSE::initBands() {
+	// two bands per thread (one per processing phase), each at least LBSP::PATCH_SIZE rows high
+	const size_t nMaxBands = std::max((size_t)m_oImgSize.height/LBSP::PATCH_SIZE,(size_t)1);
+	m_nBands = std::min(m_nThreads>1?m_nThreads*2:1,nMaxBands);
+	m_vnBandRowBounds.resize(m_nBands+1);
+	for(size_t b=0; b<=m_nBands; ++b)
+		m_vnBandRowBounds[b] = (int)(b*m_oImgSize.height/m_nBands);
+}
+
 void BackgroundSubtractorSuBSENSE::refreshModel(float fSamplesRefreshFrac, bool bForceFGUpdate) {
 	// == refresh
 	CV_Assert(m_bInitialized);
 	CV_Assert(fSamplesRefreshFrac>0.0f && fSamplesRefreshFrac<=1.0f);
 	const size_t nModelsToRefresh = fSamplesRefreshFrac<1.0f?(size_t)(fSamplesRefreshFrac*m_nBGSamples):m_nBGSamples;
-	const size_t nRefreshStartPos = fSamplesRefreshFrac<1.0f?rand()%m_nBGSamples:0;
+	const size_t nRefreshStartPos = fSamplesRefreshFrac<1.0f?m_oRandEngine((unsigned)m_nBGSamples):0;
 	if(m_nImgChannels==1) {
-		for(size_t nModelIter=0; nModelIter<m_nTotRelevantPxCount; ++nModelIter) {
-			const size_t nPxIter = m_aPxIdxLUT[nModelIter];
-			if(bForceFGUpdate || !m_oLastFGMask.data[nPxIter]) {
-				for(size_t nCurrModelIdx=nRefreshStartPos; nCurrModelIdx<nRefreshStartPos+nModelsToRefresh; ++nCurrModelIdx) {
-					int nSampleImgCoord_Y, nSampleImgCoord_X;
-					getRandSamplePosition(nSampleImgCoord_X,nSampleImgCoord_Y,m_aPxInfoLUT[nPxIter].nImgCoord_X,m_aPxInfoLUT[nPxIter].nImgCoord_Y,LBSP::PATCH_SIZE/2,m_oImgSize);
-					const size_t nSamplePxIdx = m_oImgSize.width*nSampleImgCoord_Y + nSampleImgCoord_X;
-					if(bForceFGUpdate || !m_oLastFGMask.data[nSamplePxIdx]) {
-						const size_t nCurrRealModelIdx = nCurrModelIdx%m_nBGSamples;
-						m_voBGColorSamples[nCurrRealModelIdx].data[nPxIter] = m_oLastColorFrame.data[nSamplePxIdx];
-						*((ushort*)(m_voBGDescSamples[nCurrRealModelIdx].data+nPxIter*2)) = *((ushort*)(m_oLastDescFrame.data+nSamplePxIdx*2));
+		for(size_t nSpanIter=0; nSpanIter<m_voROISpans.size(); ++nSpanIter) {
+			const PxSpan& oSpan = m_voROISpans[nSpanIter];
+			for(int nCurrImgCoord_X=oSpan.nStartX; nCurrImgCoord_X<oSpan.nEndX; ++nCurrImgCoord_X) {
+				const size_t nPxIter = (size_t)oSpan.nY*m_oImgSize.width+nCurrImgCoord_X;
+				if(bForceFGUpdate || !m_oLastFGMask.data[nPxIter]) {
+					for(size_t nCurrModelIdx=nRefreshStartPos; nCurrModelIdx<nRefreshStartPos+nModelsToRefresh; ++nCurrModelIdx) {
+						int nSampleImgCoord_Y, nSampleImgCoord_X;
+						getRandSamplePosition(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,oSpan.nY,LBSP::PATCH_SIZE/2,m_oImgSize,m_oRandEngine);
+						const size_t nSamplePxIdx = m_oImgSize.width*nSampleImgCoord_Y + nSampleImgCoord_X;
+						if(bForceFGUpdate || !m_oLastFGMask.data[nSamplePxIdx]) {
+							const size_t nCurrRealModelIdx = nCurrModelIdx%m_nBGSamples;
+							setBGSample(nPxIter,nCurrRealModelIdx,0,m_oLastColorFrame.data[nSamplePxIdx],*((ushort*)(m_oLastDescFrame.data+nSamplePxIdx*2)));
+						}
 					}
 				}
 			}
 		}
 	}
 	else { //m_nImgChannels==3
-		for(size_t nModelIter=0; nModelIter<m_nTotRelevantPxCount; ++nModelIter) {
-			const size_t nPxIter = m_aPxIdxLUT[nModelIter];
-			if(bForceFGUpdate || !m_oLastFGMask.data[nPxIter]) {
-				for(size_t nCurrModelIdx=nRefreshStartPos; nCurrModelIdx<nRefreshStartPos+nModelsToRefresh; ++nCurrModelIdx) {
-					int nSampleImgCoord_Y, nSampleImgCoord_X;
-					getRandSamplePosition(nSampleImgCoord_X,nSampleImgCoord_Y,m_aPxInfoLUT[nPxIter].nImgCoord_X,m_aPxInfoLUT[nPxIter].nImgCoord_Y,LBSP::PATCH_SIZE/2,m_oImgSize);
-					const size_t nSamplePxIdx = m_oImgSize.width*nSampleImgCoord_Y + nSampleImgCoord_X;
-					if(bForceFGUpdate || !m_oLastFGMask.data[nSamplePxIdx]) {
-						const size_t nCurrRealModelIdx = nCurrModelIdx%m_nBGSamples;
-						for(size_t c=0; c<3; ++c) {
-							m_voBGColorSamples[nCurrRealModelIdx].data[nPxIter*3+c] = m_oLastColorFrame.data[nSamplePxIdx*3+c];
-							*((ushort*)(m_voBGDescSamples[nCurrRealModelIdx].data+(nPxIter*3+c)*2)) = *((ushort*)(m_oLastDescFrame.data+(nSamplePxIdx*3+c)*2));
+		for(size_t nSpanIter=0; nSpanIter<m_voROISpans.size(); ++nSpanIter) {
+			const PxSpan& oSpan = m_voROISpans[nSpanIter];
+			for(int nCurrImgCoord_X=oSpan.nStartX; nCurrImgCoord_X<oSpan.nEndX; ++nCurrImgCoord_X) {
+				const size_t nPxIter = (size_t)oSpan.nY*m_oImgSize.width+nCurrImgCoord_X;
+				if(bForceFGUpdate || !m_oLastFGMask.data[nPxIter]) {
+					for(size_t nCurrModelIdx=nRefreshStartPos; nCurrModelIdx<nRefreshStartPos+nModelsToRefresh; ++nCurrModelIdx) {
+						int nSampleImgCoord_Y, nSampleImgCoord_X;
+						getRandSamplePosition(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,oSpan.nY,LBSP::PATCH_SIZE/2,m_oImgSize,m_oRandEngine);
+						const size_t nSamplePxIdx = m_oImgSize.width*nSampleImgCoord_Y + nSampleImgCoord_X;
+						if(bForceFGUpdate || !m_oLastFGMask.data[nSamplePxIdx]) {
+							const size_t nCurrRealModelIdx = nCurrModelIdx%m_nBGSamples;
+							for(size_t c=0; c<3; ++c) {
+								setBGSample(nPxIter,nCurrRealModelIdx,c,m_oLastColorFrame.data[nSamplePxIdx*3+c],*((ushort*)(m_oLastDescFrame.data+(nSamplePxIdx*3+c)*2)));
+							}
 						}
 					}
 				}
@@ -292,6 +437,137 @@ void BackgroundSubtractorSuBSENSE::refreshModel(float fSamplesRefreshFrac, bool
 	}
 }
 
+class BackgroundSubtractorSuBSENSE::ParallelBandInvoker : public cv::ParallelLoopBody {
+public:
+	ParallelBandInvoker(BackgroundSubtractorSuBSENSE& oBGS, FrameContext& oCtx, size_t nPhase)
+		:	 m_oBGS(oBGS)
+			,m_oCtx(oCtx)
+			,m_nPhase(nPhase) {}
+	virtual void operator()(const cv::Range& oRange) const {
+		for(int r=oRange.start; r<oRange.end; ++r) {
+			const size_t nBandIdx = m_nPhase+(size_t)r*2;
+			(m_oBGS.*m_oCtx.pBandKernel)(m_oCtx,nBandIdx);
+		}
+	}
+private:
+	BackgroundSubtractorSuBSENSE& m_oBGS;
+	FrameContext& m_oCtx;
+	const size_t m_nPhase;
+};
+
+class BackgroundSubtractorSuBSENSE::ParallelReinitInvoker : public cv::ParallelLoopBody {
+public:
+	ParallelReinitInvoker(BackgroundSubtractorSuBSENSE& oBGS, const cv::Mat& oImg, const std::vector<PxSpan>& voSpans, size_t nPass)
+		:	 m_oBGS(oBGS)
+			,m_oImg(oImg)
+			,m_voSpans(voSpans)
+			,m_nPass(nPass) {}
+	virtual void operator()(const cv::Range& oRange) const {
+		for(int r=oRange.start; r<oRange.end; ++r) {
+			if(m_nPass==0)
+				m_oBGS.reinitExposedPxDesc(m_oImg,m_voSpans[r]);
+			else
+				m_oBGS.reinitExposedPxSamples(m_voSpans[r],(size_t)r);
+		}
+	}
+private:
+	BackgroundSubtractorSuBSENSE& m_oBGS;
+	const cv::Mat& m_oImg;
+	const std::vector<PxSpan>& m_voSpans;
+	const size_t m_nPass;
+};
+
+class BackgroundSubtractorSuBSENSE::ParallelWarpInvoker : public cv::ParallelLoopBody {
+public:
+	ParallelWarpInvoker(const BackgroundSubtractorSuBSENSE& oBGS, const double* adInvTransform, cv::Mat* const* apPlanes, cv::Mat* aoBuffers, const size_t* anRecordSizes, size_t nPlanes)
+		:	 m_oBGS(oBGS)
+			,m_adInvTransform(adInvTransform)
+			,m_apPlanes(apPlanes)
+			,m_aoBuffers(aoBuffers)
+			,m_anRecordSizes(anRecordSizes)
+			,m_nPlanes(nPlanes) {}
+	virtual void operator()(const cv::Range& oRange) const {
+		const double* const h = m_adInvTransform;
+		const int nWidth = m_oBGS.m_oImgSize.width, nHeight = m_oBGS.m_oImgSize.height;
+		if(isIntegerShift(h)) {
+			// pure integer shifts move whole row segments, without any per-pixel mapping
+			const int nShiftX = (int)h[2], nShiftY = (int)h[5];
+			const int nDstStartX = std::max(-nShiftX,0), nDstEndX = std::min(nWidth-nShiftX,nWidth);
+			for(int y=oRange.start; y<oRange.end; ++y) {
+				const int nSrcY = y+nShiftY;
+				const bool bValidRow = nSrcY>=0 && nSrcY<nHeight && nDstStartX<nDstEndX;
+				for(size_t n=0; n<m_nPlanes; ++n) {
+					const size_t nRecordSize = m_anRecordSizes[n];
+					uchar* const pDstRow = m_aoBuffers[n].data+(size_t)y*nWidth*nRecordSize;
+					if(!bValidRow) {
+						memset(pDstRow,0,nWidth*nRecordSize);
+						continue;
+					}
+					memset(pDstRow,0,nDstStartX*nRecordSize);
+					memcpy(pDstRow+nDstStartX*nRecordSize,m_apPlanes[n]->data+((size_t)nSrcY*nWidth+nDstStartX+nShiftX)*nRecordSize,(nDstEndX-nDstStartX)*nRecordSize);
+					memset(pDstRow+nDstEndX*nRecordSize,0,(nWidth-nDstEndX)*nRecordSize);
+				}
+			}
+			return;
+		}
+		const bool bAffine = isAffine(h);
+		for(int y=oRange.start; y<oRange.end; ++y) {
+			// the mapping is computed once per pixel for all planes, with row increments instead of full products
+			double dSrcX = h[1]*y+h[2], dSrcY = h[4]*y+h[5], dSrcW = h[7]*y+h[8];
+			for(int x=0; x<nWidth; ++x, dSrcX+=h[0], dSrcY+=h[3], dSrcW+=h[6]) {
+				const size_t nDstPxIdx = (size_t)y*nWidth+x;
+				const int nSrcX = bAffine?cvRound(dSrcX):dSrcW?cvRound(dSrcX/dSrcW):-1;
+				const int nSrcY = bAffine?cvRound(dSrcY):dSrcW?cvRound(dSrcY/dSrcW):-1;
+				if(nSrcX>=0 && nSrcX<nWidth && nSrcY>=0 && nSrcY<nHeight) {
+					const size_t nSrcPxIdx = (size_t)nSrcY*nWidth+nSrcX;
+					for(size_t n=0; n<m_nPlanes; ++n)
+						memcpy(m_aoBuffers[n].data+nDstPxIdx*m_anRecordSizes[n],m_apPlanes[n]->data+nSrcPxIdx*m_anRecordSizes[n],m_anRecordSizes[n]);
+				}
+				else {
+					for(size_t n=0; n<m_nPlanes; ++n)
+						memset(m_aoBuffers[n].data+nDstPxIdx*m_anRecordSizes[n],0,m_anRecordSizes[n]);
+				}
+			}
+		}
+	}
+private:
+	const BackgroundSubtractorSuBSENSE& m_oBGS;
+	const double* const m_adInvTransform;
+	cv::Mat* const* const m_apPlanes;
+	cv::Mat* const m_aoBuffers;
+	const size_t* const m_anRecordSizes;
+	const size_t m_nPlanes;
+};
+
+template<bool bLeanPxState, bool bUse3x3Spread, bool bLearningRateOverride>
+BackgroundSubtractorSuBSENSE::BandKernel BackgroundSubtractorSuBSENSE::getBandKernel() const {
+	// the default sample counts get their own instantiations; any other configuration uses the runtime-count kernels
+	const bool bDefaultSampleCounts = (m_nBGSamples==BGSSUBSENSE_DEFAULT_NB_BG_SAMPLES && m_nRequiredBGSamples==BGSSUBSENSE_DEFAULT_REQUIRED_NB_BG_SAMPLES);
+	if(m_nImgChannels==1)
+		return bDefaultSampleCounts?
+			&BackgroundSubtractorSuBSENSE::processBand1ch<bLeanPxState,bUse3x3Spread,bLearningRateOverride,BGSSUBSENSE_DEFAULT_NB_BG_SAMPLES,BGSSUBSENSE_DEFAULT_REQUIRED_NB_BG_SAMPLES>:
+			&BackgroundSubtractorSuBSENSE::processBand1ch<bLeanPxState,bUse3x3Spread,bLearningRateOverride,0,0>;
+	else //m_nImgChannels==3
+		return bDefaultSampleCounts?
+			&BackgroundSubtractorSuBSENSE::processBand3ch<bLeanPxState,bUse3x3Spread,bLearningRateOverride,BGSSUBSENSE_DEFAULT_NB_BG_SAMPLES,BGSSUBSENSE_DEFAULT_REQUIRED_NB_BG_SAMPLES>:
+			&BackgroundSubtractorSuBSENSE::processBand3ch<bLeanPxState,bUse3x3Spread,bLearningRateOverride,0,0>;
+}
+
+BackgroundSubtractorSuBSENSE::BandKernel BackgroundSubtractorSuBSENSE::getBandKernel(bool bLearningRateOverride) const {
+	if(m_bLeanPxState) {
+		if(m_bUse3x3Spread)
+			return bLearningRateOverride?getBandKernel<true,true,true>():getBandKernel<true,true,false>();
+		else
+			return bLearningRateOverride?getBandKernel<true,false,true>():getBandKernel<true,false,false>();
+	}
+	else {
+		if(m_bUse3x3Spread)
+			return bLearningRateOverride?getBandKernel<false,true,true>():getBandKernel<false,true,false>();
+		else
+			return bLearningRateOverride?getBandKernel<false,false,true>():getBandKernel<false,false,false>();
+	}
+}
+
 void BackgroundSubtractorSuBSENSE::operator()(cv::InputArray _image, cv::OutputArray _fgmask, double learningRateOverride) {
 	// == process
 	CV_Assert(m_bInitialized);
@@ -301,80 +577,251 @@ void BackgroundSubtractorSuBSENSE::operator()(cv::InputArray _image, cv::OutputA
 	_fgmask.create(m_oImgSize,CV_8UC1);
 	cv::Mat oCurrFGMask = _fgmask.getMat();
 	memset(oCurrFGMask.data,0,oCurrFGMask.cols*oCurrFGMask.rows);
-	size_t nNonZeroDescCount = 0;
 	const float fRollAvgFactor_LT = 1.0f/std::min(++m_nFrameIndex,m_nSamplesForMovingAvgs);
 	const float fRollAvgFactor_ST = 1.0f/std::min(m_nFrameIndex,m_nSamplesForMovingAvgs/4);
-	if(m_nImgChannels==1) {
-		for(size_t nModelIter=0; nModelIter<m_nTotRelevantPxCount; ++nModelIter) {
-			const size_t nPxIter = m_aPxIdxLUT[nModelIter];
+	FrameContext oCtx;
+	oCtx.oInputImg = oInputImg;
+	oCtx.oCurrFGMask = oCurrFGMask;
+	oCtx.fRollAvgFactor_LT = fRollAvgFactor_LT;
+	oCtx.fRollAvgFactor_ST = fRollAvgFactor_ST;
+	oCtx.dLearningRateOverride = learningRateOverride;
+	oCtx.pBandKernel = getBandKernel(learningRateOverride>0);
+	oCtx.vnNonZeroDescCount.assign(m_nBands,0);
+	// even bands are processed first, then odd bands; bands processed concurrently are thus always separated by a
+	// whole band (at least LBSP::PATCH_SIZE rows), so their neighbor-spread model writes (up to 2 rows away) never overlap
+	for(size_t nPhase=0; nPhase<2; ++nPhase) {
+		const int nPhaseBands = (int)((m_nBands+1-nPhase)/2);
+		if(nPhaseBands>0)
+			cv::parallel_for_(cv::Range(0,nPhaseBands),ParallelBandInvoker(*this,oCtx,nPhase),nPhaseBands);
+	}
+	size_t nNonZeroDescCount = 0;
+	for(size_t b=0; b<m_nBands; ++b)
+		nNonZeroDescCount += oCtx.vnNonZeroDescCount[b];
+#if DISPLAY_SUBSENSE_DEBUG_INFO
+	std::cout << std::endl;
+	cv::Point dbgpt(nDebugCoordX,nDebugCoordY);
+	PxState oDbgPxState;
+	loadPxState(dbgpt.y*m_oImgSize.width+dbgpt.x,oDbgPxState);
+	cv::Mat oMeanMinDistFrameNormalized; oMeanMinDistFrameNormalized = getPxStatePlane(offsetof(PxState,fMeanMinDist_ST));
+	cv::circle(oMeanMinDistFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
+	cv::resize(oMeanMinDistFrameNormalized,oMeanMinDistFrameNormalized,DEFAULT_FRAME_SIZE);
+	cv::imshow("d_min(x)",oMeanMinDistFrameNormalized);
+	std::cout << std::fixed << std::setprecision(5) << "  d_min(" << dbgpt << ") = " << oDbgPxState.fMeanMinDist_ST << std::endl;
+	cv::Mat oMeanLastDistFrameNormalized; oMeanLastDistFrameNormalized = getPxStatePlane(offsetof(PxState,fMeanLastDist));
+	cv::circle(oMeanLastDistFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
+	cv::resize(oMeanLastDistFrameNormalized,oMeanLastDistFrameNormalized,DEFAULT_FRAME_SIZE);
+	cv::imshow("d_last(x)",oMeanLastDistFrameNormalized);
+	std::cout << std::fixed << std::setprecision(5) << " d_last(" << dbgpt << ") = " << oDbgPxState.fMeanLastDist << std::endl;
+	cv::Mat oMeanRawSegmResFrameNormalized; oMeanRawSegmResFrameNormalized = getPxStatePlane(offsetof(PxState,fMeanRawSegmRes_ST));
+	cv::circle(oMeanRawSegmResFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
+	cv::resize(oMeanRawSegmResFrameNormalized,oMeanRawSegmResFrameNormalized,DEFAULT_FRAME_SIZE);
+	cv::imshow("s_avg(x)",oMeanRawSegmResFrameNormalized);
+	std::cout << std::fixed << std::setprecision(5) << "  s_avg(" << dbgpt << ") = " << oDbgPxState.fMeanRawSegmRes_ST << std::endl;
+	cv::Mat oMeanFinalSegmResFrameNormalized; oMeanFinalSegmResFrameNormalized = getPxStatePlane(offsetof(PxState,fMeanFinalSegmRes_ST));
+	cv::circle(oMeanFinalSegmResFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
+	cv::resize(oMeanFinalSegmResFrameNormalized,oMeanFinalSegmResFrameNormalized,DEFAULT_FRAME_SIZE);
+	cv::imshow("z_avg(x)",oMeanFinalSegmResFrameNormalized);
+	std::cout << std::fixed << std::setprecision(5) << "  z_avg(" << dbgpt << ") = " << oDbgPxState.fMeanFinalSegmRes_ST << std::endl;
+	cv::Mat oDistThresholdFrameNormalized; getPxStatePlane(offsetof(PxState,fDistThresholdFactor)).convertTo(oDistThresholdFrameNormalized,CV_32FC1,0.25f,-0.25f);
+	cv::circle(oDistThresholdFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
+	cv::resize(oDistThresholdFrameNormalized,oDistThresholdFrameNormalized,DEFAULT_FRAME_SIZE);
+	cv::imshow("r(x)",oDistThresholdFrameNormalized);
+	std::cout << std::fixed << std::setprecision(5) << "      r(" << dbgpt << ") = " << oDbgPxState.fDistThresholdFactor << std::endl;
+	cv::Mat oVariationModulatorFrameNormalized; cv::normalize(getPxStatePlane(offsetof(PxState,fVariationFactor)),oVariationModulatorFrameNormalized,0,255,cv::NORM_MINMAX,CV_8UC1);
+	cv::circle(oVariationModulatorFrameNormalized,dbgpt,5,cv::Scalar(255));
+	cv::resize(oVariationModulatorFrameNormalized,oVariationModulatorFrameNormalized,DEFAULT_FRAME_SIZE);
+	cv::imshow("v(x)",oVariationModulatorFrameNormalized);
+	std::cout << std::fixed << std::setprecision(5) << "      v(" << dbgpt << ") = " << oDbgPxState.fVariationFactor << std::endl;
+	cv::Mat oUpdateRateFrameNormalized; getPxStatePlane(offsetof(PxState,fLearningRate)).convertTo(oUpdateRateFrameNormalized,CV_32FC1,1.0f/FEEDBACK_T_UPPER,-FEEDBACK_T_LOWER/FEEDBACK_T_UPPER);
+	cv::circle(oUpdateRateFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
+	cv::resize(oUpdateRateFrameNormalized,oUpdateRateFrameNormalized,DEFAULT_FRAME_SIZE);
+	cv::imshow("t(x)",oUpdateRateFrameNormalized);
+	std::cout << std::fixed << std::setprecision(5) << "      t(" << dbgpt << ") = " << oDbgPxState.fLearningRate << std::endl;
+#endif //DISPLAY_SUBSENSE_DEBUG_INFO
+	// blink masks are only refreshed around the analyzed region (the rest of the model is left untouched)
+	cv::Mat oCurrFGMaskWin = oCurrFGMask(m_oValidBBox), oLastRawFGMaskWin = m_oLastRawFGMask(m_oValidBBox), oBlinksFrameWin = m_oBlinksFrame(m_oValidBBox);
+	cv::Mat oCurrRawFGBlinkMaskWin = m_oCurrRawFGBlinkMask(m_oValidBBox), oLastRawFGBlinkMaskWin = m_oLastRawFGBlinkMask(m_oValidBBox);
+	cv::bitwise_xor(oCurrFGMaskWin,oLastRawFGMaskWin,oCurrRawFGBlinkMaskWin);
+	cv::bitwise_or(oCurrRawFGBlinkMaskWin,oLastRawFGBlinkMaskWin,oBlinksFrameWin);
+	oCurrRawFGBlinkMaskWin.copyTo(oLastRawFGBlinkMaskWin);
+	oCurrFGMaskWin.copyTo(oLastRawFGMaskWin);
+	// complete
+	for(size_t nSpanIter=0; nSpanIter<m_voValidSpans.size(); ++nSpanIter) {
+		const PxSpan& oSpan = m_voValidSpans[nSpanIter];
+		for(size_t nPxIter=(size_t)oSpan.nY*m_oImgSize.width+oSpan.nStartX, nPxEnd=(size_t)oSpan.nY*m_oImgSize.width+oSpan.nEndX; nPxIter<nPxEnd; ++nPxIter) {
+			PxState oPxState;
+			loadPxState(nPxIter,oPxState);
+			const float fLastFG = m_oLastFGMask.data[nPxIter]?1.0f:0.0f;
+			oPxState.fMeanFinalSegmRes_LT = oPxState.fMeanFinalSegmRes_LT*(1.0f-fRollAvgFactor_LT) + fLastFG*fRollAvgFactor_LT;
+			oPxState.fMeanFinalSegmRes_ST = oPxState.fMeanFinalSegmRes_ST*(1.0f-fRollAvgFactor_ST) + fLastFG*fRollAvgFactor_ST;
+			storePxState(nPxIter,oPxState);
+		}
+	}
+	const float fCurrNonZeroDescRatio = m_nValidPxCount?(float)nNonZeroDescCount/m_nValidPxCount:0.0f;
+	if(fCurrNonZeroDescRatio<LBSPDESC_NONZERO_RATIO_MIN && m_fLastNonZeroDescRatio<LBSPDESC_NONZERO_RATIO_MIN) {
+	    for(size_t t=0; t<=UCHAR_MAX; ++t)
+	        if(m_anLBSPThreshold_8bitLUT[t]>cv::saturate_cast<uchar>(m_nLBSPThresholdOffset+ceil(t*m_fRelLBSPThreshold/4)))
+	            --m_anLBSPThreshold_8bitLUT[t];
+	}
+	else if(fCurrNonZeroDescRatio>LBSPDESC_NONZERO_RATIO_MAX && m_fLastNonZeroDescRatio>LBSPDESC_NONZERO_RATIO_MAX) {
+	    for(size_t t=0; t<=UCHAR_MAX; ++t)
+	        if(m_anLBSPThreshold_8bitLUT[t]<cv::saturate_cast<uchar>(m_nLBSPThresholdOffset+UCHAR_MAX*m_fRelLBSPThreshold))
+	            ++m_anLBSPThreshold_8bitLUT[t];
+	}
+	m_fLastNonZeroDescRatio = fCurrNonZeroDescRatio;
+	if(m_bLearningRateScalingEnabled) {
+		cv::resize(oInputImg,m_oDownSampledFrame_MotionAnalysis,m_oDownSampledFrameSize,0,0,cv::INTER_AREA);
+		cv::accumulateWeighted(m_oDownSampledFrame_MotionAnalysis,m_oMeanDownSampledLastDistFrame_LT,fRollAvgFactor_LT);
+		cv::accumulateWeighted(m_oDownSampledFrame_MotionAnalysis,m_oMeanDownSampledLastDistFrame_ST,fRollAvgFactor_ST);
+		size_t nTotColorDiff = 0;
+		for(int i=0; i<m_oMeanDownSampledLastDistFrame_ST.rows; ++i) {
+			const size_t idx1 = m_oMeanDownSampledLastDistFrame_ST.step.p[0]*i;
+			for(int j=0; j<m_oMeanDownSampledLastDistFrame_ST.cols; ++j) {
+				const size_t idx2 = idx1+m_oMeanDownSampledLastDistFrame_ST.step.p[1]*j;
+				nTotColorDiff += (m_nImgChannels==1)?
+					(size_t)fabs((*(float*)(m_oMeanDownSampledLastDistFrame_ST.data+idx2))-(*(float*)(m_oMeanDownSampledLastDistFrame_LT.data+idx2)))/2
+							:  //(m_nImgChannels==3)
+						std::max((size_t)fabs((*(float*)(m_oMeanDownSampledLastDistFrame_ST.data+idx2))-(*(float*)(m_oMeanDownSampledLastDistFrame_LT.data+idx2))),
+							std::max((size_t)fabs((*(float*)(m_oMeanDownSampledLastDistFrame_ST.data+idx2+4))-(*(float*)(m_oMeanDownSampledLastDistFrame_LT.data+idx2+4))),
+										(size_t)fabs((*(float*)(m_oMeanDownSampledLastDistFrame_ST.data+idx2+8))-(*(float*)(m_oMeanDownSampledLastDistFrame_LT.data+idx2+8)))));
+			}
+		}
+		const float fCurrColorDiffRatio = (float)nTotColorDiff/(m_oMeanDownSampledLastDistFrame_ST.rows*m_oMeanDownSampledLastDistFrame_ST.cols);
+		if(m_bAutoModelResetEnabled) {
+			if(m_nFramesSinceLastReset>1000)
+				m_bAutoModelResetEnabled = false;
+			else if(fCurrColorDiffRatio>=FRAMELEVEL_MIN_COLOR_DIFF_THRESHOLD && m_nModelResetCooldown==0) {
+				m_nFramesSinceLastReset = 0;
+				refreshModel(0.1f); // reset 10% of the bg model
+				m_nModelResetCooldown = m_nSamplesForMovingAvgs/4;
+				for(size_t nPxIter=0; nPxIter<m_nTotPxCount; ++nPxIter) {
+					PxState oPxState;
+					loadPxState(nPxIter,oPxState);
+					oPxState.fLearningRate = 1.0f;
+					storePxState(nPxIter,oPxState);
+				}
+			}
+			else
+				++m_nFramesSinceLastReset;
+		}
+		else if(fCurrColorDiffRatio>=FRAMELEVEL_MIN_COLOR_DIFF_THRESHOLD*2) {
+			m_nFramesSinceLastReset = 0;
+			m_bAutoModelResetEnabled = true;
+		}
+		if(fCurrColorDiffRatio>=FRAMELEVEL_MIN_COLOR_DIFF_THRESHOLD/2) {
+			m_fCurrLearningRateLowerCap = (float)std::max((int)FEEDBACK_T_LOWER>>(int)(fCurrColorDiffRatio/2),1);
+			m_fCurrLearningRateUpperCap = (float)std::max((int)FEEDBACK_T_UPPER>>(int)(fCurrColorDiffRatio/2),1);
+		}
+		else {
+			m_fCurrLearningRateLowerCap = FEEDBACK_T_LOWER;
+			m_fCurrLearningRateUpperCap = FEEDBACK_T_UPPER;
+		}
+		if(m_nModelResetCooldown>0)
+			--m_nModelResetCooldown;
+	}
+}
+
+template<bool bLeanPxState, bool bUse3x3Spread, bool bLearningRateOverride, size_t nBGSamplesT, size_t nRequiredBGSamplesT>
+void BackgroundSubtractorSuBSENSE::processBand1ch(FrameContext& oCtx, size_t nBandIdx) {
+	CV_DbgAssert(nBandIdx<m_nBands);
+	// compile-time sample counts let the compiler unroll the sample group loop; 0 falls back to the runtime values
+	const size_t nBGSamples = nBGSamplesT?nBGSamplesT:m_nBGSamples;
+	const size_t nRequiredBGSamples = nRequiredBGSamplesT?nRequiredBGSamplesT:m_nRequiredBGSamples;
+	CV_DbgAssert(nBGSamples==m_nBGSamples && nRequiredBGSamples==m_nRequiredBGSamples);
+	const cv::Mat& oInputImg = oCtx.oInputImg;
+	cv::Mat& oCurrFGMask = oCtx.oCurrFGMask;
+	const float fRollAvgFactor_LT = oCtx.fRollAvgFactor_LT;
+	const float fRollAvgFactor_ST = oCtx.fRollAvgFactor_ST;
+	const double dLearningRateOverride = oCtx.dLearningRateOverride;
+	// the valid spans are ordered by row, so a band is a contiguous range of spans
+	const size_t nBandSpanIdxStart = m_vnValidRowSpanIdxs[m_vnBandRowBounds[nBandIdx]];
+	const size_t nBandSpanIdxEnd = m_vnValidRowSpanIdxs[m_vnBandRowBounds[nBandIdx+1]];
+	const bool bUseSIMDKernels = m_bUseSIMDKernels;
+	// lean mode: R(x) is stored with stochastic rounding (see PxStateLean), dithered per pixel & frame
+	const uint64 nDitherSeed = getFrameSeed(0x2545F4914F6CDD1DULL);
+	// each band gets its own generator, seeded from the frame & band indexes, so that results only depend on the band layout
+	RandEngine oRandEngine(getFrameSeed(),nBandIdx);
+	size_t nNonZeroDescCount = 0;
+	for(size_t nSpanIter=nBandSpanIdxStart; nSpanIter<nBandSpanIdxEnd; ++nSpanIter) {
+		const PxSpan& oSpan = m_voValidSpans[nSpanIter];
+		const int nCurrImgCoord_Y = oSpan.nY;
+		for(int nCurrImgCoord_X=oSpan.nStartX; nCurrImgCoord_X<oSpan.nEndX; ++nCurrImgCoord_X) {
+			const size_t nPxIter = (size_t)nCurrImgCoord_Y*m_oImgSize.width+nCurrImgCoord_X;
 			const uchar nCurrColor = oInputImg.data[nPxIter];
-			
-			// avoid empty pixel after transform
-			if (nCurrColor == 0) continue;
-			
 			const size_t nDescIter = nPxIter*2;
-			const size_t nFloatIter = nPxIter*4;
-			const int nCurrImgCoord_X = m_aPxInfoLUT[nPxIter].nImgCoord_X;
-			const int nCurrImgCoord_Y = m_aPxInfoLUT[nPxIter].nImgCoord_Y;
 			size_t nMinDescDist = s_nDescMaxDataRange_1ch;
 			size_t nMinSumDist = s_nColorMaxDataRange_1ch;
-			float* pfCurrDistThresholdFactor = (float*)(m_oDistThresholdFrame.data+nFloatIter);
-			float* pfCurrVariationFactor = (float*)(m_oVariationModulatorFrame.data+nFloatIter);
-			float* pfCurrLearningRate = ((float*)(m_oUpdateRateFrame.data+nFloatIter));
-			float* pfCurrMeanLastDist = ((float*)(m_oMeanLastDistFrame.data+nFloatIter));
-			float* pfCurrMeanMinDist_LT = ((float*)(m_oMeanMinDistFrame_LT.data+nFloatIter));
-			float* pfCurrMeanMinDist_ST = ((float*)(m_oMeanMinDistFrame_ST.data+nFloatIter));
-			float* pfCurrMeanRawSegmRes_LT = ((float*)(m_oMeanRawSegmResFrame_LT.data+nFloatIter));
-			float* pfCurrMeanRawSegmRes_ST = ((float*)(m_oMeanRawSegmResFrame_ST.data+nFloatIter));
-			float* pfCurrMeanFinalSegmRes_LT = ((float*)(m_oMeanFinalSegmResFrame_LT.data+nFloatIter));
-			float* pfCurrMeanFinalSegmRes_ST = ((float*)(m_oMeanFinalSegmResFrame_ST.data+nFloatIter));
+			// in lean mode, the fixed-point record is decoded here and encoded back once the pixel is done
+			PxState oDecodedPxState;
+			if(bLeanPxState)
+				decodePxState(getLeanPxState(nPxIter),oDecodedPxState);
+			PxState& oCurrPxState = bLeanPxState?oDecodedPxState:getPxState(nPxIter);
+			float* pfCurrDistThresholdFactor = &oCurrPxState.fDistThresholdFactor;
+			float* pfCurrVariationFactor = &oCurrPxState.fVariationFactor;
+			float* pfCurrLearningRate = &oCurrPxState.fLearningRate;
+			float* pfCurrMeanLastDist = &oCurrPxState.fMeanLastDist;
+			float* pfCurrMeanMinDist_LT = &oCurrPxState.fMeanMinDist_LT;
+			float* pfCurrMeanMinDist_ST = &oCurrPxState.fMeanMinDist_ST;
+			float* pfCurrMeanRawSegmRes_LT = &oCurrPxState.fMeanRawSegmRes_LT;
+			float* pfCurrMeanRawSegmRes_ST = &oCurrPxState.fMeanRawSegmRes_ST;
+			float* pfCurrMeanFinalSegmRes_LT = &oCurrPxState.fMeanFinalSegmRes_LT;
+			float* pfCurrMeanFinalSegmRes_ST = &oCurrPxState.fMeanFinalSegmRes_ST;
 			ushort& nLastIntraDesc = *((ushort*)(m_oLastDescFrame.data+nDescIter));
 			uchar& nLastColor = m_oLastColorFrame.data[nPxIter];
+			uchar* const anBGColorSamples = getBGColorSamples(nPxIter);
+			ushort* const anBGDescSamples = getBGDescSamples(nPxIter);
 			const size_t nCurrColorDistThreshold = (size_t)(((*pfCurrDistThresholdFactor)*m_nMinColorDistThreshold)-((!m_oUnstableRegionMask.data[nPxIter])*STAB_COLOR_DIST_OFFSET))/2;
 			const size_t nCurrDescDistThreshold = ((size_t)1<<((size_t)floor(*pfCurrDistThresholdFactor+0.5f)))+m_nDescDistThresholdOffset+(m_oUnstableRegionMask.data[nPxIter]*UNSTAB_DESC_DIST_OFFSET);
 			ushort nCurrInterDesc, nCurrIntraDesc;
 			LBSP::computeGrayscaleDescriptor(oInputImg,nCurrColor,nCurrImgCoord_X,nCurrImgCoord_Y,m_anLBSPThreshold_8bitLUT[nCurrColor],nCurrIntraDesc);
 			m_oUnstableRegionMask.data[nPxIter] = ((*pfCurrDistThresholdFactor)>UNSTABLE_REG_RDIST_MIN || (*pfCurrMeanRawSegmRes_LT-*pfCurrMeanFinalSegmRes_LT)>UNSTABLE_REG_RATIO_MIN || (*pfCurrMeanRawSegmRes_ST-*pfCurrMeanFinalSegmRes_ST)>UNSTABLE_REG_RATIO_MIN)?1:0;
-			size_t nGoodSamplesCount=0, nSampleIdx=0;
-			while(nGoodSamplesCount<m_nRequiredBGSamples && nSampleIdx<m_nBGSamples) {
-				const uchar& nBGColor = m_voBGColorSamples[nSampleIdx].data[nPxIter];
-				{
-					const size_t nColorDist = L1dist(nCurrColor,nBGColor);
-					if(nColorDist>nCurrColorDistThreshold)
-						goto failedcheck1ch;
-					const ushort& nBGIntraDesc = *((ushort*)(m_voBGDescSamples[nSampleIdx].data+nDescIter));
-					const size_t nIntraDescDist = hdist(nCurrIntraDesc,nBGIntraDesc);
-					LBSP::computeGrayscaleDescriptor(oInputImg,nBGColor,nCurrImgCoord_X,nCurrImgCoord_Y,m_anLBSPThreshold_8bitLUT[nBGColor],nCurrInterDesc);
-					const size_t nInterDescDist = hdist(nCurrInterDesc,nBGIntraDesc);
-					const size_t nDescDist = (nIntraDescDist+nInterDescDist)/2;
-					if(nDescDist>nCurrDescDistThreshold)
-						goto failedcheck1ch;
-					const size_t nSumDist = std::min((nDescDist/4)*(s_nColorMaxDataRange_1ch/s_nDescMaxDataRange_1ch)+nColorDist,s_nColorMaxDataRange_1ch);
-					if(nSumDist>nCurrColorDistThreshold)
-						goto failedcheck1ch;
-					if(nMinDescDist>nDescDist)
-						nMinDescDist = nDescDist;
-					if(nMinSumDist>nSumDist)
-						nMinSumDist = nSumDist;
-					nGoodSamplesCount++;
+			size_t nGoodSamplesCount=0;
+			for(size_t nGroupIdx=0; nGoodSamplesCount<nRequiredBGSamples && nGroupIdx<nBGSamples; nGroupIdx+=L1DIST_MASK_GROUP_SIZE) {
+				// the color & intra-LBSP prefilters reject whole groups of samples at once; only the surviving candidates get the inter-LBSP checks
+				// (a sample whose intra-LBSP distance exceeds twice the descriptor threshold fails it whatever its inter-LBSP distance)
+				unsigned int nCandidateMask = getSampleGroupValidMask(nGroupIdx,nBGSamples);
+				if(bUseSIMDKernels)
+					nCandidateMask &= L1distMask_1ch(anBGColorSamples+nGroupIdx,nCurrColor,nCurrColorDistThreshold)&hdistMask_1ch(anBGDescSamples+nGroupIdx,nCurrIntraDesc,nCurrDescDistThreshold*2+1);
+				else
+					nCandidateMask &= L1distMask_1ch_scalar(anBGColorSamples+nGroupIdx,nCurrColor,nCurrColorDistThreshold)&hdistMask_1ch_scalar(anBGDescSamples+nGroupIdx,nCurrIntraDesc,nCurrDescDistThreshold*2+1);
+				while(nCandidateMask && nGoodSamplesCount<nRequiredBGSamples) {
+					const size_t nSampleIdx = nGroupIdx+lsbidx(nCandidateMask);
+					const uchar& nBGColor = anBGColorSamples[nSampleIdx];
+					{
+						const size_t nColorDist = L1dist(nCurrColor,nBGColor);
+						const ushort& nBGIntraDesc = anBGDescSamples[nSampleIdx];
+						const size_t nIntraDescDist = hdist(nCurrIntraDesc,nBGIntraDesc);
+						LBSP::computeGrayscaleDescriptor(oInputImg,nBGColor,nCurrImgCoord_X,nCurrImgCoord_Y,m_anLBSPThreshold_8bitLUT[nBGColor],nCurrInterDesc);
+						const size_t nInterDescDist = hdist(nCurrInterDesc,nBGIntraDesc);
+						const size_t nDescDist = (nIntraDescDist+nInterDescDist)/2;
+						if(nDescDist>nCurrDescDistThreshold)
+							goto failedcheck1ch;
+						const size_t nSumDist = std::min((nDescDist/4)*(s_nColorMaxDataRange_1ch/s_nDescMaxDataRange_1ch)+nColorDist,s_nColorMaxDataRange_1ch);
+						if(nSumDist>nCurrColorDistThreshold)
+							goto failedcheck1ch;
+						if(nMinDescDist>nDescDist)
+							nMinDescDist = nDescDist;
+						if(nMinSumDist>nSumDist)
+							nMinSumDist = nSumDist;
+						nGoodSamplesCount++;
+					}
+					failedcheck1ch:
+					nCandidateMask &= nCandidateMask-1;
 				}
-				failedcheck1ch:
-				nSampleIdx++;
 			}
 			const float fNormalizedLastDist = ((float)L1dist(nLastColor,nCurrColor)/s_nColorMaxDataRange_1ch+(float)hdist(nLastIntraDesc,nCurrIntraDesc)/s_nDescMaxDataRange_1ch)/2;
 			*pfCurrMeanLastDist = (*pfCurrMeanLastDist)*(1.0f-fRollAvgFactor_ST) + fNormalizedLastDist*fRollAvgFactor_ST;
-			if(nGoodSamplesCount<m_nRequiredBGSamples) {
+			if(nGoodSamplesCount<nRequiredBGSamples) {
 				// == foreground
-				const float fNormalizedMinDist = std::min(1.0f,((float)nMinSumDist/s_nColorMaxDataRange_1ch+(float)nMinDescDist/s_nDescMaxDataRange_1ch)/2 + (float)(m_nRequiredBGSamples-nGoodSamplesCount)/m_nRequiredBGSamples);
+				const float fNormalizedMinDist = std::min(1.0f,((float)nMinSumDist/s_nColorMaxDataRange_1ch+(float)nMinDescDist/s_nDescMaxDataRange_1ch)/2 + (float)(nRequiredBGSamples-nGoodSamplesCount)/nRequiredBGSamples);
 				*pfCurrMeanMinDist_LT = (*pfCurrMeanMinDist_LT)*(1.0f-fRollAvgFactor_LT) + fNormalizedMinDist*fRollAvgFactor_LT;
 				*pfCurrMeanMinDist_ST = (*pfCurrMeanMinDist_ST)*(1.0f-fRollAvgFactor_ST) + fNormalizedMinDist*fRollAvgFactor_ST;
 				*pfCurrMeanRawSegmRes_LT = (*pfCurrMeanRawSegmRes_LT)*(1.0f-fRollAvgFactor_LT) + fRollAvgFactor_LT;
 				*pfCurrMeanRawSegmRes_ST = (*pfCurrMeanRawSegmRes_ST)*(1.0f-fRollAvgFactor_ST) + fRollAvgFactor_ST;
 				oCurrFGMask.data[nPxIter] = UCHAR_MAX;
-				if(m_nModelResetCooldown && (rand()%(size_t)FEEDBACK_T_LOWER)==0) {
-					const size_t s_rand = rand()%m_nBGSamples;
-					*((ushort*)(m_voBGDescSamples[s_rand].data+nDescIter)) = nCurrIntraDesc;
-					m_voBGColorSamples[s_rand].data[nPxIter] = nCurrColor;
+				if(m_nModelResetCooldown && oRandEngine((unsigned)FEEDBACK_T_LOWER)==0) {
+					const size_t s_rand = oRandEngine((unsigned)nBGSamples);
+					setBGSample(nPxIter,s_rand,0,nCurrColor,nCurrIntraDesc);
 				}
 			}
 			else {
@@ -384,29 +831,25 @@ void BackgroundSubtractorSuBSENSE::operator()(cv::InputArray _image, cv::OutputA
 				*pfCurrMeanMinDist_ST = (*pfCurrMeanMinDist_ST)*(1.0f-fRollAvgFactor_ST) + fNormalizedMinDist*fRollAvgFactor_ST;
 				*pfCurrMeanRawSegmRes_LT = (*pfCurrMeanRawSegmRes_LT)*(1.0f-fRollAvgFactor_LT);
 				*pfCurrMeanRawSegmRes_ST = (*pfCurrMeanRawSegmRes_ST)*(1.0f-fRollAvgFactor_ST);
-				const size_t nLearningRate = learningRateOverride>0?(size_t)ceil(learningRateOverride):(size_t)ceil(*pfCurrLearningRate);
-				if((rand()%nLearningRate)==0) {
-					const size_t s_rand = rand()%m_nBGSamples;
-					*((ushort*)(m_voBGDescSamples[s_rand].data+nDescIter)) = nCurrIntraDesc;
-					m_voBGColorSamples[s_rand].data[nPxIter] = nCurrColor;
+				const size_t nLearningRate = bLearningRateOverride?(size_t)ceil(dLearningRateOverride):(size_t)ceil(*pfCurrLearningRate);
+				if(oRandEngine((unsigned)nLearningRate)==0) {
+					const size_t s_rand = oRandEngine((unsigned)nBGSamples);
+					setBGSample(nPxIter,s_rand,0,nCurrColor,nCurrIntraDesc);
 				}
 				int nSampleImgCoord_Y, nSampleImgCoord_X;
-				const bool bCurrUsing3x3Spread = m_bUse3x3Spread && !m_oUnstableRegionMask.data[nPxIter];
+				const bool bCurrUsing3x3Spread = bUse3x3Spread && !m_oUnstableRegionMask.data[nPxIter];
 				if(bCurrUsing3x3Spread)
-					getRandNeighborPosition_3x3(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,nCurrImgCoord_Y,LBSP::PATCH_SIZE/2,m_oImgSize);
+					getRandNeighborPosition_3x3(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,nCurrImgCoord_Y,LBSP::PATCH_SIZE/2,m_oImgSize,oRandEngine);
 				else
-					getRandNeighborPosition_5x5(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,nCurrImgCoord_Y,LBSP::PATCH_SIZE/2,m_oImgSize);
-				const size_t n_rand = rand();
+					getRandNeighborPosition_5x5(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,nCurrImgCoord_Y,LBSP::PATCH_SIZE/2,m_oImgSize,oRandEngine);
+				const size_t n_rand = (unsigned)oRandEngine;
 				const size_t idx_rand_uchar = m_oImgSize.width*nSampleImgCoord_Y + nSampleImgCoord_X;
-				const size_t idx_rand_flt32 = idx_rand_uchar*4;
-				const float fRandMeanLastDist = *((float*)(m_oMeanLastDistFrame.data+idx_rand_flt32));
-				const float fRandMeanRawSegmRes = *((float*)(m_oMeanRawSegmResFrame_ST.data+idx_rand_flt32));
+				const float fRandMeanLastDist = bLeanPxState?decodeQ0_16(getLeanPxState(idx_rand_uchar).nMeanLastDist):getPxState(idx_rand_uchar).fMeanLastDist;
+				const float fRandMeanRawSegmRes = bLeanPxState?decodeQ0_16(getLeanPxState(idx_rand_uchar).nMeanRawSegmRes_ST):getPxState(idx_rand_uchar).fMeanRawSegmRes_ST;
 				if((n_rand%(bCurrUsing3x3Spread?nLearningRate:(nLearningRate/2+1)))==0
 					|| (fRandMeanRawSegmRes>GHOSTDET_S_MIN && fRandMeanLastDist<GHOSTDET_D_MAX && (n_rand%((size_t)m_fCurrLearningRateLowerCap))==0)) {
-					const size_t idx_rand_ushrt = idx_rand_uchar*2;
-					const size_t s_rand = rand()%m_nBGSamples;
-					*((ushort*)(m_voBGDescSamples[s_rand].data+idx_rand_ushrt)) = nCurrIntraDesc;
-					m_voBGColorSamples[s_rand].data[idx_rand_uchar] = nCurrColor;
+					const size_t s_rand = oRandEngine((unsigned)nBGSamples);
+					setBGSample(idx_rand_uchar,s_rand,0,nCurrColor,nCurrIntraDesc);
 				}
 			}
 			if(m_oLastFGMask.data[nPxIter] || (std::min(*pfCurrMeanMinDist_LT,*pfCurrMeanMinDist_ST)<UNSTABLE_REG_RATIO_MIN && oCurrFGMask.data[nPxIter])) {
@@ -437,35 +880,63 @@ void BackgroundSubtractorSuBSENSE::operator()(cv::InputArray _image, cv::OutputA
 				++nNonZeroDescCount;
 			nLastIntraDesc = nCurrIntraDesc;
 			nLastColor = nCurrColor;
+			if(bLeanPxState)
+				encodePxState(oCurrPxState,getLeanPxState(nPxIter),getRoundingDither(nDitherSeed,nPxIter));
 		}
 	}
-	else { //m_nImgChannels==3
-		for(size_t nModelIter=0; nModelIter<m_nTotRelevantPxCount; ++nModelIter) {
-			const size_t nPxIter = m_aPxIdxLUT[nModelIter];
-			const int nCurrImgCoord_X = m_aPxInfoLUT[nPxIter].nImgCoord_X;
-			const int nCurrImgCoord_Y = m_aPxInfoLUT[nPxIter].nImgCoord_Y;
+	oCtx.vnNonZeroDescCount[nBandIdx] = nNonZeroDescCount;
+}
+
+template<bool bLeanPxState, bool bUse3x3Spread, bool bLearningRateOverride, size_t nBGSamplesT, size_t nRequiredBGSamplesT>
+void BackgroundSubtractorSuBSENSE::processBand3ch(FrameContext& oCtx, size_t nBandIdx) {
+	CV_DbgAssert(nBandIdx<m_nBands);
+	// compile-time sample counts let the compiler unroll the sample group loop; 0 falls back to the runtime values
+	const size_t nBGSamples = nBGSamplesT?nBGSamplesT:m_nBGSamples;
+	const size_t nRequiredBGSamples = nRequiredBGSamplesT?nRequiredBGSamplesT:m_nRequiredBGSamples;
+	CV_DbgAssert(nBGSamples==m_nBGSamples && nRequiredBGSamples==m_nRequiredBGSamples);
+	const cv::Mat& oInputImg = oCtx.oInputImg;
+	cv::Mat& oCurrFGMask = oCtx.oCurrFGMask;
+	const float fRollAvgFactor_LT = oCtx.fRollAvgFactor_LT;
+	const float fRollAvgFactor_ST = oCtx.fRollAvgFactor_ST;
+	const double dLearningRateOverride = oCtx.dLearningRateOverride;
+	// the valid spans are ordered by row, so a band is a contiguous range of spans
+	const size_t nBandSpanIdxStart = m_vnValidRowSpanIdxs[m_vnBandRowBounds[nBandIdx]];
+	const size_t nBandSpanIdxEnd = m_vnValidRowSpanIdxs[m_vnBandRowBounds[nBandIdx+1]];
+	const bool bUseSIMDKernels = m_bUseSIMDKernels;
+	// lean mode: R(x) is stored with stochastic rounding (see PxStateLean), dithered per pixel & frame
+	const uint64 nDitherSeed = getFrameSeed(0x2545F4914F6CDD1DULL);
+	// each band gets its own generator, seeded from the frame & band indexes, so that results only depend on the band layout
+	RandEngine oRandEngine(getFrameSeed(),nBandIdx);
+	size_t nNonZeroDescCount = 0;
+	for(size_t nSpanIter=nBandSpanIdxStart; nSpanIter<nBandSpanIdxEnd; ++nSpanIter) {
+		const PxSpan& oSpan = m_voValidSpans[nSpanIter];
+		const int nCurrImgCoord_Y = oSpan.nY;
+		for(int nCurrImgCoord_X=oSpan.nStartX; nCurrImgCoord_X<oSpan.nEndX; ++nCurrImgCoord_X) {
+			const size_t nPxIter = (size_t)nCurrImgCoord_Y*m_oImgSize.width+nCurrImgCoord_X;
 			const size_t nPxIterRGB = nPxIter*3;
 			const uchar* const anCurrColor = oInputImg.data+nPxIterRGB;
-			
-			// avoid empty pixel after transform
-			if (anCurrColor[0] == 0 && anCurrColor[1] == 0 && anCurrColor[2] == 0) continue;
-
 			const size_t nDescIterRGB = nPxIterRGB*2;
-			const size_t nFloatIter = nPxIter*4;			
 			size_t nMinTotDescDist=s_nDescMaxDataRange_3ch;
 			size_t nMinTotSumDist=s_nColorMaxDataRange_3ch;
-			float* pfCurrDistThresholdFactor = (float*)(m_oDistThresholdFrame.data+nFloatIter);
-			float* pfCurrVariationFactor = (float*)(m_oVariationModulatorFrame.data+nFloatIter);
-			float* pfCurrLearningRate = ((float*)(m_oUpdateRateFrame.data+nFloatIter));
-			float* pfCurrMeanLastDist = ((float*)(m_oMeanLastDistFrame.data+nFloatIter));
-			float* pfCurrMeanMinDist_LT = ((float*)(m_oMeanMinDistFrame_LT.data+nFloatIter));
-			float* pfCurrMeanMinDist_ST = ((float*)(m_oMeanMinDistFrame_ST.data+nFloatIter));
-			float* pfCurrMeanRawSegmRes_LT = ((float*)(m_oMeanRawSegmResFrame_LT.data+nFloatIter));
-			float* pfCurrMeanRawSegmRes_ST = ((float*)(m_oMeanRawSegmResFrame_ST.data+nFloatIter));
-			float* pfCurrMeanFinalSegmRes_LT = ((float*)(m_oMeanFinalSegmResFrame_LT.data+nFloatIter));
-			float* pfCurrMeanFinalSegmRes_ST = ((float*)(m_oMeanFinalSegmResFrame_ST.data+nFloatIter));
+			// in lean mode, the fixed-point record is decoded here and encoded back once the pixel is done
+			PxState oDecodedPxState;
+			if(bLeanPxState)
+				decodePxState(getLeanPxState(nPxIter),oDecodedPxState);
+			PxState& oCurrPxState = bLeanPxState?oDecodedPxState:getPxState(nPxIter);
+			float* pfCurrDistThresholdFactor = &oCurrPxState.fDistThresholdFactor;
+			float* pfCurrVariationFactor = &oCurrPxState.fVariationFactor;
+			float* pfCurrLearningRate = &oCurrPxState.fLearningRate;
+			float* pfCurrMeanLastDist = &oCurrPxState.fMeanLastDist;
+			float* pfCurrMeanMinDist_LT = &oCurrPxState.fMeanMinDist_LT;
+			float* pfCurrMeanMinDist_ST = &oCurrPxState.fMeanMinDist_ST;
+			float* pfCurrMeanRawSegmRes_LT = &oCurrPxState.fMeanRawSegmRes_LT;
+			float* pfCurrMeanRawSegmRes_ST = &oCurrPxState.fMeanRawSegmRes_ST;
+			float* pfCurrMeanFinalSegmRes_LT = &oCurrPxState.fMeanFinalSegmRes_LT;
+			float* pfCurrMeanFinalSegmRes_ST = &oCurrPxState.fMeanFinalSegmRes_ST;
 			ushort* anLastIntraDesc = ((ushort*)(m_oLastDescFrame.data+nDescIterRGB));
 			uchar* anLastColor = m_oLastColorFrame.data+nPxIterRGB;
+			uchar* const anBGColorSamples = getBGColorSamples(nPxIter);
+			ushort* const anBGDescSamples = getBGDescSamples(nPxIter);
 			const size_t nCurrColorDistThreshold = (size_t)(((*pfCurrDistThresholdFactor)*m_nMinColorDistThreshold)-((!m_oUnstableRegionMask.data[nPxIter])*STAB_COLOR_DIST_OFFSET));
 			const size_t nCurrDescDistThreshold = ((size_t)1<<((size_t)floor(*pfCurrDistThresholdFactor+0.5f)))+m_nDescDistThresholdOffset+(m_oUnstableRegionMask.data[nPxIter]*UNSTAB_DESC_DIST_OFFSET);
 			const size_t nCurrTotColorDistThreshold = nCurrColorDistThreshold*3;
@@ -475,52 +946,58 @@ void BackgroundSubtractorSuBSENSE::operator()(cv::InputArray _image, cv::OutputA
 			const size_t anCurrIntraLBSPThresholds[3] = {m_anLBSPThreshold_8bitLUT[anCurrColor[0]],m_anLBSPThreshold_8bitLUT[anCurrColor[1]],m_anLBSPThreshold_8bitLUT[anCurrColor[2]]};
 			LBSP::computeRGBDescriptor(oInputImg,anCurrColor,nCurrImgCoord_X,nCurrImgCoord_Y,anCurrIntraLBSPThresholds,anCurrIntraDesc);
 			m_oUnstableRegionMask.data[nPxIter] = ((*pfCurrDistThresholdFactor)>UNSTABLE_REG_RDIST_MIN || (*pfCurrMeanRawSegmRes_LT-*pfCurrMeanFinalSegmRes_LT)>UNSTABLE_REG_RATIO_MIN || (*pfCurrMeanRawSegmRes_ST-*pfCurrMeanFinalSegmRes_ST)>UNSTABLE_REG_RATIO_MIN)?1:0;
-			size_t nGoodSamplesCount=0, nSampleIdx=0;
-			while(nGoodSamplesCount<m_nRequiredBGSamples && nSampleIdx<m_nBGSamples) {
-				const ushort* const anBGIntraDesc = (ushort*)(m_voBGDescSamples[nSampleIdx].data+nDescIterRGB);
-				const uchar* const anBGColor = m_voBGColorSamples[nSampleIdx].data+nPxIterRGB;
-				size_t nTotDescDist = 0;
-				size_t nTotSumDist = 0;
-				for(size_t c=0;c<3; ++c) {
-					const size_t nColorDist = L1dist(anCurrColor[c],anBGColor[c]);
-					if(nColorDist>nCurrSCColorDistThreshold)
-						goto failedcheck3ch;
-					const size_t nIntraDescDist = hdist(anCurrIntraDesc[c],anBGIntraDesc[c]);
-					LBSP::computeSingleRGBDescriptor(oInputImg,anBGColor[c],nCurrImgCoord_X,nCurrImgCoord_Y,c,m_anLBSPThreshold_8bitLUT[anBGColor[c]],anCurrInterDesc[c]);
-					const size_t nInterDescDist = hdist(anCurrInterDesc[c],anBGIntraDesc[c]);
-					const size_t nDescDist = (nIntraDescDist+nInterDescDist)/2;
-					const size_t nSumDist = std::min((nDescDist/2)*(s_nColorMaxDataRange_1ch/s_nDescMaxDataRange_1ch)+nColorDist,s_nColorMaxDataRange_1ch);
-					if(nSumDist>nCurrSCColorDistThreshold)
+			size_t nGoodSamplesCount=0;
+			for(size_t nGroupIdx=0; nGoodSamplesCount<nRequiredBGSamples && nGroupIdx<nBGSamples; nGroupIdx+=L1DIST_MASK_GROUP_SIZE) {
+				// the per-channel color & total intra-LBSP prefilters reject whole groups of samples at once; only the surviving candidates get the inter-LBSP checks
+				// (the total descriptor distance is at least (intra-LBSP distance-3)/2, as each channel rounds its half-sum down)
+				unsigned int nCandidateMask = getSampleGroupValidMask(nGroupIdx,nBGSamples);
+				if(bUseSIMDKernels)
+					nCandidateMask &= L1distMask_3ch(anBGColorSamples+nGroupIdx*3,anCurrColor,nCurrSCColorDistThreshold)&hdistMask_3ch(anBGDescSamples+nGroupIdx*3,anCurrIntraDesc,nCurrTotDescDistThreshold*2+3);
+				else
+					nCandidateMask &= L1distMask_3ch_scalar(anBGColorSamples+nGroupIdx*3,anCurrColor,nCurrSCColorDistThreshold)&hdistMask_3ch_scalar(anBGDescSamples+nGroupIdx*3,anCurrIntraDesc,nCurrTotDescDistThreshold*2+3);
+				while(nCandidateMask && nGoodSamplesCount<nRequiredBGSamples) {
+					const size_t nSampleIdx = nGroupIdx+lsbidx(nCandidateMask);
+					const ushort* const anBGIntraDesc = anBGDescSamples+nSampleIdx*3;
+					const uchar* const anBGColor = anBGColorSamples+nSampleIdx*3;
+					size_t nTotDescDist = 0;
+					size_t nTotSumDist = 0;
+					for(size_t c=0;c<3; ++c) {
+						const size_t nColorDist = L1dist(anCurrColor[c],anBGColor[c]);
+						const size_t nIntraDescDist = hdist(anCurrIntraDesc[c],anBGIntraDesc[c]);
+						LBSP::computeSingleRGBDescriptor(oInputImg,anBGColor[c],nCurrImgCoord_X,nCurrImgCoord_Y,c,m_anLBSPThreshold_8bitLUT[anBGColor[c]],anCurrInterDesc[c]);
+						const size_t nInterDescDist = hdist(anCurrInterDesc[c],anBGIntraDesc[c]);
+						const size_t nDescDist = (nIntraDescDist+nInterDescDist)/2;
+						const size_t nSumDist = std::min((nDescDist/2)*(s_nColorMaxDataRange_1ch/s_nDescMaxDataRange_1ch)+nColorDist,s_nColorMaxDataRange_1ch);
+						if(nSumDist>nCurrSCColorDistThreshold)
+							goto failedcheck3ch;
+						nTotDescDist += nDescDist;
+						nTotSumDist += nSumDist;
+					}
+					if(nTotDescDist>nCurrTotDescDistThreshold || nTotSumDist>nCurrTotColorDistThreshold)
 						goto failedcheck3ch;
-					nTotDescDist += nDescDist;
-					nTotSumDist += nSumDist;
+					if(nMinTotDescDist>nTotDescDist)
+						nMinTotDescDist = nTotDescDist;
+					if(nMinTotSumDist>nTotSumDist)
+						nMinTotSumDist = nTotSumDist;
+					nGoodSamplesCount++;
+					failedcheck3ch:
+					nCandidateMask &= nCandidateMask-1;
 				}
-				if(nTotDescDist>nCurrTotDescDistThreshold || nTotSumDist>nCurrTotColorDistThreshold)
-					goto failedcheck3ch;
-				if(nMinTotDescDist>nTotDescDist)
-					nMinTotDescDist = nTotDescDist;
-				if(nMinTotSumDist>nTotSumDist)
-					nMinTotSumDist = nTotSumDist;
-				nGoodSamplesCount++;
-				failedcheck3ch:
-				nSampleIdx++;
 			}
 			const float fNormalizedLastDist = ((float)L1dist<3>(anLastColor,anCurrColor)/s_nColorMaxDataRange_3ch+(float)hdist<3>(anLastIntraDesc,anCurrIntraDesc)/s_nDescMaxDataRange_3ch)/2;
 			*pfCurrMeanLastDist = (*pfCurrMeanLastDist)*(1.0f-fRollAvgFactor_ST) + fNormalizedLastDist*fRollAvgFactor_ST;
-			if(nGoodSamplesCount<m_nRequiredBGSamples) {
+			if(nGoodSamplesCount<nRequiredBGSamples) {
 				// == foreground
-				const float fNormalizedMinDist = std::min(1.0f,((float)nMinTotSumDist/s_nColorMaxDataRange_3ch+(float)nMinTotDescDist/s_nDescMaxDataRange_3ch)/2 + (float)(m_nRequiredBGSamples-nGoodSamplesCount)/m_nRequiredBGSamples);
+				const float fNormalizedMinDist = std::min(1.0f,((float)nMinTotSumDist/s_nColorMaxDataRange_3ch+(float)nMinTotDescDist/s_nDescMaxDataRange_3ch)/2 + (float)(nRequiredBGSamples-nGoodSamplesCount)/nRequiredBGSamples);
 				*pfCurrMeanMinDist_LT = (*pfCurrMeanMinDist_LT)*(1.0f-fRollAvgFactor_LT) + fNormalizedMinDist*fRollAvgFactor_LT;
 				*pfCurrMeanMinDist_ST = (*pfCurrMeanMinDist_ST)*(1.0f-fRollAvgFactor_ST) + fNormalizedMinDist*fRollAvgFactor_ST;
 				*pfCurrMeanRawSegmRes_LT = (*pfCurrMeanRawSegmRes_LT)*(1.0f-fRollAvgFactor_LT) + fRollAvgFactor_LT;
 				*pfCurrMeanRawSegmRes_ST = (*pfCurrMeanRawSegmRes_ST)*(1.0f-fRollAvgFactor_ST) + fRollAvgFactor_ST;
 				oCurrFGMask.data[nPxIter] = UCHAR_MAX;
-				if(m_nModelResetCooldown && (rand()%(size_t)FEEDBACK_T_LOWER)==0) {
-					const size_t s_rand = rand()%m_nBGSamples;
-					for(size_t c=0; c<3; ++c) {
-						*((ushort*)(m_voBGDescSamples[s_rand].data+nDescIterRGB+2*c)) = anCurrIntraDesc[c];
-						*(m_voBGColorSamples[s_rand].data+nPxIterRGB+c) = anCurrColor[c];
-					}
+				if(m_nModelResetCooldown && oRandEngine((unsigned)FEEDBACK_T_LOWER)==0) {
+					const size_t s_rand = oRandEngine((unsigned)nBGSamples);
+					for(size_t c=0; c<3; ++c)
+						setBGSample(nPxIter,s_rand,c,anCurrColor[c],anCurrIntraDesc[c]);
 				}
 			}
 			else {
@@ -530,34 +1007,27 @@ void BackgroundSubtractorSuBSENSE::operator()(cv::InputArray _image, cv::OutputA
 				*pfCurrMeanMinDist_ST = (*pfCurrMeanMinDist_ST)*(1.0f-fRollAvgFactor_ST) + fNormalizedMinDist*fRollAvgFactor_ST;
 				*pfCurrMeanRawSegmRes_LT = (*pfCurrMeanRawSegmRes_LT)*(1.0f-fRollAvgFactor_LT);
 				*pfCurrMeanRawSegmRes_ST = (*pfCurrMeanRawSegmRes_ST)*(1.0f-fRollAvgFactor_ST);
-				const size_t nLearningRate = learningRateOverride>0?(size_t)ceil(learningRateOverride):(size_t)ceil(*pfCurrLearningRate);
-				if((rand()%nLearningRate)==0) {
-					const size_t s_rand = rand()%m_nBGSamples;
-					for(size_t c=0; c<3; ++c) {
-						*((ushort*)(m_voBGDescSamples[s_rand].data+nDescIterRGB+2*c)) = anCurrIntraDesc[c];
-						*(m_voBGColorSamples[s_rand].data+nPxIterRGB+c) = anCurrColor[c];
-					}
+				const size_t nLearningRate = bLearningRateOverride?(size_t)ceil(dLearningRateOverride):(size_t)ceil(*pfCurrLearningRate);
+				if(oRandEngine((unsigned)nLearningRate)==0) {
+					const size_t s_rand = oRandEngine((unsigned)nBGSamples);
+					for(size_t c=0; c<3; ++c)
+						setBGSample(nPxIter,s_rand,c,anCurrColor[c],anCurrIntraDesc[c]);
 				}
 				int nSampleImgCoord_Y, nSampleImgCoord_X;
-				const bool bCurrUsing3x3Spread = m_bUse3x3Spread && !m_oUnstableRegionMask.data[nPxIter];
+				const bool bCurrUsing3x3Spread = bUse3x3Spread && !m_oUnstableRegionMask.data[nPxIter];
 				if(bCurrUsing3x3Spread)
-					getRandNeighborPosition_3x3(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,nCurrImgCoord_Y,LBSP::PATCH_SIZE/2,m_oImgSize);
+					getRandNeighborPosition_3x3(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,nCurrImgCoord_Y,LBSP::PATCH_SIZE/2,m_oImgSize,oRandEngine);
 				else
-					getRandNeighborPosition_5x5(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,nCurrImgCoord_Y,LBSP::PATCH_SIZE/2,m_oImgSize);
-				const size_t n_rand = rand();
+					getRandNeighborPosition_5x5(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,nCurrImgCoord_Y,LBSP::PATCH_SIZE/2,m_oImgSize,oRandEngine);
+				const size_t n_rand = (unsigned)oRandEngine;
 				const size_t idx_rand_uchar = m_oImgSize.width*nSampleImgCoord_Y + nSampleImgCoord_X;
-				const size_t idx_rand_flt32 = idx_rand_uchar*4;
-				const float fRandMeanLastDist = *((float*)(m_oMeanLastDistFrame.data+idx_rand_flt32));
-				const float fRandMeanRawSegmRes = *((float*)(m_oMeanRawSegmResFrame_ST.data+idx_rand_flt32));
+				const float fRandMeanLastDist = bLeanPxState?decodeQ0_16(getLeanPxState(idx_rand_uchar).nMeanLastDist):getPxState(idx_rand_uchar).fMeanLastDist;
+				const float fRandMeanRawSegmRes = bLeanPxState?decodeQ0_16(getLeanPxState(idx_rand_uchar).nMeanRawSegmRes_ST):getPxState(idx_rand_uchar).fMeanRawSegmRes_ST;
 				if((n_rand%(bCurrUsing3x3Spread?nLearningRate:(nLearningRate/2+1)))==0
 					|| (fRandMeanRawSegmRes>GHOSTDET_S_MIN && fRandMeanLastDist<GHOSTDET_D_MAX && (n_rand%((size_t)m_fCurrLearningRateLowerCap))==0)) {
-					const size_t idx_rand_uchar_rgb = idx_rand_uchar*3;
-					const size_t idx_rand_ushrt_rgb = idx_rand_uchar_rgb*2;
-					const size_t s_rand = rand()%m_nBGSamples;
-					for(size_t c=0; c<3; ++c) {
-						*((ushort*)(m_voBGDescSamples[s_rand].data+idx_rand_ushrt_rgb+2*c)) = anCurrIntraDesc[c];
-						*(m_voBGColorSamples[s_rand].data+idx_rand_uchar_rgb+c) = anCurrColor[c];
-					}
+					const size_t s_rand = oRandEngine((unsigned)nBGSamples);
+					for(size_t c=0; c<3; ++c)
+						setBGSample(idx_rand_uchar,s_rand,c,anCurrColor[c],anCurrIntraDesc[c]);
 				}
 			}
 			if(m_oLastFGMask.data[nPxIter] || (std::min(*pfCurrMeanMinDist_LT,*pfCurrMeanMinDist_ST)<UNSTABLE_REG_RATIO_MIN && oCurrFGMask.data[nPxIter])) {
@@ -590,280 +1060,401 @@ void BackgroundSubtractorSuBSENSE::operator()(cv::InputArray _image, cv::OutputA
 				anLastIntraDesc[c] = anCurrIntraDesc[c];
 				anLastColor[c] = anCurrColor[c];
 			}
+			if(bLeanPxState)
+				encodePxState(oCurrPxState,getLeanPxState(nPxIter),getRoundingDither(nDitherSeed,nPxIter));
 		}
 	}
-#if DISPLAY_SUBSENSE_DEBUG_INFO
-	std::cout << std::endl;
-	cv::Point dbgpt(nDebugCoordX,nDebugCoordY);
-	cv::Mat oMeanMinDistFrameNormalized; m_oMeanMinDistFrame_ST.copyTo(oMeanMinDistFrameNormalized);
-	cv::circle(oMeanMinDistFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
-	cv::resize(oMeanMinDistFrameNormalized,oMeanMinDistFrameNormalized,DEFAULT_FRAME_SIZE);
-	cv::imshow("d_min(x)",oMeanMinDistFrameNormalized);
-	std::cout << std::fixed << std::setprecision(5) << "  d_min(" << dbgpt << ") = " << m_oMeanMinDistFrame_ST.at<float>(dbgpt) << std::endl;
-	cv::Mat oMeanLastDistFrameNormalized; m_oMeanLastDistFrame.copyTo(oMeanLastDistFrameNormalized);
-	cv::circle(oMeanLastDistFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
-	cv::resize(oMeanLastDistFrameNormalized,oMeanLastDistFrameNormalized,DEFAULT_FRAME_SIZE);
-	cv::imshow("d_last(x)",oMeanLastDistFrameNormalized);
-	std::cout << std::fixed << std::setprecision(5) << " d_last(" << dbgpt << ") = " << m_oMeanLastDistFrame.at<float>(dbgpt) << std::endl;
-	cv::Mat oMeanRawSegmResFrameNormalized; m_oMeanRawSegmResFrame_ST.copyTo(oMeanRawSegmResFrameNormalized);
-	cv::circle(oMeanRawSegmResFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
-	cv::resize(oMeanRawSegmResFrameNormalized,oMeanRawSegmResFrameNormalized,DEFAULT_FRAME_SIZE);
-	cv::imshow("s_avg(x)",oMeanRawSegmResFrameNormalized);
-	std::cout << std::fixed << std::setprecision(5) << "  s_avg(" << dbgpt << ") = " << m_oMeanRawSegmResFrame_ST.at<float>(dbgpt) << std::endl;
-	cv::Mat oMeanFinalSegmResFrameNormalized; m_oMeanFinalSegmResFrame_ST.copyTo(oMeanFinalSegmResFrameNormalized);
-	cv::circle(oMeanFinalSegmResFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
-	cv::resize(oMeanFinalSegmResFrameNormalized,oMeanFinalSegmResFrameNormalized,DEFAULT_FRAME_SIZE);
-	cv::imshow("z_avg(x)",oMeanFinalSegmResFrameNormalized);
-	std::cout << std::fixed << std::setprecision(5) << "  z_avg(" << dbgpt << ") = " << m_oMeanFinalSegmResFrame_ST.at<float>(dbgpt) << std::endl;
-	cv::Mat oDistThresholdFrameNormalized; m_oDistThresholdFrame.convertTo(oDistThresholdFrameNormalized,CV_32FC1,0.25f,-0.25f);
-	cv::circle(oDistThresholdFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
-	cv::resize(oDistThresholdFrameNormalized,oDistThresholdFrameNormalized,DEFAULT_FRAME_SIZE);
-	cv::imshow("r(x)",oDistThresholdFrameNormalized);
-	std::cout << std::fixed << std::setprecision(5) << "      r(" << dbgpt << ") = " << m_oDistThresholdFrame.at<float>(dbgpt) << std::endl;
-	cv::Mat oVariationModulatorFrameNormalized; cv::normalize(m_oVariationModulatorFrame,oVariationModulatorFrameNormalized,0,255,cv::NORM_MINMAX,CV_8UC1);
-	cv::circle(oVariationModulatorFrameNormalized,dbgpt,5,cv::Scalar(255));
-	cv::resize(oVariationModulatorFrameNormalized,oVariationModulatorFrameNormalized,DEFAULT_FRAME_SIZE);
-	cv::imshow("v(x)",oVariationModulatorFrameNormalized);
-	std::cout << std::fixed << std::setprecision(5) << "      v(" << dbgpt << ") = " << m_oVariationModulatorFrame.at<float>(dbgpt) << std::endl;
-	cv::Mat oUpdateRateFrameNormalized; m_oUpdateRateFrame.convertTo(oUpdateRateFrameNormalized,CV_32FC1,1.0f/FEEDBACK_T_UPPER,-FEEDBACK_T_LOWER/FEEDBACK_T_UPPER);
-	cv::circle(oUpdateRateFrameNormalized,dbgpt,5,cv::Scalar(1.0f));
-	cv::resize(oUpdateRateFrameNormalized,oUpdateRateFrameNormalized,DEFAULT_FRAME_SIZE);
-	cv::imshow("t(x)",oUpdateRateFrameNormalized);
-	std::cout << std::fixed << std::setprecision(5) << "      t(" << dbgpt << ") = " << m_oUpdateRateFrame.at<float>(dbgpt) << std::endl;
-#endif //DISPLAY_SUBSENSE_DEBUG_INFO
-	cv::bitwise_xor(oCurrFGMask,m_oLastRawFGMask,m_oCurrRawFGBlinkMask);
-	cv::bitwise_or(m_oCurrRawFGBlinkMask,m_oLastRawFGBlinkMask,m_oBlinksFrame);
-	m_oCurrRawFGBlinkMask.copyTo(m_oLastRawFGBlinkMask);
-	oCurrFGMask.copyTo(m_oLastRawFGMask);
-	// complete
-	cv::addWeighted(m_oMeanFinalSegmResFrame_LT,(1.0f-fRollAvgFactor_LT),m_oLastFGMask,(1.0/UCHAR_MAX)*fRollAvgFactor_LT,0,m_oMeanFinalSegmResFrame_LT,CV_32F);
-	cv::addWeighted(m_oMeanFinalSegmResFrame_ST,(1.0f-fRollAvgFactor_ST),m_oLastFGMask,(1.0/UCHAR_MAX)*fRollAvgFactor_ST,0,m_oMeanFinalSegmResFrame_ST,CV_32F);
-	const float fCurrNonZeroDescRatio = (float)nNonZeroDescCount/m_nTotRelevantPxCount;
-	if(fCurrNonZeroDescRatio<LBSPDESC_NONZERO_RATIO_MIN && m_fLastNonZeroDescRatio<LBSPDESC_NONZERO_RATIO_MIN) {
-	    for(size_t t=0; t<=UCHAR_MAX; ++t)
-	        if(m_anLBSPThreshold_8bitLUT[t]>cv::saturate_cast<uchar>(m_nLBSPThresholdOffset+ceil(t*m_fRelLBSPThreshold/4)))
-	            --m_anLBSPThreshold_8bitLUT[t];
+	oCtx.vnNonZeroDescCount[nBandIdx] = nNonZeroDescCount;
+}
+
+
+void BackgroundSubtractorSuBSENSE::getBackgroundImage(cv::OutputArray backgroundImage) const {
+	CV_Assert(m_bInitialized);
+	m_oBGColorSumFrame.convertTo(backgroundImage,CV_8U,1.0/m_nBGSamples);
+}
+
+void BackgroundSubtractorSuBSENSE::getBackgroundDescriptorsImage(cv::OutputArray backgroundDescImage) const {
+	CV_Assert(LBSP::DESC_SIZE==2);
+	CV_Assert(m_bInitialized);
+	m_oBGDescSumFrame.convertTo(backgroundDescImage,CV_16U,1.0/m_nBGSamples);
+}
+
+void BackgroundSubtractorSuBSENSE::update(const cv::Mat &newFrame, const cv::Mat &transmatrix) {
+	newFrame.copyTo(m_oLastColorFrame);
+	// all full-resolution model planes share the same nearest-neighbor mapping, computed once in a single pass (integer
+	// shifts just move row segments); exposed pixels get zeroed records, i.e. T(x)=0, which flags them for reinitialization below
+	warpPxRecords(transmatrix);
+	// the downsampled mean distances are smooth, so they keep a bilinear warp (with the homography brought to their scale)
+	cv::Mat oDownSampledTransform;
+	transmatrix.convertTo(oDownSampledTransform,CV_64F);
+	double* const h = (double*)oDownSampledTransform.data; // S*H*S^-1, with S = diag(1/ratio,1/ratio,1)
+	h[2] /= FRAMELEVEL_ANALYSIS_DOWNSAMPLE_RATIO;
+	h[5] /= FRAMELEVEL_ANALYSIS_DOWNSAMPLE_RATIO;
+	h[6] *= FRAMELEVEL_ANALYSIS_DOWNSAMPLE_RATIO;
+	h[7] *= FRAMELEVEL_ANALYSIS_DOWNSAMPLE_RATIO;
+	if(isAffine(h)) {
+		cv::warpAffine(m_oMeanDownSampledLastDistFrame_LT, m_oMeanDownSampledLastDistFrame_LT, oDownSampledTransform.rowRange(0,2), m_oDownSampledFrameSize);
+		cv::warpAffine(m_oMeanDownSampledLastDistFrame_ST, m_oMeanDownSampledLastDistFrame_ST, oDownSampledTransform.rowRange(0,2), m_oDownSampledFrameSize);
 	}
-	else if(fCurrNonZeroDescRatio>LBSPDESC_NONZERO_RATIO_MAX && m_fLastNonZeroDescRatio>LBSPDESC_NONZERO_RATIO_MAX) {
-	    for(size_t t=0; t<=UCHAR_MAX; ++t)
-	        if(m_anLBSPThreshold_8bitLUT[t]<cv::saturate_cast<uchar>(m_nLBSPThresholdOffset+UCHAR_MAX*m_fRelLBSPThreshold))
-	            ++m_anLBSPThreshold_8bitLUT[t];
+	else {
+		cv::warpPerspective(m_oMeanDownSampledLastDistFrame_LT, m_oMeanDownSampledLastDistFrame_LT, oDownSampledTransform, m_oDownSampledFrameSize);
+		cv::warpPerspective(m_oMeanDownSampledLastDistFrame_ST, m_oMeanDownSampledLastDistFrame_ST, oDownSampledTransform, m_oDownSampledFrameSize);
 	}
-	m_fLastNonZeroDescRatio = fCurrNonZeroDescRatio;
-	if(m_bLearningRateScalingEnabled) {
-		cv::resize(oInputImg,m_oDownSampledFrame_MotionAnalysis,m_oDownSampledFrameSize,0,0,cv::INTER_AREA);
-		cv::accumulateWeighted(m_oDownSampledFrame_MotionAnalysis,m_oMeanDownSampledLastDistFrame_LT,fRollAvgFactor_LT);
-		cv::accumulateWeighted(m_oDownSampledFrame_MotionAnalysis,m_oMeanDownSampledLastDistFrame_ST,fRollAvgFactor_ST);
-		size_t nTotColorDiff = 0;
-		for(int i=0; i<m_oMeanDownSampledLastDistFrame_ST.rows; ++i) {
-			const size_t idx1 = m_oMeanDownSampledLastDistFrame_ST.step.p[0]*i;
-			for(int j=0; j<m_oMeanDownSampledLastDistFrame_ST.cols; ++j) {
-				const size_t idx2 = idx1+m_oMeanDownSampledLastDistFrame_ST.step.p[1]*j;
-				nTotColorDiff += (m_nImgChannels==1)?
-					(size_t)fabs((*(float*)(m_oMeanDownSampledLastDistFrame_ST.data+idx2))-(*(float*)(m_oMeanDownSampledLastDistFrame_LT.data+idx2)))/2
-							:  //(m_nImgChannels==3)
-						std::max((size_t)fabs((*(float*)(m_oMeanDownSampledLastDistFrame_ST.data+idx2))-(*(float*)(m_oMeanDownSampledLastDistFrame_LT.data+idx2))),
-							std::max((size_t)fabs((*(float*)(m_oMeanDownSampledLastDistFrame_ST.data+idx2+4))-(*(float*)(m_oMeanDownSampledLastDistFrame_LT.data+idx2+4))),
-										(size_t)fabs((*(float*)(m_oMeanDownSampledLastDistFrame_ST.data+idx2+8))-(*(float*)(m_oMeanDownSampledLastDistFrame_LT.data+idx2+8)))));
-			}
-		}
-		const float fCurrColorDiffRatio = (float)nTotColorDiff/(m_oMeanDownSampledLastDistFrame_ST.rows*m_oMeanDownSampledLastDistFrame_ST.cols);
-		if(m_bAutoModelResetEnabled) {
-			if(m_nFramesSinceLastReset>1000)
-				m_bAutoModelResetEnabled = false;
-			else if(fCurrColorDiffRatio>=FRAMELEVEL_MIN_COLOR_DIFF_THRESHOLD && m_nModelResetCooldown==0) {
-				m_nFramesSinceLastReset = 0;
-				refreshModel(0.1f); // reset 10% of the bg model
-				m_nModelResetCooldown = m_nSamplesForMovingAvgs/4;
-				m_oUpdateRateFrame = cv::Scalar(1.0f);
-			}
-			else
-				++m_nFramesSinceLastReset;
-		}
-		else if(fCurrColorDiffRatio>=FRAMELEVEL_MIN_COLOR_DIFF_THRESHOLD*2) {
-			m_nFramesSinceLastReset = 0;
-			m_bAutoModelResetEnabled = true;
+	// scratch planes (motion analysis downsample, morph ops buffers, current blink mask) are fully rewritten before being read again, so they are not warped
+
+	// initialize empty pixel after transform (only the ROI strips uncovered by the motion are considered)
+	computeExposedSpans(transmatrix,m_voExposedSpans);
+	reinitExposedPx(newFrame,m_voExposedSpans);
+}
+
+void BackgroundSubtractorSuBSENSE::shiftModel(int nShiftX, int nShiftY) {
+	CV_Assert(m_bInitialized);
+	// moved in place: the canvas model is too large for the second copy a warp would need
+	shiftPxRecords(nShiftX,nShiftY);
+	const cv::Mat oDownSampledShift = (cv::Mat_<double>(2,3) << 1,0,(double)nShiftX/FRAMELEVEL_ANALYSIS_DOWNSAMPLE_RATIO,0,1,(double)nShiftY/FRAMELEVEL_ANALYSIS_DOWNSAMPLE_RATIO);
+	cv::warpAffine(m_oMeanDownSampledLastDistFrame_LT, m_oMeanDownSampledLastDistFrame_LT, oDownSampledShift, m_oDownSampledFrameSize);
+	cv::warpAffine(m_oMeanDownSampledLastDistFrame_ST, m_oMeanDownSampledLastDistFrame_ST, oDownSampledShift, m_oDownSampledFrameSize);
+}
+
+void BackgroundSubtractorSuBSENSE::reinitExposedRegion(const cv::Mat& oImg) {
+	CV_Assert(m_bInitialized);
+	CV_Assert(oImg.type()==m_nImgType && oImg.size()==m_oImgSize && oImg.isContinuous());
+	reinitExposedPx(oImg,m_voValidSpans);
+}
+
+void BackgroundSubtractorSuBSENSE::clearPxModel(const cv::Mat& oMask) {
+	CV_Assert(m_bInitialized);
+	CV_Assert(oMask.type()==CV_8UC1 && oMask.size()==m_oImgSize && oMask.isContinuous());
+	const size_t nSumSize = m_oBGColorSumFrame.elemSize();
+	const size_t nPxStateSize = m_oPxStateFrame.elemSize();
+	for(size_t nPxIter=0; nPxIter<m_nTotPxCount; ++nPxIter) {
+		if(oMask.data[nPxIter]) {
+			// zeroed records (T(x)=0) are picked up by the next exposed pixels reinitialization
+			memset(m_oBGSampleBank.data+nPxIter*m_nBGSampleRecordSize,0,m_nBGSampleRecordSize);
+			memset(m_oBGColorSumFrame.data+nPxIter*nSumSize,0,nSumSize);
+			memset(m_oBGDescSumFrame.data+nPxIter*nSumSize,0,nSumSize);
+			memset(m_oPxStateFrame.data+nPxIter*nPxStateSize,0,nPxStateSize);
 		}
-		if(fCurrColorDiffRatio>=FRAMELEVEL_MIN_COLOR_DIFF_THRESHOLD/2) {
-			m_fCurrLearningRateLowerCap = (float)std::max((int)FEEDBACK_T_LOWER>>(int)(fCurrColorDiffRatio/2),1);
-			m_fCurrLearningRateUpperCap = (float)std::max((int)FEEDBACK_T_UPPER>>(int)(fCurrColorDiffRatio/2),1);
+	}
+}
+
+void BackgroundSubtractorSuBSENSE::reinitExposedPx(const cv::Mat& oImg, const std::vector<PxSpan>& voSpans) {
+	if(voSpans.empty())
+		return;
+	// first pass: the last colors & descriptors of all exposed pixels are taken from the new frame, so that the samples drawn in the second pass come from it
+	cv::parallel_for_(cv::Range(0,(int)voSpans.size()),ParallelReinitInvoker(*this,oImg,voSpans,0),(double)m_nThreads);
+	// second pass: state reset & samples drawn from the neighborhood (only the pixel itself is written, neighbors are only read)
+	cv::parallel_for_(cv::Range(0,(int)voSpans.size()),ParallelReinitInvoker(*this,oImg,voSpans,1),(double)m_nThreads);
+}
+
+void BackgroundSubtractorSuBSENSE::reinitExposedPxDesc(const cv::Mat& oImg, const PxSpan& oSpan) {
+	for(int nCurrImgCoord_X=oSpan.nStartX; nCurrImgCoord_X<oSpan.nEndX; ++nCurrImgCoord_X) {
+		const size_t nPxIter = (size_t)oSpan.nY*m_oImgSize.width+nCurrImgCoord_X;
+		PxState oPxState;
+		loadPxState(nPxIter,oPxState);
+		if(oPxState.fLearningRate>=m_fCurrLearningRateLowerCap)
+			continue;
+		if(m_nImgChannels==1) {
+			m_oLastColorFrame.data[nPxIter] = oImg.data[nPxIter];
+			LBSP::computeGrayscaleDescriptor(oImg,oImg.data[nPxIter],nCurrImgCoord_X,oSpan.nY,m_anLBSPThreshold_8bitLUT[oImg.data[nPxIter]],*((ushort*)(m_oLastDescFrame.data+nPxIter*2)));
 		}
-		else {
-			m_fCurrLearningRateLowerCap = FEEDBACK_T_LOWER;
-			m_fCurrLearningRateUpperCap = FEEDBACK_T_UPPER;
+		else { //m_nImgChannels==3
+			const size_t nPxRGBIter = nPxIter*3;
+			const uchar* const anCurrColor = oImg.data+nPxRGBIter;
+			const size_t anCurrIntraLBSPThresholds[3] = {m_anLBSPThreshold_8bitLUT[anCurrColor[0]],m_anLBSPThreshold_8bitLUT[anCurrColor[1]],m_anLBSPThreshold_8bitLUT[anCurrColor[2]]};
+			for(size_t c=0; c<3; ++c)
+				m_oLastColorFrame.data[nPxRGBIter+c] = anCurrColor[c];
+			// all three channels in a single neighborhood pass
+			LBSP::computeRGBDescriptor(oImg,anCurrColor,nCurrImgCoord_X,oSpan.nY,anCurrIntraLBSPThresholds,(ushort*)(m_oLastDescFrame.data+nPxRGBIter*2));
 		}
-		if(m_nModelResetCooldown>0)
-			--m_nModelResetCooldown;
 	}
 }
 
-void BackgroundSubtractorSuBSENSE::getBackgroundImage(cv::OutputArray backgroundImage) const {
-	CV_Assert(m_bInitialized);
-	cv::Mat oAvgBGImg = cv::Mat::zeros(m_oImgSize,CV_32FC((int)m_nImgChannels));
-	for(size_t s=0; s<m_nBGSamples; ++s) {
-		for(int y=0; y<m_oImgSize.height; ++y) {
-			for(int x=0; x<m_oImgSize.width; ++x) {
-				const size_t idx_nimg = m_voBGColorSamples[s].step.p[0]*y + m_voBGColorSamples[s].step.p[1]*x;
-				const size_t nFloatIter = idx_nimg*4;
-				float* oAvgBgImgPtr = (float*)(oAvgBGImg.data+nFloatIter);
-				const uchar* const oBGImgPtr = m_voBGColorSamples[s].data+idx_nimg;
+void BackgroundSubtractorSuBSENSE::reinitExposedPxSamples(const PxSpan& oSpan, size_t nSpanIdx) {
+	// one stream per span keeps the draws independent of the thread count (the complemented seed keeps them apart from the band kernels' streams)
+	RandEngine oRandEngine(getFrameSeed(~0ULL),nSpanIdx);
+	for(int nCurrImgCoord_X=oSpan.nStartX; nCurrImgCoord_X<oSpan.nEndX; ++nCurrImgCoord_X) {
+		const size_t nPxIter = (size_t)oSpan.nY*m_oImgSize.width+nCurrImgCoord_X;
+		PxState oPxState;
+		loadPxState(nPxIter,oPxState);
+		if(oPxState.fLearningRate>=m_fCurrLearningRateLowerCap)
+			continue;
+		oPxState.fLearningRate = m_fCurrLearningRateLowerCap;
+		oPxState.fDistThresholdFactor = 1.0f;
+		oPxState.fVariationFactor = 10.0f;
+		storePxState(nPxIter,oPxState);
+		for(size_t nCurrModelIdx=0; nCurrModelIdx<m_nBGSamples; ++nCurrModelIdx) {
+			int nSampleImgCoord_Y, nSampleImgCoord_X;
+			getRandSamplePosition(nSampleImgCoord_X,nSampleImgCoord_Y,nCurrImgCoord_X,oSpan.nY,LBSP::PATCH_SIZE/2,m_oImgSize,oRandEngine);
+			const size_t nSamplePxIdx = m_oImgSize.width*nSampleImgCoord_Y + nSampleImgCoord_X;
+			if(!m_oLastFGMask.data[nSamplePxIdx]) {
 				for(size_t c=0; c<m_nImgChannels; ++c)
-					oAvgBgImgPtr[c] += ((float)oBGImgPtr[c])/m_nBGSamples;
+					setBGSample(nPxIter,nCurrModelIdx,c,m_oLastColorFrame.data[nSamplePxIdx*m_nImgChannels+c],((ushort*)m_oLastDescFrame.data)[nSamplePxIdx*m_nImgChannels+c]);
 			}
 		}
 	}
-	oAvgBGImg.convertTo(backgroundImage,CV_8U);
 }
 
-void BackgroundSubtractorSuBSENSE::getBackgroundDescriptorsImage(cv::OutputArray backgroundDescImage) const {
-	CV_Assert(LBSP::DESC_SIZE==2);
-	CV_Assert(m_bInitialized);
-	cv::Mat oAvgBGDesc = cv::Mat::zeros(m_oImgSize,CV_32FC((int)m_nImgChannels));
-	for(size_t n=0; n<m_voBGDescSamples.size(); ++n) {
-		for(int y=0; y<m_oImgSize.height; ++y) {
-			for(int x=0; x<m_oImgSize.width; ++x) {
-				const size_t idx_ndesc = m_voBGDescSamples[n].step.p[0]*y + m_voBGDescSamples[n].step.p[1]*x;
-				const size_t nFloatIter = idx_ndesc*2;
-				float* oAvgBgDescPtr = (float*)(oAvgBGDesc.data+nFloatIter);
-				const ushort* const oBGDescPtr = (ushort*)(m_voBGDescSamples[n].data+idx_ndesc);
-				for(size_t c=0; c<m_nImgChannels; ++c)
-					oAvgBgDescPtr[c] += ((float)oBGDescPtr[c])/m_voBGDescSamples.size();
-			}
+void BackgroundSubtractorSuBSENSE::computeExposedSpans(const cv::Mat& oTransform, std::vector<PxSpan>& voSpans) const {
+	cv::Mat oTransform64F;
+	oTransform.convertTo(oTransform64F,CV_64F);
+	double adQuadX[4], adQuadY[4], dOrientation;
+	if(!getWarpedQuad((double*)oTransform64F.data,m_oImgSize,adQuadX,adQuadY,dOrientation)) {
+		voSpans = m_voROISpans;
+		return;
+	}
+	// pixels inside the footprint of the last frame all map back inside of it, so only the ROI parts on its left & right can have
+	// been exposed (border pixels that still map inside through rounding are filtered out by their T(x) afterwards)
+	voSpans.clear();
+	for(int y=0; y<m_oImgSize.height; ++y) {
+		int nCoveredStartX, nCoveredEndX;
+		if(!getQuadRowRange(adQuadX,adQuadY,dOrientation,y,m_oImgSize.width,nCoveredStartX,nCoveredEndX))
+			nCoveredStartX = nCoveredEndX = 0;
+		for(size_t nSpanIter=m_vnROIRowSpanIdxs[y]; nSpanIter<m_vnROIRowSpanIdxs[y+1]; ++nSpanIter) {
+			PxSpan oLeftSpan = m_voROISpans[nSpanIter], oRightSpan = m_voROISpans[nSpanIter];
+			oLeftSpan.nEndX = std::min(oLeftSpan.nEndX,nCoveredStartX);
+			oRightSpan.nStartX = std::max(oRightSpan.nStartX,nCoveredEndX);
+			if(oLeftSpan.nStartX<oLeftSpan.nEndX)
+				voSpans.push_back(oLeftSpan);
+			if(oRightSpan.nStartX<oRightSpan.nEndX)
+				voSpans.push_back(oRightSpan);
 		}
 	}
-	oAvgBGDesc.convertTo(backgroundDescImage,CV_16U);
 }
 
-void BackgroundSubtractorSuBSENSE::update(const cv::Mat &newFrame, const cv::Mat &transmatrix) {
-	m_oLastColorFrame = newFrame.clone();
-	cv::warpPerspective(m_oLastDescFrame, m_oLastDescFrame, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oLastFGMask, m_oLastFGMask, transmatrix, m_oImgSize);
-	for (int i = 0; i < (int) m_voBGColorSamples.size(); i ++)
-		cv::warpPerspective(m_voBGColorSamples[i], m_voBGColorSamples[i], transmatrix, m_oImgSize);
-	for (int i = 0; i < (int) m_voBGDescSamples.size(); i ++)
-		cv::warpPerspective(m_voBGDescSamples[i], m_voBGDescSamples[i], transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oUpdateRateFrame, m_oUpdateRateFrame, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oDistThresholdFrame, m_oDistThresholdFrame, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oVariationModulatorFrame, m_oVariationModulatorFrame, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oMeanLastDistFrame, m_oMeanLastDistFrame, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oMeanMinDistFrame_LT, m_oMeanMinDistFrame_LT, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oMeanMinDistFrame_ST, m_oMeanMinDistFrame_ST, transmatrix, m_oImgSize);
-	//! per-pixel mean downsampled distances between consecutive frames (used to analyze camera movement and control max learning rates globally)
-	cv::warpPerspective(m_oMeanDownSampledLastDistFrame_LT, m_oMeanDownSampledLastDistFrame_LT, transmatrix, m_oDownSampledFrameSize);
-	cv::warpPerspective(m_oMeanDownSampledLastDistFrame_ST, m_oMeanDownSampledLastDistFrame_ST, transmatrix, m_oDownSampledFrameSize);
-	//! pre-allocated matrix used to downsample the input frame when needed
-	cv::warpPerspective(m_oDownSampledFrame_MotionAnalysis, m_oDownSampledFrame_MotionAnalysis, transmatrix, m_oDownSampledFrameSize);
-	
-	cv::warpPerspective(m_oMeanRawSegmResFrame_LT, m_oMeanRawSegmResFrame_LT, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oMeanRawSegmResFrame_ST, m_oMeanRawSegmResFrame_ST, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oMeanFinalSegmResFrame_LT, m_oMeanFinalSegmResFrame_LT, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oMeanFinalSegmResFrame_ST, m_oMeanFinalSegmResFrame_ST, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oUnstableRegionMask, m_oUnstableRegionMask, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oBlinksFrame, m_oBlinksFrame, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oLastRawFGMask, m_oLastRawFGMask, transmatrix, m_oImgSize);
-	// m_oLastRawFGMask = resultFrame.clone();
-	//! pre-allocated CV_8UC1 matrices used to speed up morph ops
-	cv::warpPerspective(m_oFGMask_PreFlood, m_oFGMask_PreFlood, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oFGMask_FloodedHoles, m_oFGMask_FloodedHoles, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oLastFGMask_dilated, m_oLastFGMask_dilated, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oLastFGMask_dilated_inverted, m_oLastFGMask_dilated_inverted, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oCurrRawFGBlinkMask, m_oCurrRawFGBlinkMask, transmatrix, m_oImgSize);
-	cv::warpPerspective(m_oLastRawFGBlinkMask, m_oLastRawFGBlinkMask, transmatrix, m_oImgSize);
-	
-	// initialize empty pixel after transform
-	if (m_nImgChannels == 1) {
-		for (size_t nPxIter=0; nPxIter < m_nTotPxCount; nPxIter ++) {
-			if (m_oROI.data[nPxIter] && m_oUpdateRateFrame.at<float>(nPxIter) < m_fCurrLearningRateLowerCap) {
-				const size_t nDescIter = nPxIter*2;
-				LBSP::computeGrayscaleDescriptor(newFrame, newFrame.data[nPxIter], m_aPxInfoLUT[nPxIter].nImgCoord_X, m_aPxInfoLUT[nPxIter].nImgCoord_Y, m_anLBSPThreshold_8bitLUT[newFrame.data[nPxIter]], *((ushort*)(m_oLastDescFrame.data+nDescIter)));
-				m_oUpdateRateFrame.at<float>(nPxIter) = m_fCurrLearningRateLowerCap;
-				m_oDistThresholdFrame.at<float>(nPxIter) = 1.0f;
-				m_oVariationModulatorFrame.at<float>(nPxIter) = 10.0f;
-				for (size_t nCurrModelIdx = 0; nCurrModelIdx < m_nBGSamples; nCurrModelIdx ++) {
-					int nSampleImgCoord_Y, nSampleImgCoord_X;
-					getRandSamplePosition(nSampleImgCoord_X, nSampleImgCoord_Y, m_aPxInfoLUT[nPxIter].nImgCoord_X, m_aPxInfoLUT[nPxIter].nImgCoord_Y, LBSP::PATCH_SIZE/2,m_oImgSize);
-					const size_t nSamplePxIdx = m_oImgSize.width*nSampleImgCoord_Y + nSampleImgCoord_X;
-					if (!m_oLastFGMask.data[nSamplePxIdx]) {
-						const size_t nCurrRealModelIdx = nCurrModelIdx%m_nBGSamples;
-						m_voBGColorSamples[nCurrRealModelIdx].data[nPxIter] = m_oLastColorFrame.data[nSamplePxIdx];
-						*((ushort*)(m_voBGDescSamples[nCurrRealModelIdx].data+nPxIter*2)) = *((ushort*)(m_oLastDescFrame.data+nSamplePxIdx*2));
-					}
-				}
+size_t BackgroundSubtractorSuBSENSE::getModelPlanes(cv::Mat** apPlanes, bool bWithLastColor) {
+	// every plane that is read before being rewritten on the next frame (the morph ops & blink scratch planes are skipped)
+	cv::Mat* const apModelPlanes[s_nModelPlanes] = {
+		&m_oBGSampleBank,&m_oBGColorSumFrame,&m_oBGDescSumFrame,&m_oPxStateFrame,&m_oLastDescFrame,&m_oLastFGMask,
+		&m_oUnstableRegionMask,&m_oBlinksFrame,&m_oLastRawFGMask,&m_oLastFGMask_dilated_inverted,&m_oLastRawFGBlinkMask,
+		&m_oLastColorFrame,
+	};
+	// the last color frame comes last, so that it can be left out when it is about to be overwritten anyway
+	const size_t nPlanes = s_nModelPlanes-(bWithLastColor?0:1);
+	std::copy(apModelPlanes,apModelPlanes+nPlanes,apPlanes);
+	return nPlanes;
+}
+
+void BackgroundSubtractorSuBSENSE::shiftPxRecords(int nShiftX, int nShiftY) {
+	cv::Mat* apPlanes[s_nModelPlanes];
+	const size_t nPlanes = getModelPlanes(apPlanes,true);
+	const int nWidth = m_oImgSize.width, nHeight = m_oImgSize.height;
+	// destination row segment [nDstStartX,nDstEndX) comes from the same segment shifted by -nShiftX in row y-nShiftY
+	const int nDstStartX = std::max(nShiftX,0), nDstEndX = std::min(nWidth+nShiftX,nWidth);
+	for(size_t n=0; n<nPlanes; ++n) {
+		CV_Assert(apPlanes[n]->isContinuous() && (apPlanes[n]->total()*apPlanes[n]->elemSize())%m_nTotPxCount==0);
+		const size_t nRecordSize = apPlanes[n]->total()*apPlanes[n]->elemSize()/m_nTotPxCount;
+		const size_t nRowSize = nWidth*nRecordSize;
+		// rows are visited away from the direction of the shift, so that each source row is read before it gets overwritten
+		for(int i=0; i<nHeight; ++i) {
+			const int y = nShiftY>0?nHeight-1-i:i;
+			const int nSrcY = y-nShiftY;
+			uchar* const pDstRow = apPlanes[n]->data+(size_t)y*nRowSize;
+			if(nSrcY<0 || nSrcY>=nHeight || nDstStartX>=nDstEndX) {
+				memset(pDstRow,0,nRowSize);
+				continue;
 			}
+			memmove(pDstRow+nDstStartX*nRecordSize,apPlanes[n]->data+(size_t)nSrcY*nRowSize+(nDstStartX-nShiftX)*nRecordSize,(nDstEndX-nDstStartX)*nRecordSize);
+			memset(pDstRow,0,nDstStartX*nRecordSize);
+			memset(pDstRow+nDstEndX*nRecordSize,0,(nWidth-nDstEndX)*nRecordSize);
 		}
 	}
-	else { // m_nImgChannels == 3
-		for (size_t nPxIter = 0; nPxIter < m_nTotPxCount; nPxIter++) {
-			if (m_oROI.data[nPxIter] && m_oUpdateRateFrame.at<float>(nPxIter) < m_fCurrLearningRateLowerCap) {
-				const size_t nPxRGBIter = nPxIter*3;
-				const size_t nDescRGBIter = nPxRGBIter*2;
-				for (size_t c = 0; c < 3; c ++) {
-					LBSP::computeSingleRGBDescriptor(newFrame, newFrame.data[nPxRGBIter+c], m_aPxInfoLUT[nPxIter].nImgCoord_X, m_aPxInfoLUT[nPxIter].nImgCoord_Y, c, m_anLBSPThreshold_8bitLUT[newFrame.data[nPxRGBIter+c]],((ushort*)(m_oLastDescFrame.data+nDescRGBIter))[c]);
-				}
-				m_oUpdateRateFrame.at<float>(nPxIter) = m_fCurrLearningRateLowerCap;
-				m_oDistThresholdFrame.at<float>(nPxIter) = 1.0f;
-				m_oVariationModulatorFrame.at<float>(nPxIter) = 10.0f;
-				for (size_t nCurrModelIdx = 0; nCurrModelIdx < m_nBGSamples; nCurrModelIdx ++) {
-					int nSampleImgCoord_Y, nSampleImgCoord_X;
-					getRandSamplePosition(nSampleImgCoord_X, nSampleImgCoord_Y, m_aPxInfoLUT[nPxIter].nImgCoord_X, m_aPxInfoLUT[nPxIter].nImgCoord_Y, LBSP::PATCH_SIZE/2, m_oImgSize);
-					const size_t nSamplePxIdx = m_oImgSize.width*nSampleImgCoord_Y + nSampleImgCoord_X;
-					if (!m_oLastFGMask.data[nSamplePxIdx]) {
-						const size_t nCurrRealModelIdx = nCurrModelIdx%m_nBGSamples;
-						for(size_t c = 0; c < 3; c ++) {
-							m_voBGColorSamples[nCurrRealModelIdx].data[nPxIter*3+c] = m_oLastColorFrame.data[nSamplePxIdx*3+c];
-							*((ushort*)(m_voBGDescSamples[nCurrRealModelIdx].data+(nPxIter*3+c)*2)) = *((ushort*)(m_oLastDescFrame.data+(nSamplePxIdx*3+c)*2));
-						}
-					}
-				}
-			}
+}
+
+void BackgroundSubtractorSuBSENSE::warpPxRecords(const cv::Mat& oTransform, bool bWithLastColor) {
+	cv::Mat* apPlanes[s_nModelPlanes];
+	const size_t nPlanes = getModelPlanes(apPlanes,bWithLastColor);
+	m_voWarpBuffers.resize(nPlanes);
+	std::vector<size_t> vnRecordSizes(nPlanes);
+	for(size_t n=0; n<nPlanes; ++n) {
+		CV_Assert(apPlanes[n]->isContinuous() && (apPlanes[n]->total()*apPlanes[n]->elemSize())%m_nTotPxCount==0);
+		m_voWarpBuffers[n].create(apPlanes[n]->size(),apPlanes[n]->type());
+		vnRecordSizes[n] = apPlanes[n]->total()*apPlanes[n]->elemSize()/m_nTotPxCount;
+	}
+	cv::Mat oInvTransform;
+	oTransform.convertTo(oInvTransform,CV_64F);
+	if(isIntegerShift((const double*)oInvTransform.data)) {
+		// inverted by hand to keep the shift exact
+		((double*)oInvTransform.data)[2] = -((double*)oInvTransform.data)[2];
+		((double*)oInvTransform.data)[5] = -((double*)oInvTransform.data)[5];
+	}
+	else
+		cv::invert(oInvTransform,oInvTransform,cv::DECOMP_LU);
+	cv::parallel_for_(cv::Range(0,m_oImgSize.height),ParallelWarpInvoker(*this,(const double*)oInvTransform.data,apPlanes,&m_voWarpBuffers[0],&vnRecordSizes[0],nPlanes),(double)m_nThreads);
+	for(size_t n=0; n<nPlanes; ++n)
+		cv::swap(*apPlanes[n],m_voWarpBuffers[n]);
+}
+
+cv::Mat BackgroundSubtractorSuBSENSE::getPxStatePlane(size_t nFieldOffset) const {
+	CV_Assert(m_bInitialized && nFieldOffset<sizeof(PxState) && (nFieldOffset%sizeof(float))==0);
+	cv::Mat oPlane;
+	if(!m_bLeanPxState)
+		cv::extractChannel(m_oPxStateFrame,oPlane,(int)(nFieldOffset/sizeof(float)));
+	else {
+		oPlane.create(m_oImgSize,CV_32FC1);
+		for(size_t nPxIter=0; nPxIter<m_nTotPxCount; ++nPxIter) {
+			PxState oPxState;
+			loadPxState(nPxIter,oPxState);
+			((float*)oPlane.data)[nPxIter] = *(const float*)((const uchar*)&oPxState+nFieldOffset);
 		}
-	}	
+	}
+	return oPlane;
 }
 
-void BackgroundSubtractorSuBSENSE::complete(cv::OutputArray &fgMask) {
-	cv::Mat a = fgMask.getMat();
-	imwrite("a0.jpg", a);
-	cv::morphologyEx(a,m_oFGMask_PreFlood,cv::MORPH_CLOSE,cv::Mat());
-	m_oFGMask_PreFlood.copyTo(m_oFGMask_FloodedHoles);
-	cv::floodFill(m_oFGMask_FloodedHoles,cv::Point(0,0),UCHAR_MAX);
-	cv::bitwise_not(m_oFGMask_FloodedHoles,m_oFGMask_FloodedHoles);
-	cv::erode(m_oFGMask_PreFlood,m_oFGMask_PreFlood,cv::Mat(),cv::Point(-1,-1),3);
-	cv::bitwise_or(a,m_oFGMask_FloodedHoles,a);
-	imwrite("a1.jpg", a);
-	cv::bitwise_or(a,m_oFGMask_PreFlood,a);
-	imwrite("a2.jpg", a);
-	cv::medianBlur(a,m_oLastFGMask,m_nMedianBlurKernelSize);
-	cv::dilate(m_oLastFGMask,m_oLastFGMask_dilated,cv::Mat(),cv::Point(-1,-1),3);
-	cv::bitwise_and(m_oBlinksFrame,m_oLastFGMask_dilated_inverted,m_oBlinksFrame);
-	cv::bitwise_not(m_oLastFGMask_dilated,m_oLastFGMask_dilated_inverted);
-	cv::bitwise_and(m_oBlinksFrame,m_oLastFGMask_dilated_inverted,m_oBlinksFrame);
-	m_oLastFGMask.copyTo(a);
-	a.convertTo(fgMask, CV_8U);
+void BackgroundSubtractorSuBSENSE::loadPxState(size_t nPxIter, PxState& oPxState) const {
+	if(m_bLeanPxState)
+		decodePxState(getLeanPxState(nPxIter),oPxState);
+	else
+		oPxState = getPxState(nPxIter);
+}
+
+void BackgroundSubtractorSuBSENSE::storePxState(size_t nPxIter, const PxState& oPxState) {
+	if(m_bLeanPxState)
+		encodePxState(oPxState,getLeanPxState(nPxIter));
+	else
+		getPxState(nPxIter) = oPxState;
+}
+
+size_t BackgroundSubtractorSuBSENSE::getPxStateFootprint() const {
+	return m_bLeanPxState?sizeof(PxStateLean):sizeof(PxState);
+}
+
+void BackgroundSubtractorSuBSENSE::setRandSeed(uint64 nSeed) {
+	m_nRandSeed = nSeed;
+	m_oRandEngine.seed(m_nRandSeed);
+}
+
+void BackgroundSubtractorSuBSENSE::setSIMDKernelsEnabled(bool bEnabled) {
+	m_bUseSIMDKernels = bEnabled;
+}
+
+void BackgroundSubtractorSuBSENSE::setDiagnostics(DiagnosticsSink* pDiagnostics) {
+	m_pDiagnostics = pDiagnostics;
+}
+
+void BackgroundSubtractorSuBSENSE::complete(cv::OutputArray &fgMask, const cv::Rect& oWindow) {
+	const cv::Rect oWin = (oWindow.area()>0)?(oWindow&cv::Rect(0,0,m_oImgSize.width,m_oImgSize.height)):cv::Rect(0,0,m_oImgSize.width,m_oImgSize.height);
+	cv::Mat oFGMask = fgMask.getMat();
+	CV_Assert(oFGMask.size()==m_oImgSize);
+	cv::Mat a = oFGMask(oWin);
+	cv::Mat oLastFGMaskWin = m_oLastFGMask(oWin), oBlinksFrameWin = m_oBlinksFrame(oWin), oLastFGMaskDilatedInvertedWin = m_oLastFGMask_dilated_inverted(oWin);
+	// the scratch planes are model-sized too, their window views are written in place (no reallocation when the window size changes)
+	cv::Mat oPreFloodWin = m_oFGMask_PreFlood(oWin), oFloodedHolesWin = m_oFGMask_FloodedHoles(oWin), oLastFGMaskDilatedWin = m_oLastFGMask_dilated(oWin);
+	if(m_pDiagnostics)
+		m_pDiagnostics->post("complete_input",a);
+	cv::morphologyEx(a,oPreFloodWin,cv::MORPH_CLOSE,cv::Mat());
+	oPreFloodWin.copyTo(oFloodedHolesWin);
+	cv::floodFill(oFloodedHolesWin,cv::Point(0,0),UCHAR_MAX);
+	cv::bitwise_not(oFloodedHolesWin,oFloodedHolesWin);
+	cv::erode(oPreFloodWin,oPreFloodWin,cv::Mat(),cv::Point(-1,-1),3);
+	cv::bitwise_or(a,oFloodedHolesWin,a);
+	if(m_pDiagnostics)
+		m_pDiagnostics->post("complete_filled",a);
+	cv::bitwise_or(a,oPreFloodWin,a);
+	if(m_pDiagnostics)
+		m_pDiagnostics->post("complete_closed",a);
+	cv::medianBlur(a,oLastFGMaskWin,m_nMedianBlurKernelSize);
+	cv::dilate(oLastFGMaskWin,oLastFGMaskDilatedWin,cv::Mat(),cv::Point(-1,-1),3);
+	cv::bitwise_and(oBlinksFrameWin,oLastFGMaskDilatedInvertedWin,oBlinksFrameWin);
+	cv::bitwise_not(oLastFGMaskDilatedWin,oLastFGMaskDilatedInvertedWin);
+	cv::bitwise_and(oBlinksFrameWin,oLastFGMaskDilatedInvertedWin,oBlinksFrameWin);
+	oLastFGMaskWin.copyTo(a);
+	oFGMask.convertTo(fgMask, CV_8U);
 }
 
-int BackgroundSubtractorSuBSENSE::dist(const cv::Mat &a, const cv::Mat &b, int ax, int ay, int bx, int by, int cutoff) const{
+int BackgroundSubtractorSuBSENSE::dist(const cv::Mat &a, const cv::Mat &b, int ax, int ay, int bx, int by, int cutoff, int nPatchSize) const{
 	int ans = 0;
-	for (int dy = 0; dy < patch_w; dy++) {
-		for (int dx = 0; dx < patch_w; dx++) {
-			size_t anPxIter = ay * m_oImgSize.width + ax, bnPxIter = by * m_oImgSize.width + bx;
-			if (a.channels() == 1) {
-				int d = a.data[anPxIter] - b.data[bnPxIter];
-				ans += d*d;
-			} else {
-				anPxIter *= 3, bnPxIter *= 3;
-				for (size_t c = 0; c < 3; c++) {
-					int d = a.data[anPxIter+c] - b.data[bnPxIter+c];
-					ans += d*d;
-				}
-			}
-		}
+	const int nChannels = a.channels();
+	for (int dy = 0; dy < nPatchSize; dy++) {
+		ans += L2sqrdistSum(a.ptr<uchar>(ay + dy) + ax * nChannels, b.ptr<uchar>(by + dy) + bx * nChannels, (size_t)(nPatchSize * nChannels));
 		if (ans >= cutoff) { return cutoff; }
 	}
 	return ans;
 }
 
-void BackgroundSubtractorSuBSENSE::improve_guess(const cv::Mat &a, const cv::Mat &b, int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by) {
-	int d = dist(a, b, ax, ay, bx, by, dbest);
+class BackgroundSubtractorSuBSENSE::ParallelPatchDistInvoker : public cv::ParallelLoopBody {
+public:
+	ParallelPatchDistInvoker(BackgroundSubtractorSuBSENSE& oBGS, const cv::Mat& oImgA, const cv::Mat& oImgB, int nPatchSize, cv::Mat& oPatchDist, size_t nPass)
+		:	 m_oBGS(oBGS)
+			,m_oImgA(oImgA)
+			,m_oImgB(oImgB)
+			,m_nPatchSize(nPatchSize)
+			,m_oPatchDist(oPatchDist)
+			,m_nPass(nPass) {}
+	virtual void operator()(const cv::Range& oRange) const {
+		if(m_nPass==0)
+			m_oBGS.computePatchSqrDiffRows(m_oImgA,m_oImgB,oRange.start,oRange.end);
+		else
+			m_oBGS.computePatchSumRows(m_nPatchSize,m_oPatchDist,oRange.start,oRange.end);
+	}
+private:
+	BackgroundSubtractorSuBSENSE& m_oBGS;
+	const cv::Mat& m_oImgA;
+	const cv::Mat& m_oImgB;
+	const int m_nPatchSize;
+	cv::Mat& m_oPatchDist;
+	const size_t m_nPass;
+};
+
+void BackgroundSubtractorSuBSENSE::computePatchDist(const cv::Mat& oImgA, const cv::Mat& oImgB, int nPatchSize, cv::Mat& oPatchDist) {
+	CV_Assert(oImgA.size()==oImgB.size() && oImgA.type()==oImgB.type() && (oImgA.type()==CV_8UC1 || oImgA.type()==CV_8UC3));
+	CV_Assert(nPatchSize>0 && nPatchSize<=oImgA.cols && nPatchSize<=oImgA.rows);
+	m_oPatchSqrDiff.create(oImgA.size(),CV_32SC1);
+	oPatchDist.create(oImgA.rows-nPatchSize+1,oImgA.cols-nPatchSize+1,CV_32SC1);
+	// both passes are O(1) per pixel: the squared differences are computed once, and each patch sum reuses its neighbors' ones
+	cv::parallel_for_(cv::Range(0,oImgA.rows),ParallelPatchDistInvoker(*this,oImgA,oImgB,nPatchSize,oPatchDist,0),(double)m_nThreads);
+	cv::parallel_for_(cv::Range(0,oPatchDist.rows),ParallelPatchDistInvoker(*this,oImgA,oImgB,nPatchSize,oPatchDist,1),(double)m_nThreads);
+}
+
+void BackgroundSubtractorSuBSENSE::computePatchSqrDiffRows(const cv::Mat& oImgA, const cv::Mat& oImgB, int nStartY, int nEndY) {
+	const int nChannels = oImgA.channels();
+	const size_t nRowElements = (size_t)oImgA.cols*nChannels;
+	std::vector<ushort> vnRowSqrDiff(nRowElements);
+	for(int y=nStartY; y<nEndY; ++y) {
+		int* anSqrDiff = m_oPatchSqrDiff.ptr<int>(y);
+		L2sqrdistArray(oImgA.ptr<uchar>(y),oImgB.ptr<uchar>(y),vnRowSqrDiff.data(),nRowElements);
+		if(nChannels==1) {
+			for(int x=0; x<oImgA.cols; ++x)
+				anSqrDiff[x] = vnRowSqrDiff[x];
+		}
+		else {
+			for(int x=0; x<oImgA.cols; ++x)
+				anSqrDiff[x] = (int)vnRowSqrDiff[x*3]+vnRowSqrDiff[x*3+1]+vnRowSqrDiff[x*3+2];
+		}
+	}
+}
+
+void BackgroundSubtractorSuBSENSE::computePatchSumRows(int nPatchSize, cv::Mat& oPatchDist, int nStartY, int nEndY) const {
+	const int nCols = m_oPatchSqrDiff.cols;
+	// vertical sums of the nPatchSize rows below the current one, slid down one row at a time
+	std::vector<int> vnColSums(nCols,0);
+	for(int y=nStartY; y<nStartY+nPatchSize; ++y) {
+		const int* anSqrDiff = m_oPatchSqrDiff.ptr<int>(y);
+		for(int x=0; x<nCols; ++x)
+			vnColSums[x] += anSqrDiff[x];
+	}
+	for(int y=nStartY; y<nEndY; ++y) {
+		if(y>nStartY) {
+			const int* anSqrDiffOut = m_oPatchSqrDiff.ptr<int>(y-1);
+			const int* anSqrDiffIn = m_oPatchSqrDiff.ptr<int>(y+nPatchSize-1);
+			for(int x=0; x<nCols; ++x)
+				vnColSums[x] += anSqrDiffIn[x]-anSqrDiffOut[x];
+		}
+		// horizontal sliding window over the column sums
+		int* anPatchDist = oPatchDist.ptr<int>(y);
+		int nSum = 0;
+		for(int x=0; x<nPatchSize; ++x)
+			nSum += vnColSums[x];
+		anPatchDist[0] = nSum;
+		for(int x=1; x<oPatchDist.cols; ++x) {
+			nSum += vnColSums[x+nPatchSize-1]-vnColSums[x-1];
+			anPatchDist[x] = nSum;
+		}
+	}
+}
+
+void BackgroundSubtractorSuBSENSE::improve_guess(const cv::Mat &a, const cv::Mat &b, int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by) const {
+	int d = dist(a, b, ax, ay, bx, by, dbest, patch_w2);
 	if (d < dbest) {
 		dbest = d;
 		xbest = bx;
@@ -871,111 +1462,328 @@ void BackgroundSubtractorSuBSENSE::improve_guess(const cv::Mat &a, const cv::Mat
 	}
 }
 
-void BackgroundSubtractorSuBSENSE::patch_match(const cv::Mat &a, const cv::Mat &b, std::vector<cv::Point2i> &ans, cv::Mat & ansMat, cv::Mat matrix) {
-	/* Initialize with random nearest neighbor field (NNF). */
-	ans.clear();
-	ans.resize(m_nTotPxCount);
-	std::vector<double> annd;
-	annd.resize(m_nTotPxCount);
+void BackgroundSubtractorSuBSENSE::setPatchMatchParams(size_t nIters, double dBudgetMs, int nSearchRadius) {
+	CV_Assert(dBudgetMs>=0 && nSearchRadius>0);
+	m_nPatchMatchIters = nIters;
+	m_dPatchMatchBudgetMs = dBudgetMs;
+	m_nPatchMatchRadius = nSearchRadius;
+}
+
+size_t BackgroundSubtractorSuBSENSE::getLastPatchMatchIters() const {
+	return m_nLastPatchMatchIters;
+}
+
+size_t BackgroundSubtractorSuBSENSE::getLastPatchMatchEvals() const {
+	return m_nLastPatchMatchEvals;
+}
+
+class BackgroundSubtractorSuBSENSE::ParallelPatchMatchInvoker : public cv::ParallelLoopBody {
+public:
+	ParallelPatchMatchInvoker(const BackgroundSubtractorSuBSENSE& oBGS, PatchMatchContext& oCtx)
+		:	 m_oBGS(oBGS)
+			,m_oCtx(oCtx) {}
+	virtual void operator()(const cv::Range& oRange) const {
+		for(int r=oRange.start; r<oRange.end; ++r)
+			m_oBGS.refinePatchMatchTile(m_oCtx,(size_t)r);
+	}
+private:
+	const BackgroundSubtractorSuBSENSE& m_oBGS;
+	PatchMatchContext& m_oCtx;
+};
+
+void BackgroundSubtractorSuBSENSE::refinePatchMatchTile(PatchMatchContext& oCtx, size_t nTileIdx) const {
+	const cv::Mat& a = *oCtx.pImgA;
+	const cv::Mat& b = *oCtx.pImgB;
+	const int nJump = oCtx.nJump;
+	const int anJumpX[4] = {-nJump,nJump,0,0}, anJumpY[4] = {0,0,-nJump,nJump};
+	const int nSearchStart = std::min(m_nPatchMatchRadius,std::max(a.cols,a.rows));
+	RandEngine oRandEngine(getFrameSeed((uint64)(oCtx.nIter+1)*0xBF58476D1CE4E5B9ULL),nTileIdx);
+	const cv::Rect& oActiveRect = oCtx.oActiveRect;
+	const int nStartY = std::max((int)nTileIdx*PATCHMATCH_TILE_ROWS,oActiveRect.y);
+	const int nEndY = std::min((int)(nTileIdx+1)*PATCHMATCH_TILE_ROWS,oActiveRect.y+oActiveRect.height);
+	size_t nEvals = 0, nImproved = 0;
+	for(int ay=nStartY; ay<nEndY; ++ay) {
+		const uchar* anActiveBlocks = oCtx.pActiveBlocks?oCtx.pActiveBlocks->ptr<uchar>(ay/pm_block_w):NULL;
+		for(int ax=oActiveRect.x; ax<oActiveRect.x+oActiveRect.width; ++ax) {
+			if(anActiveBlocks && !anActiveBlocks[ax/pm_block_w]) {
+				// skips the rest of the inactive block
+				ax = (ax/pm_block_w+1)*pm_block_w-1;
+				continue;
+			}
+			const size_t idx = (size_t)ay*a.cols+ax;
+			const std::vector<cv::Point2i>& voPrevNNF = *oCtx.pvoPrevNNF;
+			int xbest = voPrevNNF[idx].x, ybest = voPrevNNF[idx].y, dbest = (*oCtx.pvnPrevDist)[idx];
+			// propagation: the neighbors one jump away (read from the previous pass, so tiles are independent) suggest their shifted match
+			for(int n=0; n<4; ++n) {
+				const int nx = ax+anJumpX[n], ny = ay+anJumpY[n];
+				if((unsigned)nx>=(unsigned)oCtx.nEffWidthA || (unsigned)ny>=(unsigned)oCtx.nEffHeightA)
+					continue;
+				// the NNF of the inactive patches is not kept up to date
+				if(oCtx.pActiveBlocks && !oCtx.pActiveBlocks->at<uchar>(ny/pm_block_w,nx/pm_block_w))
+					continue;
+				const cv::Point2i& oNeighbor = voPrevNNF[(size_t)ny*a.cols+nx];
+				const int xp = oNeighbor.x-anJumpX[n], yp = oNeighbor.y-anJumpY[n];
+				if((unsigned)xp<(unsigned)oCtx.nEffWidthB && (unsigned)yp<(unsigned)oCtx.nEffHeightB && (xp!=xbest || yp!=ybest)) {
+					improve_guess(a,b,ax,ay,xbest,ybest,dbest,xp,yp);
+					++nEvals;
+				}
+			}
+			// random search in windows of exponentially decreasing size around the best guess
+			for(int mag=nSearchStart; mag>=1; mag/=2) {
+				const int xmin = std::max(xbest-mag,0), xmax = std::min(xbest+mag+1,oCtx.nEffWidthB);
+				const int ymin = std::max(ybest-mag,0), ymax = std::min(ybest+mag+1,oCtx.nEffHeightB);
+				if(xmin>=xmax || ymin>=ymax)
+					continue;
+				const int xp = xmin+(int)oRandEngine((unsigned)(xmax-xmin));
+				const int yp = ymin+(int)oRandEngine((unsigned)(ymax-ymin));
+				improve_guess(a,b,ax,ay,xbest,ybest,dbest,xp,yp);
+				++nEvals;
+			}
+			if(dbest<(*oCtx.pvnPrevDist)[idx])
+				++nImproved;
+			(*oCtx.pvoNNF)[idx] = cv::Point2i(xbest,ybest);
+			(*oCtx.pvnDist)[idx] = dbest;
+		}
+	}
+	oCtx.vnTileEvals[nTileIdx] = nEvals;
+	oCtx.vnTileImproved[nTileIdx] = nImproved;
+}
+
+void BackgroundSubtractorSuBSENSE::getPatchMatchActivity(const cv::Mat& oFGMask, int nMargin, cv::Mat& oActiveBlocks) {
+	CV_Assert(!oFGMask.empty() && oFGMask.type()==CV_8UC1 && nMargin>=0);
+	const cv::Size oBlocksSize((oFGMask.cols+pm_block_w-1)/pm_block_w,(oFGMask.rows+pm_block_w-1)/pm_block_w);
+	oActiveBlocks.create(oBlocksSize,CV_8UC1);
+	oActiveBlocks = cv::Scalar_<uchar>(0);
+	for(int y=0; y<oFGMask.rows; ++y) {
+		const uchar* anFG = oFGMask.ptr<uchar>(y);
+		uchar* anBlocks = oActiveBlocks.ptr<uchar>(y/pm_block_w);
+		for(int x=0; x<oFGMask.cols; ++x)
+			anBlocks[x/pm_block_w] |= anFG[x];
+	}
+	// the margin is rounded up to whole blocks
+	const int nMarginBlocks = (nMargin+pm_block_w-1)/pm_block_w;
+	if(nMarginBlocks>0)
+		cv::dilate(oActiveBlocks,oActiveBlocks,cv::getStructuringElement(cv::MORPH_RECT,cv::Size(2*nMarginBlocks+1,2*nMarginBlocks+1)));
+}
+
+void BackgroundSubtractorSuBSENSE::patch_match(const cv::Mat &a, const cv::Mat &b, std::vector<cv::Point2i> &ans, cv::Mat & ansMat, cv::Mat matrix, const cv::Mat &oActiveBlocks) {
+	/* Initialize the nearest neighbor field (NNF) with the homography, warm-started from the last frame's NNF, random where nothing is known. */
+	CV_Assert(a.size()==b.size() && a.type()==b.type());
+	const bool bSparse = !oActiveBlocks.empty();
+	CV_Assert(!bSparse || (oActiveBlocks.type()==CV_8UC1 && oActiveBlocks.cols==(a.cols+pm_block_w-1)/pm_block_w && oActiveBlocks.rows==(a.rows+pm_block_w-1)/pm_block_w));
+	const int64 nStartTick = cv::getTickCount();
+	m_nLastPatchMatchIters = 0;
+	m_nLastPatchMatchEvals = 0;
+	// the NNF & distance buffers are kept between frames; the last frame's NNF (and the homography matches it started from) seeds this one
+	const bool bWarmStart = m_voPatchNNF.size()==a.total() && m_oPatchNNFSize==a.size();
+	if (bWarmStart) {
+		m_voPatchPrevNNF.swap(m_voPatchNNF);
+		m_voPatchPrevPred.swap(m_voPatchNNFPred);
+	}
+	// in sparse mode, the last frame's NNF was only written in its active blocks
+	const cv::Mat* pPrevActiveBlocks = (bWarmStart && !m_oPatchNNFActiveBlocks.empty()) ? &m_oPatchNNFActiveBlocks : NULL;
+	std::vector<cv::Point2i>& nnf = m_voPatchNNF;
+	std::vector<int>& annd = m_vnPatchNNDist;
+	nnf.resize(a.total());
+	annd.resize(a.total());
+	m_voPatchNNFPred.resize(a.total());
+	m_oPatchNNFSize = a.size();
 	ansMat.create(a.size(), CV_8UC1);
 	ansMat = cv::Scalar(0);
 
 	int aew = a.cols - patch_w2 + 1, aeh = a.rows - patch_w2 + 1;       /* Effective width and height (possible upper left corners of patches). */
 	int bew = a.cols - patch_w2 + 1, beh = a.rows - patch_w2 + 1;
-	std::vector<cv::Point2f> p1, p2;
-	for (int ay = 0; ay < aeh; ay++)
-		for (int ax = 0; ax < aew; ax++) p1.push_back(cv::Point2f(ax, ay));
-	p2.reserve(p1.size());
-	cv::perspectiveTransform(p1, p2, matrix);
-
-	int p = 0;
-	for (int ay = 0; ay < aeh; ay++) {
-		for (int ax = 0; ax < aew; ax++) {
-			int idx = ay*m_oImgSize.width + ax;
-			int bx = int(p2[p].x);
-			int by = int(p2[p++].y);
-			if (!(0<=bx && bx<m_oImgSize.width && 0<=by && by<m_oImgSize.height)) {
-				bx = rand()%bew; by = rand()%beh;
-				ans[idx] = cv::Point2i(bx, by);
-				annd[idx] = dist(a, b, ax, ay, bx, by);
-				for (int ii = 0; ii < pm_iters; ii++) {
-					bx = rand()%bew; by = rand()%beh;
-					int disnow = dist(a, b, ax, ay, bx, by);
-					if (disnow < annd[idx]) {
-						ans[idx] = cv::Point2i(bx, by);
-						annd[idx] = disnow;
-					}
+	if (aew <= 0 || aeh <= 0) {
+		m_oPatchNNFSize = cv::Size();
+		ans = nnf;
+		return;
+	}
+	cv::Mat oTransform;
+	matrix.convertTo(oTransform, CV_64F);
+	const double* h = (const double*)oTransform.data;
+	// all the loops below only visit the patches of the bounding box of the active blocks (the whole frame in dense mode), skipping the inactive blocks
+	cv::Rect oActiveRect(0, 0, aew, aeh);
+	if (bSparse) {
+		int nMinX = oActiveBlocks.cols, nMaxX = -1, nMinY = oActiveBlocks.rows, nMaxY = -1;
+		for (int y = 0; y < oActiveBlocks.rows; y++) {
+			const uchar* anBlocks = oActiveBlocks.ptr<uchar>(y);
+			for (int x = 0; x < oActiveBlocks.cols; x++) {
+				if (anBlocks[x]) {
+					nMinX = std::min(nMinX, x); nMaxX = std::max(nMaxX, x);
+					nMinY = std::min(nMinY, y); nMaxY = std::max(nMaxY, y);
 				}
-			} else {
-				ans[idx] = cv::Point2i(bx, by);
-				annd[idx] = dist(a, b, ax, ay, bx, by);
 			}
-			annd[idx] /= patch_w2 * patch_w2;
-			if (annd[idx] / 52 >= 1) ansMat.data[idx] = 255;
-			else ansMat.data[idx] = int(annd[idx] / 52.0 * 255);
 		}
-	}
-	
-	/*
-	for (int iter = 0; iter < pm_iters; iter++) {
-		// In each iteration, improve the NNF, by looping in scanline or reverse-scanline order. 
-		int ystart = 0, yend = aeh, ychange = 1;
-		int xstart = 0, xend = aew, xchange = 1;
-		if (iter % 2 == 1) {
-			xstart = xend-1; xend = -1; xchange = -1;
-			ystart = yend-1; yend = -1; ychange = -1;
+		oActiveRect = cv::Rect();
+		if (nMaxX >= 0 && nMinX * pm_block_w < aew && nMinY * pm_block_w < aeh) {
+			const int nEndX = std::min(aew, (nMaxX + 1) * pm_block_w), nEndY = std::min(aeh, (nMaxY + 1) * pm_block_w);
+			oActiveRect = cv::Rect(nMinX * pm_block_w, nMinY * pm_block_w, nEndX - nMinX * pm_block_w, nEndY - nMinY * pm_block_w);
 		}
-		for (int ay = ystart; ay != yend; ay += ychange)
-			for (int ax = xstart; ax != xend; ax += xchange) { 
-				// Current (best) guess. 
-				size_t nPxIter = ay*m_oImgSize.width + ax;
-				cv::Point2i v = ans[nPxIter];
-				int xbest = v.x, ybest = v.y;
-				int dbest = annd[nPxIter];
-
-				// Propagation: Improve current guess by trying instead correspondences from left and above (below and right on odd iterations). 
-				if ((unsigned) (ax - xchange) < (unsigned) aew) {
-					cv::Point2i vp = ans[nPxIter-xchange];
-					int xp = vp.x + xchange, yp = vp.y;
-					if ((unsigned) xp < (unsigned) bew)
-						improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp);
+	}
+	const int nActiveEndX = oActiveRect.x + oActiveRect.width, nActiveEndY = oActiveRect.y + oActiveRect.height;
+	// b resampled along the homography over the pixels of the active patches only (the homography is moved to the rect origin): the patches
+	// following it are compared all at once, as box sums of a single squared difference image
+	if (oActiveRect.area() > 0) {
+		const cv::Rect oDenseRect(oActiveRect.x, oActiveRect.y, oActiveRect.width + patch_w2 - 1, oActiveRect.height + patch_w2 - 1);
+		const cv::Mat oRectOrigin = (cv::Mat_<double>(3,3) << 1, 0, oDenseRect.x, 0, 1, oDenseRect.y, 0, 0, 1);
+		const cv::Mat oRectTransform = oTransform * oRectOrigin;
+		cv::warpPerspective(b, m_oPatchWarpedImg, oRectTransform, oDenseRect.size(), cv::INTER_NEAREST | cv::WARP_INVERSE_MAP, cv::BORDER_REPLICATE);
+		computePatchDist(a(oDenseRect), m_oPatchWarpedImg, patch_w2, m_oPatchDist);
+	}
+
+	size_t nEvals = 0, nActive = 0;
+	for (int ay = oActiveRect.y; ay < nActiveEndY; ay++) {
+		const uchar* anActiveBlocks = bSparse ? oActiveBlocks.ptr<uchar>(ay / pm_block_w) : NULL;
+		const int* anPatchDist = m_oPatchDist.ptr<int>(ay - oActiveRect.y) - oActiveRect.x;
+		for (int ax = oActiveRect.x; ax < nActiveEndX; ax++) {
+			if (anActiveBlocks && !anActiveBlocks[ax / pm_block_w]) {
+				// skips the rest of the inactive block; its patches are considered matched (ansMat = 0)
+				ax = (ax / pm_block_w + 1) * pm_block_w - 1;
+				continue;
+			}
+			int idx = ay*a.cols + ax;
+			// rounded as the nearest-neighbor warp does, so (bx,by) is the pixel the warped patch starts from
+			const double w = h[6]*ax + h[7]*ay + h[8];
+			int bx = -1, by = -1;
+			if (w > DBL_EPSILON) {
+				bx = cvRound((h[0]*ax + h[1]*ay + h[2]) / w);
+				by = cvRound((h[3]*ax + h[4]*ay + h[5]) / w);
+			}
+			const bool bInFrame = 0<=bx && bx<a.cols && 0<=by && by<a.rows;
+			nActive++;
+			// warm-start candidate: where the homography match was corrected on the last frame, the same correction on top of the new one;
+			// where there is no homography match, the last frame's displacement at the same position
+			int cx = -1, cy = -1;
+			if (bWarmStart) {
+				if (bInFrame) {
+					if (bx < aew && by < aeh && (!pPrevActiveBlocks || pPrevActiveBlocks->at<uchar>(by / pm_block_w, bx / pm_block_w))) {
+						const size_t nPrevIdx = (size_t)by*a.cols + bx;
+						const cv::Point2i& oPrevPred = m_voPatchPrevPred[nPrevIdx];
+						if (oPrevPred.x >= 0 && m_voPatchPrevNNF[nPrevIdx] != oPrevPred) {
+							cx = bx + m_voPatchPrevNNF[nPrevIdx].x - oPrevPred.x;
+							cy = by + m_voPatchPrevNNF[nPrevIdx].y - oPrevPred.y;
+						}
+					}
 				}
-				if ((unsigned) (ay - ychange) < (unsigned) aeh) {
-					cv::Point2i vp = ans[(ay-ychange) * m_oImgSize.width + ax];
-					int xp = vp.x, yp = vp.y + ychange;
-					if ((unsigned) yp < (unsigned) beh)
-						improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp);
+				else if (!pPrevActiveBlocks || pPrevActiveBlocks->at<uchar>(ay / pm_block_w, ax / pm_block_w)) {
+					cx = m_voPatchPrevNNF[idx].x;
+					cy = m_voPatchPrevNNF[idx].y;
 				}
-
-				// Random search: Improve current guess by searching in boxes of exponentially decreasing size around the current best guess. 
-				int rs_start = rs_max;
-				if (rs_start > MAX(m_oImgSize.width, m_oImgSize.height)) rs_start = MAX(m_oImgSize.width, m_oImgSize.height);
-				for (int mag = rs_start; mag >= 1; mag /= 2) {
-					// Sampling window 
-					int xmin = MAX(xbest-mag, 0), xmax = MIN(xbest+mag+1,bew);
-					int ymin = MAX(ybest-mag, 0), ymax = MIN(ybest+mag+1,beh);
-					int xp = xmin+ ((xmax-xmin) == 0? 0 : rand()%(xmax-xmin));
-					int yp = ymin+ ((ymax-ymin) == 0? 0 : rand()%(ymax-ymin));
-					improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp);
+			}
+			const bool bWarmCandidate = 0<=cx && cx<bew && 0<=cy && cy<beh;
+			if (bInFrame) {
+				m_voPatchNNFPred[idx] = cv::Point2i(bx, by);
+				// the distance of a homography match is the one of the patch warped along the homography (not of the axis-aligned
+				// patch at (bx,by)): a candidate only replaces it if its plain patch matches better than the warped one
+				int xbest = bx, ybest = by, dbest = anPatchDist[ax];
+				// only the pixels whose warm-start candidate differs from the homography match are re-evaluated
+				if (bWarmCandidate && (cx != bx || cy != by)) {
+					improve_guess(a, b, ax, ay, xbest, ybest, dbest, cx, cy);
+					nEvals++;
 				}
+				nnf[idx] = cv::Point2i(xbest, ybest);
+				annd[idx] = dbest;
+			} else {
+				// no correspondence in the frame: warm-start or random patch, improved by the refinement below
+				m_voPatchNNFPred[idx] = cv::Point2i(-1, -1);
+				if (!bWarmCandidate) {
+					cx = (int)m_oRandEngine((unsigned)bew);
+					cy = (int)m_oRandEngine((unsigned)beh);
+				}
+				nnf[idx] = cv::Point2i(cx, cy);
+				annd[idx] = dist(a, b, ax, ay, cx, cy, INT_MAX, patch_w2);
+				nEvals++;
+			}
+		}
+	}
+
+	// refinement: Jacobi-style jump flooding (each pass reads the NNF of the previous one, with a jump halved at every pass down to 1) + random search;
+	// the passes are split in row tiles with their own random engine, so the result does not depend on the thread count
+	PatchMatchContext oCtx;
+	oCtx.pImgA = &a;
+	oCtx.pImgB = &b;
+	oCtx.nEffWidthA = aew;
+	oCtx.nEffHeightA = aeh;
+	oCtx.nEffWidthB = bew;
+	oCtx.nEffHeightB = beh;
+	oCtx.oActiveRect = oActiveRect;
+	oCtx.pActiveBlocks = bSparse ? &oActiveBlocks : NULL;
+	const int nTiles = (aeh + PATCHMATCH_TILE_ROWS - 1) / PATCHMATCH_TILE_ROWS;
+	oCtx.vnTileEvals.resize(nTiles);
+	oCtx.vnTileImproved.resize(nTiles);
+	// the passes alternate between the NNF buffers and the pass buffers (each pass writes every active patch, and only reads active ones)
+	std::vector<cv::Point2i>* pvoPrevNNF = &nnf, *pvoNextNNF = &m_voPatchPassNNF;
+	std::vector<int>* pvnPrevDist = &annd, *pvnNextDist = &m_vnPatchPassDist;
+	if (m_nPatchMatchIters && nActive) {
+		m_voPatchPassNNF.resize(a.total());
+		m_vnPatchPassDist.resize(a.total());
+	}
+	for (size_t iter = 0; iter < m_nPatchMatchIters && nActive; iter++) {
+		if (m_dPatchMatchBudgetMs > 0 && (cv::getTickCount() - nStartTick) * 1000.0 / cv::getTickFrequency() >= m_dPatchMatchBudgetMs)
+			break;
+		oCtx.pvoPrevNNF = pvoPrevNNF;
+		oCtx.pvnPrevDist = pvnPrevDist;
+		oCtx.pvoNNF = pvoNextNNF;
+		oCtx.pvnDist = pvnNextDist;
+		oCtx.nIter = iter;
+		// a cold NNF floods from long jumps down to 1 on its last pass; a warm-started one is already close, so it restarts from a short
+		// jump and reaches 1 after a couple of passes (where the convergence test below can stop it)
+		if (bWarmStart)
+			oCtx.nJump = 1 << std::max(PATCHMATCH_WARM_MAX_JUMP_LOG2 - (int)iter, 0);
+		else
+			oCtx.nJump = (m_nPatchMatchIters - 1 - iter) < PATCHMATCH_MAX_JUMP_LOG2 ? 1 << (m_nPatchMatchIters - 1 - iter) : 1 << PATCHMATCH_MAX_JUMP_LOG2;
+		cv::parallel_for_(cv::Range(0, nTiles), ParallelPatchMatchInvoker(*this, oCtx), (double)m_nThreads);
+		std::swap(pvoPrevNNF, pvoNextNNF);
+		std::swap(pvnPrevDist, pvnNextDist);
+		m_nLastPatchMatchIters++;
+		size_t nImproved = 0;
+		for (int t = 0; t < nTiles; t++) {
+			nEvals += oCtx.vnTileEvals[t];
+			nImproved += oCtx.vnTileImproved[t];
+		}
+		// converged; only tested once the short-range propagation ran (the long jumps of the first passes improve few patches on their own)
+		if (oCtx.nJump == 1 && nImproved < PATCHMATCH_CONVERGENCE_RATIO * nActive)
+			break;
+	}
+	m_nLastPatchMatchEvals = nEvals;
+	// after an odd number of passes, the result is in the pass buffers: they become the NNF kept for the next frame
+	if (pvoPrevNNF != &nnf) {
+		nnf.swap(m_voPatchPassNNF);
+		annd.swap(m_vnPatchPassDist);
+	}
+	if (bSparse)
+		oActiveBlocks.copyTo(m_oPatchNNFActiveBlocks);
+	else
+		m_oPatchNNFActiveBlocks.release();
 
-				ans[nPxIter] = cv::Point2i(xbest, ybest);
-				annd[nPxIter] = dbest;
+	ans.resize(a.total());
+	for (int ay = oActiveRect.y; ay < nActiveEndY; ay++) {
+		const uchar* anActiveBlocks = bSparse ? oActiveBlocks.ptr<uchar>(ay / pm_block_w) : NULL;
+		for (int ax = oActiveRect.x; ax < nActiveEndX; ax++) {
+			if (anActiveBlocks && !anActiveBlocks[ax / pm_block_w]) {
+				ax = (ax / pm_block_w + 1) * pm_block_w - 1;
+				continue;
 			}
-    }
-	*/
+			int idx = ay*a.cols + ax;
+			const double dMeanDist = (double)annd[idx] / (patch_w2 * patch_w2);
+			if (dMeanDist >= PATCHMATCH_DIST_SATURATION) ansMat.data[idx] = 255;
+			else ansMat.data[idx] = int(dMeanDist / PATCHMATCH_DIST_SATURATION * 255);
+			ans[idx] = nnf[idx];
+		}
+	}
 }
 
 void BackgroundSubtractorSuBSENSE::cover(cv::Mat &a, const cv::Mat &b, std::vector<cv::Point2i> &ans) {
-	int aew = m_oImgSize.width - patch_w + 1, aeh = m_oImgSize.height - patch_w + 1;
-	int bew = m_oImgSize.width - patch_w + 1, beh = m_oImgSize.height - patch_w + 1;
+	// the frames (and the NNF) are indexed by their own width, which is not the model's in panoramic mode
+	CV_Assert(a.size()==b.size() && a.type()==b.type() && a.isContinuous() && b.isContinuous() && ans.size()==a.total());
+	int aew = a.cols - patch_w + 1, aeh = a.rows - patch_w + 1;
 	for (int ay = 0; ay < aeh; ay+=patch_w )
 		for (int ax = 0; ax < aew; ax+=patch_w) {
-			int bx = ans[ay * m_oImgSize.width + ax].x, by = ans[ay * m_oImgSize.width + ax].y;
+			int bx = ans[ay * a.cols + ax].x, by = ans[ay * a.cols + ax].y;
 			for (int ii = 0; ii < patch_w; ii ++)
 				for (int jj = 0; jj < patch_w; jj ++) {
-					size_t anPxIter = (ay + ii) * m_oImgSize.width + ax + jj, bnPxIter = (by + ii) * m_oImgSize.width + bx + jj;
-					if (m_nImgChannels==1) {
+					size_t anPxIter = (ay + ii) * a.cols + ax + jj, bnPxIter = (by + ii) * b.cols + bx + jj;
+					if (a.channels()==1) {
 						a.data[anPxIter] = b.data[bnPxIter];
 					} else {
 						anPxIter *= 3, bnPxIter *= 3;
@@ -988,12 +1796,14 @@ void BackgroundSubtractorSuBSENSE::cover(cv::Mat &a, const cv::Mat &b, std::vect
 
 void BackgroundSubtractorSuBSENSE::randomField(cv::Mat & image, cv::Mat & ansMat, cv::Mat & lastMat, cv::OutputArray & fgMask) {
 	cv::Mat a = fgMask.getMat();
+	// all the planes are frame-sized (not model-sized in panoramic mode), and indexed by the frame width
+	CV_Assert(a.type()==CV_8UC1 && a.isContinuous() && ansMat.size()==a.size() && lastMat.size()==a.size() && image.size()==a.size());
 	cv::addWeighted(a, 0.5, ansMat, 0.5, 0, a);
 	cv::addWeighted(a, 0.8, lastMat, 0.2, 0, a);
     int aew = a.cols - patch_w + 1, aeh = a.rows - patch_w + 1;
 	int ww = (aew - 1) / patch_w + 1, hh = (aeh - 1) / patch_w + 1;
 	int size = ww * hh;
-	Graph *graph = new Graph(size);
+	m_oFieldGraph.reset(ww, hh);
 	
 	std::vector<double> foreNum;
 	foreNum.reserve(size);
@@ -1002,7 +1812,7 @@ void BackgroundSubtractorSuBSENSE::randomField(cv::Mat & image, cv::Mat & ansMat
 			float ss = 0; //, s2 = 0;
 			for (int ii = 0; ii < patch_w; ii ++)
 				for (int jj = 0; jj < patch_w; jj ++)
-					ss += 1 - a.data[(ay + ii) * image.cols + ax + jj]/255.0;
+					ss += 1 - a.data[(ay + ii) * a.cols + ax + jj]/255.0;
 					//if (a.data[(ay + ii) * image.cols + ax + jj] == 0) ss ++;
 			foreNum.push_back(ss);
 
@@ -1015,8 +1825,8 @@ void BackgroundSubtractorSuBSENSE::randomField(cv::Mat & image, cv::Mat & ansMat
 			d = MAX(1e-20f, 1 - d);
 			float d2 = -log(d);
 
-			if (d1 > d2) graph->add_edge(graph->getS(), foreNum.size()-1, d1 - d2, 0);
-			else graph->add_edge(foreNum.size()-1, graph->getT(), d2 - d1, 0);
+			if (d1 > d2) m_oFieldGraph.add_tweights(foreNum.size()-1, d1 - d2, 0);
+			else m_oFieldGraph.add_tweights(foreNum.size()-1, 0, d2 - d1);
 		}
 
 	double avgDistance = 0;
@@ -1056,69 +1866,76 @@ void BackgroundSubtractorSuBSENSE::randomField(cv::Mat & image, cv::Mat & ansMat
 			int idx = ay/patch_w * ww + ax/patch_w;
 			if (ay>0) {
 				cap = lmd1 + lmd2 * exp(-edgeLen[countIdx++] / 2 / avgDistance);
-				graph->add_edge(idx, idx-ww, cap, cap);
+				m_oFieldGraph.add_edge(idx, 0, -1, cap, cap);
 			}
 			if (ax>0) {
 				cap = lmd1 + lmd2 * exp(-edgeLen[countIdx++] / 2 / avgDistance);
-				graph->add_edge(idx, idx-1, cap, cap);
+				m_oFieldGraph.add_edge(idx, -1, 0, cap, cap);
 			}
 			if (ax>0 && ay>0) {
 				cap = lmd1 + lmd2 * exp(-edgeLen[countIdx++] / 2 / avgDistance);
-				graph->add_edge(idx, idx-ww-1, cap, cap);
+				m_oFieldGraph.add_edge(idx, -1, -1, cap, cap);
 			}
 			if (ay>0 && ax + patch_w < aew) {
 				cap = lmd1 + lmd2 * exp(-edgeLen[countIdx++] / 2 / avgDistance);
-				graph->add_edge(idx, idx-ww+1, cap, cap);
+				m_oFieldGraph.add_edge(idx, 1, -1, cap, cap);
 			}
 		}
 
-    graph->dinic(graph->getS());
-	graph->extended_path();
+	// blocks left on the source side of the minimum cut are foreground
+	m_oFieldGraph.maxflow();
 	std::vector<int> lebal;
 	lebal.resize(size);
 
-	cv::Mat aaa = a.clone();
-	aaa = cv::Scalar(0);
-	cv::Mat bbb = aaa.clone();
+	// debug images, only built for the subscribed probes
+	const bool bDbgLabels = m_pDiagnostics && m_pDiagnostics->enabled("field_labels");
+	const bool bDbgBlocks = m_pDiagnostics && (m_pDiagnostics->enabled("field_border") || m_pDiagnostics->enabled("field_filled"));
+	cv::Mat aaa, bbb;
+	if (bDbgBlocks)
+		aaa = cv::Mat::zeros(a.size(), a.type());
+	if (bDbgLabels)
+		bbb = cv::Mat::zeros(a.size(), a.type());
 	for (int ay = 0; ay < aeh; ay+=patch_w)
 		for (int ax = 0; ax < aew; ax+=patch_w) {
 			int idx = ay/patch_w * ww + ax/patch_w;
-			if (graph->check_type(idx))
+			if (bDbgLabels && m_oFieldGraph.check_type(idx))
 				for (int ii = 0; ii < patch_w; ii ++)
 					for (int jj = 0; jj < patch_w; jj ++) {
-						size_t anPxIter = (ay + ii) * m_oImgSize.width + ax + jj;
+						size_t anPxIter = (ay + ii) * a.cols + ax + jj;
 						bbb.data[anPxIter] = 255;
 					}
 			bool f1 = false, f2 = false;
 			if (ax > 0) {
-				if (graph->check_type(idx-1)) f1 = true;
+				if (m_oFieldGraph.check_type(idx-1)) f1 = true;
 				else f2 = true;
 			}
 			if (ay > 0) {
-				if (graph->check_type(idx-ww)) f1 = true;
+				if (m_oFieldGraph.check_type(idx-ww)) f1 = true;
 				else f2 = true;
 			}
 			if (ax + patch_w < aew) {
-				if (graph->check_type(idx+1)) f1 = true;
+				if (m_oFieldGraph.check_type(idx+1)) f1 = true;
 				else f2 = true;
 			}
 			if (ay + patch_w < aeh) {
-				if (graph->check_type(idx+ww)) f1 = true;
+				if (m_oFieldGraph.check_type(idx+ww)) f1 = true;
 				else f2 = true;
 			}
 			if (f1 && f2) {
-				for (int ii = 0; ii < patch_w; ii ++)
-					for (int jj = 0; jj < patch_w; jj ++) {
-						size_t anPxIter = (ay + ii) * m_oImgSize.width + ax + jj;
-
-					aaa.data[anPxIter] = 255;
-				}
+				if (bDbgBlocks)
+					for (int ii = 0; ii < patch_w; ii ++)
+						for (int jj = 0; jj < patch_w; jj ++) {
+							size_t anPxIter = (ay + ii) * a.cols + ax + jj;
+							aaa.data[anPxIter] = 255;
+						}
 				lebal[idx] = 1;
 				continue;
 			}
 		}
-	cv::imwrite("A.jpg", bbb);
-	cv::imwrite("B.jpg", aaa);
+	if (bDbgLabels)
+		m_pDiagnostics->post("field_labels", bbb);
+	if (bDbgBlocks)
+		m_pDiagnostics->post("field_border", aaa);
 
 	for (int ay = 0; ay < aeh; ay+=patch_w)
 		for (int ax = 0; ax < aew; ax+=patch_w) {
@@ -1132,20 +1949,77 @@ void BackgroundSubtractorSuBSENSE::randomField(cv::Mat & image, cv::Mat & ansMat
 				// on the edge
 				for (int ii = 0; ii < patch_w; ii ++)
 					for (int jj = 0; jj < patch_w; jj ++) {
-						size_t anPxIter = (ay + ii) * m_oImgSize.width + ax + jj;
+						size_t anPxIter = (ay + ii) * a.cols + ax + jj;
 						a.data[anPxIter] = a.data[anPxIter]>155? 255:0;
 					}
 			} else {
 				// full the patch
-				int goa = graph->check_type(idx)? 255:0;
+				int goa = m_oFieldGraph.check_type(idx)? 255:0;
 				for (int ii = 0; ii < patch_w; ii ++)
 					for (int jj = 0; jj < patch_w; jj ++) {
-						size_t anPxIter = (ay + ii) * m_oImgSize.width + ax + jj;
+						size_t anPxIter = (ay + ii) * a.cols + ax + jj;
 						a.data[anPxIter] = goa;
-						aaa.data[anPxIter] = 255;
+						if (bDbgBlocks)
+							aaa.data[anPxIter] = 255;
 					}
 			}
 		}
-	cv::imwrite("C.jpg", aaa);
+	if (bDbgBlocks)
+		m_pDiagnostics->post("field_filled", aaa);
 	a.convertTo(fgMask, CV_8U);
-}
\ No newline at end of file
+}
+
+void BackgroundSubtractorSuBSENSE::setValidRegion(const cv::Mat& oTransform, const cv::Size& oFrameSize) {
+	CV_Assert(m_bInitialized);
+	const cv::Size oSrcSize = (oFrameSize.area()>0)?oFrameSize:m_oImgSize;
+	if(!oTransform.empty()) {
+		CV_Assert(oTransform.rows==3 && oTransform.cols==3);
+		cv::Mat oTransform64F;
+		oTransform.convertTo(oTransform64F,CV_64F);
+		double adQuadX[4], adQuadY[4], dOrientation;
+		// degenerate footprints fall back to the whole ROI
+		if(getWarpedQuad((double*)oTransform64F.data,oSrcSize,adQuadX,adQuadY,dOrientation)) {
+			m_voValidSpans.clear();
+			m_nValidPxCount = 0;
+			int nBBoxMinX = m_oImgSize.width, nBBoxMaxX = -1, nBBoxMinY = m_oImgSize.height, nBBoxMaxY = -1;
+			for(int y=0; y<m_oImgSize.height; ++y) {
+				m_vnValidRowSpanIdxs[y] = m_voValidSpans.size();
+				int nMinX, nEndX;
+				if(!getQuadRowRange(adQuadX,adQuadY,dOrientation,y,m_oImgSize.width,nMinX,nEndX))
+					continue;
+				for(size_t nSpanIter=m_vnROIRowSpanIdxs[y]; nSpanIter<m_vnROIRowSpanIdxs[y+1]; ++nSpanIter) {
+					PxSpan oSpan = m_voROISpans[nSpanIter];
+					oSpan.nStartX = std::max(oSpan.nStartX,nMinX);
+					oSpan.nEndX = std::min(oSpan.nEndX,nEndX);
+					if(oSpan.nStartX<oSpan.nEndX) {
+						m_voValidSpans.push_back(oSpan);
+						m_nValidPxCount += oSpan.nEndX-oSpan.nStartX;
+						nBBoxMinX = std::min(nBBoxMinX,oSpan.nStartX);
+						nBBoxMaxX = std::max(nBBoxMaxX,oSpan.nEndX-1);
+						nBBoxMinY = std::min(nBBoxMinY,y);
+						nBBoxMaxY = y;
+					}
+				}
+			}
+			m_vnValidRowSpanIdxs[m_oImgSize.height] = m_voValidSpans.size();
+			m_oValidBBox = (nBBoxMaxX>=0)?cv::Rect(nBBoxMinX,nBBoxMinY,nBBoxMaxX-nBBoxMinX+1,nBBoxMaxY-nBBoxMinY+1):cv::Rect();
+			return;
+		}
+	}
+	m_voValidSpans = m_voROISpans;
+	m_vnValidRowSpanIdxs = m_vnROIRowSpanIdxs;
+	m_nValidPxCount = m_nTotRelevantPxCount;
+	m_oValidBBox = cv::Rect(0,0,m_oImgSize.width,m_oImgSize.height);
+}
+
+cv::Rect BackgroundSubtractorSuBSENSE::getValidRegionBBox() const {
+	return m_oValidBBox;
+}
+
+size_t BackgroundSubtractorSuBSENSE::getPxModelFootprint(int nImgChannels) const {
+	CV_Assert(nImgChannels==1 || nImgChannels==3);
+	const size_t nColorOffset = cv::alignSize(cv::alignSize(m_nBGSamples,L1DIST_MASK_GROUP_SIZE)*nImgChannels*2,16);
+	const size_t nRecordSize = cv::alignSize(nColorOffset+cv::alignSize(m_nBGSamples,L1DIST_MASK_GROUP_SIZE)*nImgChannels,16);
+	// samples record, color & descriptor sums, state record, last color & descriptor, ROI + 12 byte masks
+	return nRecordSize+nImgChannels*8+getPxStateFootprint()+nImgChannels*3+13;
+}
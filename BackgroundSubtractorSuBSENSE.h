@@ -1,6 +1,10 @@
 #pragma once
 
 #include "BackgroundSubtractorLBSP.h"
+#include "RandUtils.h"
+#include "graph.h"
+
+class DiagnosticsSink;
 
 //! defines the default value for BackgroundSubtractorLBSP::m_fRelLBSPThreshold
 #define BGSSUBSENSE_DEFAULT_LBSP_REL_SIMILARITY_THRESHOLD (0.333f)
@@ -14,6 +18,10 @@
 #define BGSSUBSENSE_DEFAULT_REQUIRED_NB_BG_SAMPLES (2)
 //! defines the default value for BackgroundSubtractorSuBSENSE::m_nSamplesForMovingAvgs
 #define BGSSUBSENSE_DEFAULT_N_SAMPLES_FOR_MV_AVGS (100)
+//! defines the default value for BackgroundSubtractorSuBSENSE::m_nThreads
+#define BGSSUBSENSE_DEFAULT_NB_THREADS (1)
+//! defines the default value for BackgroundSubtractorSuBSENSE::m_bLeanPxState
+#define BGSSUBSENSE_DEFAULT_LEAN_PX_STATE (false)
 
 #ifndef MAX
 #define MAX(a, b) ((a)>(b)?(a):(b))
@@ -26,6 +34,8 @@ const int patch_w2  = 25;
 const int patch_area = patch_w * patch_w;
 const int pm_iters = 5;
 const int rs_max   = INT_MAX;
+// block size of the patch match activity mask
+const int pm_block_w = 16;
 // parameter for random field
 const double L1 = 0.6, L2 = 0.3;
 
@@ -38,7 +48,12 @@ const double L1 = 0.6, L2 = 0.3;
 	For more details on the different parameters or on the algorithm itself, see P.-L. St-Charles et al.,
 	"Flexible Background Subtraction With Self-Balanced Local Sensitivity", in CVPRW 2014.
 
-	This algorithm is currently NOT thread-safe.
+	The per-pixel classification/update loop can be split into row bands processed by several worker threads (see
+	the 'nThreads' constructor parameter); for a fixed thread count, results are reproducible from one run to another.
+	The public interface itself is still NOT thread-safe.
+
+	The per-pixel adaptive state can also be stored in 16-bit fixed-point (see the 'bLeanPxState' constructor parameter),
+	which halves its footprint; results then differ slightly from the default (float) mode.
  */
 class BackgroundSubtractorSuBSENSE : public BackgroundSubtractorLBSP {
 public:
@@ -48,7 +63,9 @@ public:
 									size_t nMinColorDistThreshold=BGSSUBSENSE_DEFAULT_MIN_COLOR_DIST_THRESHOLD,
 									size_t nBGSamples=BGSSUBSENSE_DEFAULT_NB_BG_SAMPLES,
 									size_t nRequiredBGSamples=BGSSUBSENSE_DEFAULT_REQUIRED_NB_BG_SAMPLES,
-									size_t nSamplesForMovingAvgs=BGSSUBSENSE_DEFAULT_N_SAMPLES_FOR_MV_AVGS);
+									size_t nSamplesForMovingAvgs=BGSSUBSENSE_DEFAULT_N_SAMPLES_FOR_MV_AVGS,
+									size_t nThreads=BGSSUBSENSE_DEFAULT_NB_THREADS,
+									bool bLeanPxState=BGSSUBSENSE_DEFAULT_LEAN_PX_STATE);
 	//! default destructor
 	virtual ~BackgroundSubtractorSuBSENSE();
 	//! (re)initiaization method; needs to be called before starting background subtraction
@@ -64,17 +81,197 @@ public:
 	//! update the model with frame after motion
 	void update(const cv::Mat &newFrame, const cv::Mat &transmatrix);
 	// patch match part
-	void patch_match(const cv::Mat &a, const cv::Mat &b, std::vector<cv::Point2i> &ans, cv::Mat & ansMat, cv::Mat matrix);
+	// with a non-empty activity mask (see getPatchMatchActivity), patches are only matched in the active blocks; the others are considered matched (ansMat = 0)
+	// and their ans entries are left untouched
+	void patch_match(const cv::Mat &a, const cv::Mat &b, std::vector<cv::Point2i> &ans, cv::Mat & ansMat, cv::Mat matrix, const cv::Mat &oActiveBlocks = cv::Mat());
+	//! builds the patch match activity mask (CV_8UC1, one value per pm_block_w x pm_block_w block) of a foreground mask: its blocks within nMargin pixels of a foreground pixel
+	static void getPatchMatchActivity(const cv::Mat& oFGMask, int nMargin, cv::Mat& oActiveBlocks);
 	void cover(cv::Mat &a, const cv::Mat &b, std::vector<cv::Point2i> &ans);
+	//! sets the number of PatchMatch refinement passes, their time budget (in ms, 0 = none; checked between passes) and the random search radius
+	void setPatchMatchParams(size_t nIters, double dBudgetMs=0, int nSearchRadius=rs_max);
+	//! returns the number of PatchMatch refinement passes run on the last frame
+	size_t getLastPatchMatchIters() const;
+	//! returns the number of patch distances evaluated by the last patch match (besides the dense homography ones)
+	size_t getLastPatchMatchEvals() const;
 	// Probabilistic blocks Markov Random Fields
 	void randomField(cv::Mat & image, cv::Mat & ansMat, cv::Mat & lastMat, cv::OutputArray & fgMask);
 	// final complete
-	void complete(cv::OutputArray &fgMask);
+	void complete(cv::OutputArray &fgMask, const cv::Rect& oWindow=cv::Rect());
+	//! attaches a diagnostics sink (not owned, NULL = none) receiving the debug images of complete() & randomField(); they are only computed for its subscribed probes
+	void setDiagnostics(DiagnosticsSink* pDiagnostics);
+	//! reseeds all random draws of the model (sample replacement, spreading, refreshes, patch match); same seed + same input = same output
+	void setRandSeed(uint64 nSeed);
+	//! selects the SIMD (default) or scalar paths of the sample group prefilters; both produce the same masks
+	void setSIMDKernelsEnabled(bool bEnabled);
+	//! returns the number of bytes used to store the adaptive state of one pixel
+	size_t getPxStateFootprint() const;
+	//! restricts the next analyzed frames to the ROI pixels covered by an input frame (of the given size, default = model size) warped with the given homography (input->model coordinates); an empty matrix means the whole ROI
+	void setValidRegion(const cv::Mat& oTransform, const cv::Size& oFrameSize=cv::Size());
+	//! returns the bounding box of the current valid region (the window touched by the next analyzed frame)
+	cv::Rect getValidRegionBBox() const;
+	//! reinitializes the model of the valid region pixels that were never seen or have been cleared, using the given image (in model coordinates)
+	void reinitExposedRegion(const cv::Mat& oImg);
+	//! clears the model of the masked pixels; they are reinitialized the next time they are exposed
+	void clearPxModel(const cv::Mat& oMask);
+	//! moves the whole model by an integer offset (e.g. to recenter a panoramic model); pixels shifted in are left cleared
+	void shiftModel(int nShiftX, int nShiftY);
+	//! returns an estimate of the number of bytes used by the model for each pixel, for the given channel count
+	size_t getPxModelFootprint(int nImgChannels) const;
 
 protected:
+	//! packed per-pixel adaptive state; all fields a pixel needs are read & written through a single record instead of 10 full-frame planes
+	struct PxState {
+		//! distance threshold factor (equivalent to 'R(x)' in PBAS, but used as a relative value to determine both intensity and descriptor variation thresholds)
+		float fDistThresholdFactor;
+		//! distance variation modulator ('v(x)', relative value used to modulate 'R(x)' and 'T(x)' variations)
+		float fVariationFactor;
+		//! update rate ('T(x)' in PBAS, which contains pixel-level 'sigmas', as referred to in ViBe)
+		float fLearningRate;
+		//! mean distance between consecutive frames ('D_last(x)', used to detect ghosts and high variation regions in the sequence)
+		float fMeanLastDist;
+		//! mean minimal distances from the model ('D_min(x)' in PBAS, used to control variation magnitude and direction of 'T(x)' and 'R(x)')
+		float fMeanMinDist_LT, fMeanMinDist_ST;
+		//! mean raw segmentation results (used to detect unstable segmentation regions)
+		float fMeanRawSegmRes_LT, fMeanRawSegmRes_ST;
+		//! mean final segmentation results (used to detect unstable segmentation regions)
+		float fMeanFinalSegmRes_LT, fMeanFinalSegmRes_ST;
+	};
+	//! fixed-point version of PxState used in lean mode (R(x) in Q4.12, v(x) in Q8.8, T(x) in Q9.7, all means in Q0.16);
+	//! the R(x) decrement (FEEDBACK_R_VAR/v(x)) falls below half a Q4.12 LSB once v(x) > ~82 (v(x) saturates at 256 in Q8.8), so the
+	//! band kernels store R(x) with stochastic rounding: it then follows the float decrements on average, down to 0.16 LSB per frame
+	struct PxStateLean {
+		ushort nDistThresholdFactor;
+		ushort nVariationFactor;
+		ushort nLearningRate;
+		ushort nMeanLastDist;
+		ushort nMeanMinDist_LT, nMeanMinDist_ST;
+		ushort nMeanRawSegmRes_LT, nMeanRawSegmRes_ST;
+		ushort nMeanFinalSegmRes_LT, nMeanFinalSegmRes_ST;
+	};
+	//! number of fields in a PxState/PxStateLean record
+	static const int s_nPxStateFields = (int)(sizeof(PxState)/sizeof(float));
+	struct FrameContext;
+	//! row band kernel type (one instantiation of processBand1ch/processBand3ch)
+	typedef void (BackgroundSubtractorSuBSENSE::*BandKernel)(FrameContext&, size_t);
+	//! per-frame data shared by all row bands processed in operator()
+	struct FrameContext {
+		cv::Mat oInputImg;
+		cv::Mat oCurrFGMask;
+		float fRollAvgFactor_LT;
+		float fRollAvgFactor_ST;
+		double dLearningRateOverride;
+		//! band kernel instantiation picked for this frame
+		BandKernel pBandKernel;
+		//! per-band non-zero descriptor counts (summed once all bands are done)
+		std::vector<size_t> vnNonZeroDescCount;
+	};
+	//! parallel_for_ body used to dispatch row bands to worker threads
+	class ParallelBandInvoker;
+	//! parallel_for_ body used to resample all per-pixel model planes in a single pass
+	class ParallelWarpInvoker;
+	//! parallel_for_ body used to reinitialize exposed pixels span by span
+	class ParallelReinitInvoker;
+	//! parallel_for_ body used to compute dense patch distances row by row
+	class ParallelPatchDistInvoker;
+	//! parallel_for_ body used to refine the patch match NNF tile by tile
+	class ParallelPatchMatchInvoker;
+	//! state shared by the tiles of a PatchMatch refinement pass
+	struct PatchMatchContext {
+		const cv::Mat* pImgA;
+		const cv::Mat* pImgB;
+		//! number of valid patch top-left corners in both images
+		int nEffWidthA, nEffHeightA, nEffWidthB, nEffHeightB;
+		//! NNF & patch distances written by the pass
+		std::vector<cv::Point2i>* pvoNNF;
+		std::vector<int>* pvnDist;
+		//! NNF & patch distances of the previous pass (only read, so tiles can run concurrently)
+		const std::vector<cv::Point2i>* pvoPrevNNF;
+		const std::vector<int>* pvnPrevDist;
+		//! propagation distance & pass index
+		int nJump;
+		size_t nIter;
+		//! bounding box of the active patches & activity mask (NULL = all patches are active)
+		cv::Rect oActiveRect;
+		const cv::Mat* pActiveBlocks;
+		//! per-tile counts of evaluated candidates & improved patches
+		std::vector<size_t> vnTileEvals;
+		std::vector<size_t> vnTileImproved;
+	};
+	//! runs a PatchMatch refinement pass (jump propagation + random search) over a tile of PATCHMATCH_TILE_ROWS rows
+	void refinePatchMatchTile(PatchMatchContext& oCtx, size_t nTileIdx) const;
+	//! classifies & updates all relevant pixels of a row band (1-channel version); sample counts of 0 mean 'use the runtime values'
+	template<bool bLeanPxState, bool bUse3x3Spread, bool bLearningRateOverride, size_t nBGSamplesT, size_t nRequiredBGSamplesT>
+	void processBand1ch(FrameContext& oCtx, size_t nBandIdx);
+	//! classifies & updates all relevant pixels of a row band (3-channels version); sample counts of 0 mean 'use the runtime values'
+	template<bool bLeanPxState, bool bUse3x3Spread, bool bLearningRateOverride, size_t nBGSamplesT, size_t nRequiredBGSamplesT>
+	void processBand3ch(FrameContext& oCtx, size_t nBandIdx);
+	//! returns the band kernel instantiation matching the channel count & sample counts of the model
+	template<bool bLeanPxState, bool bUse3x3Spread, bool bLearningRateOverride>
+	BandKernel getBandKernel() const;
+	//! returns the band kernel instantiation to use for the current frame (called once per frame)
+	BandKernel getBandKernel(bool bLearningRateOverride) const;
+	//! (re)computes the row band boundaries (called on initialization)
+	void initBands();
+	//! reinitializes the state & samples of the given pixels whose learning rate is below its lower cap (i.e. exposed by a warp or cleared), using the given image (in model coordinates)
+	void reinitExposedPx(const cv::Mat& oImg, const std::vector<PxSpan>& voSpans);
+	//! first reinitialization pass over a span: last colors & descriptors of its exposed pixels
+	void reinitExposedPxDesc(const cv::Mat& oImg, const PxSpan& oSpan);
+	//! second reinitialization pass over a span: state reset & samples of its exposed pixels (with a random stream of its own)
+	void reinitExposedPxSamples(const PxSpan& oSpan, size_t nSpanIdx);
+	//! computes the ROI spans that a motion with the given (forward) homography can have exposed, i.e. those outside the last frame's footprint
+	void computeExposedSpans(const cv::Mat& oTransform, std::vector<PxSpan>& voSpans) const;
+	//! warps all per-pixel model planes (samples bank, sums, packed state, last descriptors & masks, and optionally the last colors) with the given (forward) homography in one pass, using nearest-neighbor resampling of whole records; pixels mapped from outside the frame are zeroed
+	void warpPxRecords(const cv::Mat& oTransform, bool bWithLastColor=false);
+	//! moves all the per-pixel model planes (last color frame included) by an integer offset in place, without any extra buffer; pixels shifted in get zeroed records
+	void shiftPxRecords(int nShiftX, int nShiftY);
+	//! number of per-pixel model planes moved by warps & shifts
+	static const size_t s_nModelPlanes = 12;
+	//! fills apPlanes with the per-pixel model planes, the last color frame last (left out if !bWithLastColor), and returns their count
+	size_t getModelPlanes(cv::Mat** apPlanes, bool bWithLastColor);
+	//! returns the packed adaptive state record of a pixel (float mode only)
+	inline PxState& getPxState(size_t nPxIter) {return ((PxState*)m_oPxStateFrame.data)[nPxIter];}
+	inline const PxState& getPxState(size_t nPxIter) const {return ((const PxState*)m_oPxStateFrame.data)[nPxIter];}
+	//! returns the fixed-point adaptive state record of a pixel (lean mode only)
+	inline PxStateLean& getLeanPxState(size_t nPxIter) {return ((PxStateLean*)m_oPxStateFrame.data)[nPxIter];}
+	inline const PxStateLean& getLeanPxState(size_t nPxIter) const {return ((const PxStateLean*)m_oPxStateFrame.data)[nPxIter];}
+	//! returns the seed of the current frame's random streams (per band, span or tile); different salts give unrelated seeds for the same frame
+	inline uint64 getFrameSeed(uint64 nSalt=0) const {return m_nRandSeed^((uint64)m_nFrameIndex*0x9E3779B97F4A7C15ULL)^nSalt;}
+	//! converts a fixed-point state record to its float version
+	static inline void decodePxState(const PxStateLean& oLeanPxState, PxState& oPxState);
+	//! converts a float state record to its fixed-point version (values are rounded & saturated; fRDither is added to R(x) before flooring it:
+	//! 0.5 rounds to nearest, a dither uniform in [0,1) rounds stochastically)
+	static inline void encodePxState(const PxState& oPxState, PxStateLean& oLeanPxState, float fRDither=0.5f);
+	//! reads the adaptive state record of a pixel as floats, in either storage mode
+	void loadPxState(size_t nPxIter, PxState& oPxState) const;
+	//! writes the adaptive state record of a pixel from floats, in either storage mode
+	void storePxState(size_t nPxIter, const PxState& oPxState);
+	//! returns a CV_32FC1 copy of one field of the packed state records (e.g. getPxStatePlane(offsetof(PxState,fLearningRate)), used for display/debug)
+	cv::Mat getPxStatePlane(size_t nFieldOffset) const;
+	//! returns a pointer to the color samples of a pixel (sample 's', channel 'c' at index s*m_nImgChannels+c)
+	inline uchar* getBGColorSamples(size_t nPxIter) {return m_oBGSampleBank.data+nPxIter*m_nBGSampleRecordSize+m_nBGSampleColorOffset;}
+	inline const uchar* getBGColorSamples(size_t nPxIter) const {return m_oBGSampleBank.data+nPxIter*m_nBGSampleRecordSize+m_nBGSampleColorOffset;}
+	//! returns a pointer to the descriptor samples of a pixel (sample 's', channel 'c' at index s*m_nImgChannels+c)
+	inline ushort* getBGDescSamples(size_t nPxIter) {return (ushort*)(m_oBGSampleBank.data+nPxIter*m_nBGSampleRecordSize);}
+	inline const ushort* getBGDescSamples(size_t nPxIter) const {return (const ushort*)(m_oBGSampleBank.data+nPxIter*m_nBGSampleRecordSize);}
+	//! replaces the value of sample 's', channel 'c' of a pixel and updates its running color & descriptor sums (all sample writes must go through here)
+	inline void setBGSample(size_t nPxIter, size_t s, size_t c, uchar nColor, ushort nDesc) {
+		const size_t nSampleIdx = s*m_nImgChannels+c, nSumIdx = nPxIter*m_nImgChannels+c;
+		uchar& nOldColor = getBGColorSamples(nPxIter)[nSampleIdx];
+		ushort& nOldDesc = getBGDescSamples(nPxIter)[nSampleIdx];
+		((int*)m_oBGColorSumFrame.data)[nSumIdx] += (int)nColor-(int)nOldColor;
+		((int*)m_oBGDescSumFrame.data)[nSumIdx] += (int)nDesc-(int)nOldDesc;
+		nOldColor = nColor;
+		nOldDesc = nDesc;
+	}
 	// patch match count
-	int dist(const cv::Mat &a, const cv::Mat &b, int ax, int ay, int bx, int by, int cutoff=INT_MAX) const;
-	void improve_guess(const cv::Mat &a, const cv::Mat &b, int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by);
+	int dist(const cv::Mat &a, const cv::Mat &b, int ax, int ay, int bx, int by, int cutoff=INT_MAX, int nPatchSize=patch_w) const;
+	//! computes the SSD of every nPatchSize x nPatchSize patch of two aligned images (CV_8UC1 or CV_8UC3) at once, as a box sum of their squared difference image; oPatchDist (CV_32SC1) is indexed by the patch top-left corner
+	void computePatchDist(const cv::Mat& oImgA, const cv::Mat& oImgB, int nPatchSize, cv::Mat& oPatchDist);
+	//! fills rows [nStartY,nEndY) of the channel-summed squared difference image (m_oPatchSqrDiff)
+	void computePatchSqrDiffRows(const cv::Mat& oImgA, const cv::Mat& oImgB, int nStartY, int nEndY);
+	//! fills rows [nStartY,nEndY) of the patch distances with vertical then horizontal running sums of m_oPatchSqrDiff
+	void computePatchSumRows(int nPatchSize, cv::Mat& oPatchDist, int nStartY, int nEndY) const;
+	void improve_guess(const cv::Mat &a, const cv::Mat &b, int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by) const;
 	//! absolute minimal color distance threshold ('R' or 'radius' in the original ViBe paper, used as the default/initial 'R(x)' value here)
 	const size_t m_nMinColorDistThreshold;
 	//! absolute descriptor distance threshold offset
@@ -85,6 +282,24 @@ protected:
 	const size_t m_nRequiredBGSamples;
 	//! number of samples to use to compute the learning rate of moving averages
 	const size_t m_nSamplesForMovingAvgs;
+	//! number of worker threads the per-pixel loop is split for (1 = sequential)
+	const size_t m_nThreads;
+	//! specifies whether the per-pixel adaptive state is stored as PxStateLean (fixed-point) records instead of PxState (float) records
+	const bool m_bLeanPxState;
+	//! number of row bands the relevant pixels are split into (even bands are processed first, then odd bands)
+	size_t m_nBands;
+	//! row band boundaries (band 'b' covers rows [m_vnBandRowBounds[b],m_vnBandRowBounds[b+1]) )
+	std::vector<int> m_vnBandRowBounds;
+	//! run-length spans of the ROI pixels covered by the current frame (same as the ROI spans when no motion compensation is used)
+	std::vector<PxSpan> m_voValidSpans;
+	//! index of the first valid span of each row (row 'y' covers [m_vnValidRowSpanIdxs[y],m_vnValidRowSpanIdxs[y+1]) )
+	std::vector<size_t> m_vnValidRowSpanIdxs;
+	//! number of pixels covered by the valid spans
+	size_t m_nValidPxCount;
+	//! bounding box of the valid spans
+	cv::Rect m_oValidBBox;
+	//! ROI spans exposed by the last model warp (reused buffer)
+	std::vector<PxSpan> m_voExposedSpans;
 	//! last calculated non-zero desc ratio
 	float m_fLastNonZeroDescRatio;
 	//! specifies whether Tmin/Tmax scaling is enabled or not
@@ -95,30 +310,39 @@ protected:
 	int m_nMedianBlurKernelSize;
 	//! specifies the px update spread range
 	bool m_bUse3x3Spread;
+	//! specifies whether the sample group prefilters use their SIMD paths
+	bool m_bUseSIMDKernels;
 	//! specifies the downsampled frame size used for cam motion analysis
 	cv::Size m_oDownSampledFrameSize;
 
-	//! background model pixel color intensity samples (equivalent to 'B(x)' in PBAS)
-	std::vector<cv::Mat> m_voBGColorSamples;
-	//! background model descriptors samples
-	std::vector<cv::Mat> m_voBGDescSamples;
+	//! background model samples bank, stored pixel-major: each row is a 16-byte aligned record holding all the
+	//! descriptor samples of a pixel (N*C ushorts) followed by all its color intensity samples (N*C uchars, 'B(x)' in PBAS)
+	cv::Mat m_oBGSampleBank;
+	//! running per-pixel sums of the color & descriptor samples (CV_32SC(C), kept up to date by setBGSample), used to get background images without going through the bank
+	cv::Mat m_oBGColorSumFrame, m_oBGDescSumFrame;
+	//! byte size of a pixel record in the samples bank
+	size_t m_nBGSampleRecordSize;
+	//! byte offset of the color samples in a pixel record
+	size_t m_nBGSampleColorOffset;
+	//! seed of the model's random draws (the band engines of each frame are derived from it)
+	uint64 m_nRandSeed;
+	//! random engine used by the sequential parts of the model (refreshes, motion updates, patch match)
+	RandEngine m_oRandEngine;
+	//! diagnostics sink of the debug images (not owned, may be NULL)
+	DiagnosticsSink* m_pDiagnostics;
+	//! PatchMatch refinement parameters (see setPatchMatchParams) & passes run on the last frame
+	size_t m_nPatchMatchIters;
+	double m_dPatchMatchBudgetMs;
+	int m_nPatchMatchRadius;
+	size_t m_nLastPatchMatchIters;
+	size_t m_nLastPatchMatchEvals;
 
-	//! per-pixel update rates ('T(x)' in PBAS, which contains pixel-level 'sigmas', as referred to in ViBe)
-	cv::Mat m_oUpdateRateFrame;
-	//! per-pixel distance thresholds (equivalent to 'R(x)' in PBAS, but used as a relative value to determine both intensity and descriptor variation thresholds)
-	cv::Mat m_oDistThresholdFrame;
-	//! per-pixel distance variation modulators ('v(x)', relative value used to modulate 'R(x)' and 'T(x)' variations)
-	cv::Mat m_oVariationModulatorFrame;
-	//! per-pixel mean distances between consecutive frames ('D_last(x)', used to detect ghosts and high variation regions in the sequence)
-	cv::Mat m_oMeanLastDistFrame;
-	//! per-pixel mean minimal distances from the model ('D_min(x)' in PBAS, used to control variation magnitude and direction of 'T(x)' and 'R(x)')
-	cv::Mat m_oMeanMinDistFrame_LT, m_oMeanMinDistFrame_ST;
+	//! packed per-pixel adaptive state records (one PxState per pixel stored as a CV_32FC(s_nPxStateFields) matrix, or one PxStateLean per pixel stored as CV_16UC(s_nPxStateFields) in lean mode)
+	cv::Mat m_oPxStateFrame;
+	//! destination planes of model warps, one per warped plane (swapped with their source afterwards, so they are only allocated once)
+	std::vector<cv::Mat> m_voWarpBuffers;
 	//! per-pixel mean downsampled distances between consecutive frames (used to analyze camera movement and control max learning rates globally)
 	cv::Mat m_oMeanDownSampledLastDistFrame_LT, m_oMeanDownSampledLastDistFrame_ST;
-	//! per-pixel mean raw segmentation results (used to detect unstable segmentation regions)
-	cv::Mat m_oMeanRawSegmResFrame_LT, m_oMeanRawSegmResFrame_ST;
-	//! per-pixel mean raw segmentation results (used to detect unstable segmentation regions)
-	cv::Mat m_oMeanFinalSegmResFrame_LT, m_oMeanFinalSegmResFrame_ST;
 	//! a lookup map used to keep track of unstable regions (based on segm. noise & local dist. thresholds)
 	cv::Mat m_oUnstableRegionMask;
 	//! per-pixel blink detection map ('Z(x)')
@@ -135,5 +359,23 @@ protected:
 	cv::Mat m_oLastFGMask_dilated_inverted;
 	cv::Mat m_oCurrRawFGBlinkMask;
 	cv::Mat m_oLastRawFGBlinkMask;
+	//! pre-allocated matrices used by patch match (previous frame resampled along the homography, squared differences, patch distances)
+	cv::Mat m_oPatchWarpedImg;
+	cv::Mat m_oPatchSqrDiff;
+	cv::Mat m_oPatchDist;
+	//! NNF kept between frames (with the homography match each patch started from, (-1,-1) if none) & its patch distances (warped-patch
+	//! distances where the NNF still holds the homography match)
+	std::vector<cv::Point2i> m_voPatchNNF, m_voPatchNNFPred;
+	std::vector<int> m_vnPatchNNDist;
+	//! second NNF & patch distances buffers, the refinement passes alternate between them and the ones above
+	std::vector<cv::Point2i> m_voPatchPassNNF;
+	std::vector<int> m_vnPatchPassDist;
+	//! NNF of the previous frame, used to warm-start the current one
+	std::vector<cv::Point2i> m_voPatchPrevNNF, m_voPatchPrevPred;
+	cv::Size m_oPatchNNFSize;
+	//! activity mask the kept NNF was computed with (empty = dense), the other patches of the NNF are stale
+	cv::Mat m_oPatchNNFActiveBlocks;
+	//! block graph of randomField(), kept between frames so its buffers are only allocated once
+	GridGraph m_oFieldGraph;
 };
 
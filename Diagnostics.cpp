@@ -0,0 +1,90 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <cstdio>
+
+#include "Diagnostics.h"
+
+using namespace std;
+
+DiagnosticsSink::DiagnosticsSink(const string &path): path(path), frame(0), all(false), writing(false), stopping(false) {
+}
+
+DiagnosticsSink::~DiagnosticsSink() {
+	if (!writerThread.joinable()) return ;
+	{
+		lock_guard<mutex> lock(queueMutex);
+		stopping = true;
+	}
+	queueCond.notify_all();
+	writerThread.join();
+}
+
+void DiagnosticsSink::setPath(const string &path) {
+	this->path = path;
+}
+
+void DiagnosticsSink::subscribe(const string &probe) {
+	if (probe == "*") all = true;
+	else probes.insert(probe);
+}
+
+void DiagnosticsSink::unsubscribe(const string &probe) {
+	if (probe == "*") {
+		all = false;
+		probes.clear();
+	}
+	else probes.erase(probe);
+}
+
+bool DiagnosticsSink::enabled(const string &probe) const {
+	return all || (!probes.empty() && probes.count(probe) > 0);
+}
+
+void DiagnosticsSink::setFrame(int frame) {
+	this->frame = frame;
+}
+
+void DiagnosticsSink::post(const string &probe, const cv::Mat &image) {
+	if (!enabled(probe) || image.empty()) return ;
+	char num[100];
+	sprintf(num, "%d", frame);
+	Pending pending;
+	pending.filename = path + probe + num + ".jpg";
+	// the caller keeps working on its buffer
+	pending.image = image.clone();
+	{
+		unique_lock<mutex> lock(queueMutex);
+		if (!writerThread.joinable())
+			writerThread = thread(&DiagnosticsSink::writer, this);
+		queueCond.wait(lock, [this] { return queue.size() < DIAGNOSTICS_MAX_PENDING; });
+		queue.push_back(pending);
+	}
+	queueCond.notify_all();
+}
+
+void DiagnosticsSink::flush() {
+	unique_lock<mutex> lock(queueMutex);
+	queueCond.wait(lock, [this] { return queue.empty() && !writing; });
+}
+
+void DiagnosticsSink::writer() {
+	for (;;) {
+		Pending pending;
+		{
+			unique_lock<mutex> lock(queueMutex);
+			queueCond.wait(lock, [this] { return !queue.empty() || stopping; });
+			// the pending images are still written when stopping
+			if (queue.empty()) return ;
+			pending = queue.front();
+			queue.pop_front();
+			writing = true;
+		}
+		queueCond.notify_all();
+		cv::imwrite(pending.filename, pending.image);
+		{
+			lock_guard<mutex> lock(queueMutex);
+			writing = false;
+		}
+		queueCond.notify_all();
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <string>
+#include <set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+// images waiting to be written before post() blocks
+const size_t DIAGNOSTICS_MAX_PENDING = 16;
+
+// named debug probes, all off by default
+// MovingSubtractor: "compare" (warped last frame - frame), "match" (patch match), "AResult" / "BResult" / "CResult" (mask after SuBSENSE / max flow / completion)
+// SuBSENSE complete(): "complete_input", "complete_filled" (holes filled), "complete_closed" (closed mask)
+// SuBSENSE randomField(): "field_labels" (foreground blocks), "field_border" (border blocks), "field_filled" (blocks filled by their label)
+class DiagnosticsSink {
+public:
+	// images are written as path + probe + frame + ".jpg"
+	DiagnosticsSink(const string &path = "");
+	// waits for the pending writes
+	~DiagnosticsSink();
+	void setPath(const string &path);
+	// "*" subscribes all the probes; subscriptions are not meant to change while frames are processed
+	void subscribe(const string &probe);
+	void unsubscribe(const string &probe);
+	// whether a probe is subscribed: the debug products of a probe are only computed if it is
+	bool enabled(const string &probe) const;
+	// frame index used to name the next images
+	void setFrame(int frame);
+	// copies the image, which is written on a background thread (no-op if the probe is not subscribed)
+	void post(const string &probe, const cv::Mat &image);
+	// waits until all posted images are written
+	void flush();
+
+private:
+	struct Pending {
+		string filename;
+		cv::Mat image;
+	};
+	void writer();
+
+	string path;
+	int frame;
+	set<string> probes;
+	bool all;
+	// writer thread, started by the first post
+	thread writerThread;
+	mutex queueMutex;
+	condition_variable queueCond;
+	deque<Pending> queue;
+	bool writing;
+	bool stopping;
+};
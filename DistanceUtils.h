@@ -1,6 +1,16 @@
 #pragma once
 
 #include <opencv2/core/types_c.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DISTUTILS_USE_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#include <emmintrin.h>
+#define DISTUTILS_USE_SSE2 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 //! computes the L1 distance between two integer values
 template<typename T> static inline typename std::enable_if<std::is_integral<T>::value,size_t>::type L1dist(T a, T b) {
@@ -314,3 +324,220 @@ template<size_t nChannels, typename T> static inline size_t hdist(const T* a, co
 template<size_t nChannels, typename T> static inline size_t gdist(const T* a, const T* b) {
 	return L1dist(popcount<nChannels>(a),popcount<nChannels>(b));
 }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! number of samples tested at once by the L1distMask & hdistMask functions (sample arrays must be readable up to a multiple of it)
+#if DISTUTILS_USE_AVX2
+static const size_t L1DIST_MASK_GROUP_SIZE = 32;
+#elif DISTUTILS_USE_SSE2
+static const size_t L1DIST_MASK_GROUP_SIZE = 16;
+#else //!DISTUTILS_USE_AVX2 && !DISTUTILS_USE_SSE2
+static const size_t L1DIST_MASK_GROUP_SIZE = 32;
+#endif //!DISTUTILS_USE_AVX2 && !DISTUTILS_USE_SSE2
+
+//! returns the index of the lowest set bit of a non-zero 32-bit mask
+static inline size_t lsbidx(unsigned int x) {
+	CV_DbgAssert(x);
+#if defined(_MSC_VER)
+	unsigned long nIdx;
+	_BitScanForward(&nIdx,x);
+	return (size_t)nIdx;
+#else //!defined(_MSC_VER)
+	return (size_t)__builtin_ctz(x);
+#endif //!defined(_MSC_VER)
+}
+
+//! scalar version of L1distMask_1ch (always available, e.g. to check the SIMD paths)
+static inline unsigned int L1distMask_1ch_scalar(const uchar* samples, uchar ref, size_t threshold) {
+	const uchar t = (uchar)std::min(threshold,(size_t)UCHAR_MAX);
+	unsigned int nMask = 0;
+	for(size_t s=0; s<L1DIST_MASK_GROUP_SIZE; ++s)
+		nMask |= (unsigned int)(L1dist(samples[s],ref)<=t)<<s;
+	return nMask;
+}
+
+//! scalar version of L1distMask_3ch
+static inline unsigned int L1distMask_3ch_scalar(const uchar* samples, const uchar* ref, size_t threshold) {
+	const uchar t = (uchar)std::min(threshold,(size_t)UCHAR_MAX);
+	unsigned int nMask = 0;
+	for(size_t s=0; s<L1DIST_MASK_GROUP_SIZE; ++s)
+		nMask |= (unsigned int)(L1dist(samples[s*3],ref[0])<=t && L1dist(samples[s*3+1],ref[1])<=t && L1dist(samples[s*3+2],ref[2])<=t)<<s;
+	return nMask;
+}
+
+//! returns a bitmask of the samples (in a group of L1DIST_MASK_GROUP_SIZE 1-channel samples) whose L1 distance to 'ref' is lower or equal to the threshold
+static inline unsigned int L1distMask_1ch(const uchar* samples, uchar ref, size_t threshold) {
+#if DISTUTILS_USE_AVX2 || DISTUTILS_USE_SSE2
+	const uchar t = (uchar)std::min(threshold,(size_t)UCHAR_MAX);
+#endif //DISTUTILS_USE_AVX2 || DISTUTILS_USE_SSE2
+#if DISTUTILS_USE_AVX2
+	const __m256i vRef = _mm256_set1_epi8((char)ref);
+	const __m256i vSamples = _mm256_loadu_si256((const __m256i*)samples);
+	const __m256i vDist = _mm256_or_si256(_mm256_subs_epu8(vSamples,vRef),_mm256_subs_epu8(vRef,vSamples));
+	const __m256i vExcess = _mm256_subs_epu8(vDist,_mm256_set1_epi8((char)t));
+	return (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(vExcess,_mm256_setzero_si256()));
+#elif DISTUTILS_USE_SSE2
+	const __m128i vRef = _mm_set1_epi8((char)ref);
+	const __m128i vSamples = _mm_loadu_si128((const __m128i*)samples);
+	const __m128i vDist = _mm_or_si128(_mm_subs_epu8(vSamples,vRef),_mm_subs_epu8(vRef,vSamples));
+	const __m128i vExcess = _mm_subs_epu8(vDist,_mm_set1_epi8((char)t));
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(vExcess,_mm_setzero_si128()));
+#else //!DISTUTILS_USE_AVX2 && !DISTUTILS_USE_SSE2
+	return L1distMask_1ch_scalar(samples,ref,threshold);
+#endif //!DISTUTILS_USE_AVX2 && !DISTUTILS_USE_SSE2
+}
+
+//! returns a bitmask of the samples (in a group of L1DIST_MASK_GROUP_SIZE interleaved 3-channels samples) whose per-channel L1 distances to 'ref' are all lower or equal to the threshold
+static inline unsigned int L1distMask_3ch(const uchar* samples, const uchar* ref, size_t threshold) {
+#if DISTUTILS_USE_AVX2 || DISTUTILS_USE_SSE2
+	const uchar t = (uchar)std::min(threshold,(size_t)UCHAR_MAX);
+	// the interleaved reference pattern has a 3-register period, so each register gets its own phase of it
+	const size_t nRegSize = L1DIST_MASK_GROUP_SIZE;
+	uchar anRefPattern[L1DIST_MASK_GROUP_SIZE*3];
+	for(size_t n=0; n<nRegSize*3; ++n)
+		anRefPattern[n] = ref[n%3];
+	unsigned int anByteMasks[3];
+	for(size_t r=0; r<3; ++r) {
+#if DISTUTILS_USE_AVX2
+		const __m256i vRef = _mm256_loadu_si256((const __m256i*)(anRefPattern+r*nRegSize));
+		const __m256i vSamples = _mm256_loadu_si256((const __m256i*)(samples+r*nRegSize));
+		const __m256i vDist = _mm256_or_si256(_mm256_subs_epu8(vSamples,vRef),_mm256_subs_epu8(vRef,vSamples));
+		const __m256i vExcess = _mm256_subs_epu8(vDist,_mm256_set1_epi8((char)t));
+		anByteMasks[r] = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(vExcess,_mm256_setzero_si256()));
+#else //DISTUTILS_USE_SSE2
+		const __m128i vRef = _mm_loadu_si128((const __m128i*)(anRefPattern+r*nRegSize));
+		const __m128i vSamples = _mm_loadu_si128((const __m128i*)(samples+r*nRegSize));
+		const __m128i vDist = _mm_or_si128(_mm_subs_epu8(vSamples,vRef),_mm_subs_epu8(vRef,vSamples));
+		const __m128i vExcess = _mm_subs_epu8(vDist,_mm_set1_epi8((char)t));
+		anByteMasks[r] = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(vExcess,_mm_setzero_si128()));
+#endif //DISTUTILS_USE_SSE2
+	}
+	// a sample passes only if its 3 consecutive channel bits are all set
+	unsigned int nMask = 0;
+	for(size_t s=0, b=0; s<L1DIST_MASK_GROUP_SIZE; ++s, b+=3) {
+		const unsigned int nBits = ((anByteMasks[b/nRegSize]>>(b%nRegSize))&1)
+		                         & ((anByteMasks[(b+1)/nRegSize]>>((b+1)%nRegSize))&1)
+		                         & ((anByteMasks[(b+2)/nRegSize]>>((b+2)%nRegSize))&1);
+		nMask |= nBits<<s;
+	}
+	return nMask;
+#else //!DISTUTILS_USE_AVX2 && !DISTUTILS_USE_SSE2
+	return L1distMask_3ch_scalar(samples,ref,threshold);
+#endif //!DISTUTILS_USE_AVX2 && !DISTUTILS_USE_SSE2
+}
+
+//! scalar version of hdistMask_1ch
+static inline unsigned int hdistMask_1ch_scalar(const ushort* samples, ushort ref, size_t threshold) {
+	unsigned int nMask = 0;
+	for(size_t s=0; s<L1DIST_MASK_GROUP_SIZE; ++s)
+		nMask |= (unsigned int)(hdist(samples[s],ref)<=threshold)<<s;
+	return nMask;
+}
+
+//! scalar version of hdistMask_3ch
+static inline unsigned int hdistMask_3ch_scalar(const ushort* samples, const ushort* ref, size_t threshold) {
+	unsigned int nMask = 0;
+	for(size_t s=0; s<L1DIST_MASK_GROUP_SIZE; ++s)
+		nMask |= (unsigned int)(hdist<3>(samples+s*3,ref)<=threshold)<<s;
+	return nMask;
+}
+
+#if DISTUTILS_USE_AVX2 || DISTUTILS_USE_SSE2
+//! computes the population count of each 16-bit lane
+static inline __m128i popcount_epi16(__m128i x) {
+	x = _mm_sub_epi16(x,_mm_and_si128(_mm_srli_epi16(x,1),_mm_set1_epi16(0x5555)));
+	x = _mm_add_epi16(_mm_and_si128(x,_mm_set1_epi16(0x3333)),_mm_and_si128(_mm_srli_epi16(x,2),_mm_set1_epi16(0x3333)));
+	x = _mm_and_si128(_mm_add_epi16(x,_mm_srli_epi16(x,4)),_mm_set1_epi16(0x0F0F));
+	return _mm_and_si128(_mm_add_epi16(x,_mm_srli_epi16(x,8)),_mm_set1_epi16(0x001F));
+}
+#endif //DISTUTILS_USE_AVX2 || DISTUTILS_USE_SSE2
+
+//! returns a bitmask of the samples (in a group of L1DIST_MASK_GROUP_SIZE 1-channel descriptors) whose hamming distance to 'ref' is lower or equal to the threshold
+static inline unsigned int hdistMask_1ch(const ushort* samples, ushort ref, size_t threshold) {
+#if DISTUTILS_USE_AVX2 || DISTUTILS_USE_SSE2
+	const __m128i vRef = _mm_set1_epi16((short)ref);
+	const __m128i vThreshold = _mm_set1_epi16((short)std::min(threshold,(size_t)16));
+	unsigned int nMask = 0;
+	for(size_t s=0; s<L1DIST_MASK_GROUP_SIZE; s+=16) {
+		const __m128i vDistLo = popcount_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(samples+s)),vRef));
+		const __m128i vDistHi = popcount_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(samples+s+8)),vRef));
+		const __m128i vExcess = _mm_packs_epi16(_mm_cmpgt_epi16(vDistLo,vThreshold),_mm_cmpgt_epi16(vDistHi,vThreshold));
+		nMask |= ((unsigned int)_mm_movemask_epi8(vExcess)^0xFFFFu)<<s;
+	}
+	return nMask;
+#else //!DISTUTILS_USE_AVX2 && !DISTUTILS_USE_SSE2
+	return hdistMask_1ch_scalar(samples,ref,threshold);
+#endif //!DISTUTILS_USE_AVX2 && !DISTUTILS_USE_SSE2
+}
+
+//! returns a bitmask of the samples (in a group of L1DIST_MASK_GROUP_SIZE interleaved 3-channels descriptors) whose total hamming distance to 'ref' is lower or equal to the threshold
+static inline unsigned int hdistMask_3ch(const ushort* samples, const ushort* ref, size_t threshold) {
+#if DISTUTILS_USE_AVX2 || DISTUTILS_USE_SSE2
+	// the lane popcounts are vectorized, the per-sample sums of 3 consecutive lanes are not
+	const __m128i avRef[3] = {_mm_setr_epi16((short)ref[0],(short)ref[1],(short)ref[2],(short)ref[0],(short)ref[1],(short)ref[2],(short)ref[0],(short)ref[1]),
+	                          _mm_setr_epi16((short)ref[2],(short)ref[0],(short)ref[1],(short)ref[2],(short)ref[0],(short)ref[1],(short)ref[2],(short)ref[0]),
+	                          _mm_setr_epi16((short)ref[1],(short)ref[2],(short)ref[0],(short)ref[1],(short)ref[2],(short)ref[0],(short)ref[1],(short)ref[2])};
+	ushort anDists[L1DIST_MASK_GROUP_SIZE*3];
+	for(size_t n=0, r=0; n<L1DIST_MASK_GROUP_SIZE*3; n+=8, r=(r+1)%3)
+		_mm_storeu_si128((__m128i*)(anDists+n),popcount_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(samples+n)),avRef[r])));
+	unsigned int nMask = 0;
+	for(size_t s=0; s<L1DIST_MASK_GROUP_SIZE; ++s)
+		nMask |= (unsigned int)((size_t)(anDists[s*3]+anDists[s*3+1]+anDists[s*3+2])<=threshold)<<s;
+	return nMask;
+#else //!DISTUTILS_USE_AVX2 && !DISTUTILS_USE_SSE2
+	return hdistMask_3ch_scalar(samples,ref,threshold);
+#endif //!DISTUTILS_USE_AVX2 && !DISTUTILS_USE_SSE2
+}
+
+//! computes the element-wise squared differences of two uchar arrays (255^2 still fits in a ushort)
+static inline void L2sqrdistArray(const uchar* a, const uchar* b, ushort* d, size_t nElements) {
+	size_t n = 0;
+#if DISTUTILS_USE_AVX2
+	for(; n+16<=nElements; n+=16) {
+		const __m128i vA = _mm_loadu_si128((const __m128i*)(a+n));
+		const __m128i vB = _mm_loadu_si128((const __m128i*)(b+n));
+		const __m256i vDist = _mm256_cvtepu8_epi16(_mm_or_si128(_mm_subs_epu8(vA,vB),_mm_subs_epu8(vB,vA)));
+		_mm256_storeu_si256((__m256i*)(d+n),_mm256_mullo_epi16(vDist,vDist));
+	}
+#elif DISTUTILS_USE_SSE2
+	const __m128i vZero = _mm_setzero_si128();
+	for(; n+16<=nElements; n+=16) {
+		const __m128i vA = _mm_loadu_si128((const __m128i*)(a+n));
+		const __m128i vB = _mm_loadu_si128((const __m128i*)(b+n));
+		const __m128i vDist = _mm_or_si128(_mm_subs_epu8(vA,vB),_mm_subs_epu8(vB,vA));
+		const __m128i vDistLo = _mm_unpacklo_epi8(vDist,vZero), vDistHi = _mm_unpackhi_epi8(vDist,vZero);
+		_mm_storeu_si128((__m128i*)(d+n),_mm_mullo_epi16(vDistLo,vDistLo));
+		_mm_storeu_si128((__m128i*)(d+n+8),_mm_mullo_epi16(vDistHi,vDistHi));
+	}
+#endif //DISTUTILS_USE_SSE2
+	for(; n<nElements; ++n) {
+		const int nDist = (int)a[n]-(int)b[n];
+		d[n] = (ushort)(nDist*nDist);
+	}
+}
+
+//! returns the sum of the element-wise squared differences of two uchar arrays (i.e. their squared L2 distance)
+static inline int L2sqrdistSum(const uchar* a, const uchar* b, size_t nElements) {
+	size_t n = 0;
+	int nSum = 0;
+#if DISTUTILS_USE_AVX2 || DISTUTILS_USE_SSE2
+	const __m128i vZero = _mm_setzero_si128();
+	__m128i vSum = _mm_setzero_si128();
+	for(; n+16<=nElements; n+=16) {
+		const __m128i vA = _mm_loadu_si128((const __m128i*)(a+n));
+		const __m128i vB = _mm_loadu_si128((const __m128i*)(b+n));
+		const __m128i vDist = _mm_or_si128(_mm_subs_epu8(vA,vB),_mm_subs_epu8(vB,vA));
+		const __m128i vDistLo = _mm_unpacklo_epi8(vDist,vZero), vDistHi = _mm_unpackhi_epi8(vDist,vZero);
+		vSum = _mm_add_epi32(vSum,_mm_add_epi32(_mm_madd_epi16(vDistLo,vDistLo),_mm_madd_epi16(vDistHi,vDistHi)));
+	}
+	int anSums[4];
+	_mm_storeu_si128((__m128i*)anSums,vSum);
+	nSum = anSums[0]+anSums[1]+anSums[2]+anSums[3];
+#endif //DISTUTILS_USE_AVX2 || DISTUTILS_USE_SSE2
+	for(; n<nElements; ++n) {
+		const int nDist = (int)a[n]-(int)b[n];
+		nSum += nDist*nDist;
+	}
+	return nSum;
+}
@@ -0,0 +1,101 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+#include <algorithm>
+
+#include "FeatureTracker.h"
+
+using namespace std;
+
+FeatureTracker::FeatureTracker(int budget, double qualityLevel, double minDistance): budget(budget), qualityLevel(qualityLevel), minDistance(minDistance), lastDetected(0) {
+	CV_Assert(budget > 0);
+}
+
+void FeatureTracker::reset() {
+	points.clear();
+}
+
+void FeatureTracker::setBudget(int budget) {
+	CV_Assert(budget > 0);
+	this->budget = budget;
+}
+
+int FeatureTracker::getBudget() const {
+	return budget;
+}
+
+int FeatureTracker::getLastDetectedCount() const {
+	return lastDetected;
+}
+
+void FeatureTracker::refill(const cv::Mat &grey) {
+	lastDetected = 0;
+	const int cells = TRACKER_GRID_COLS * TRACKER_GRID_ROWS;
+	const int share = max(1, budget / cells);
+	vector<int> counts(cells, 0);
+	for (size_t i = 0; i < points.size(); i ++) {
+		const int cx = min(TRACKER_GRID_COLS - 1, (int) (points[i].x * TRACKER_GRID_COLS / grey.cols));
+		const int cy = min(TRACKER_GRID_ROWS - 1, (int) (points[i].y * TRACKER_GRID_ROWS / grey.rows));
+		counts[cy * TRACKER_GRID_COLS + cx] ++;
+	}
+	bool needed = false;
+	for (int c = 0; c < cells && !needed; c ++)
+		needed = counts[c] < share * TRACKER_REFILL_RATIO;
+	if (!needed) return ;
+	// the quality threshold is relative to the strongest corner of the whole frame (as for a single detection), not of each cell:
+	// goodFeaturesToTrack scales it by the strongest corner of its input, so the cell level is rescaled accordingly
+	cv::cornerMinEigenVal(grey, cornerResponse, 3);
+	double frameMax = 0;
+	cv::minMaxLoc(cornerResponse, NULL, &frameMax);
+	const double minResponse = qualityLevel * frameMax;
+	if (minResponse <= 0) return ;
+	// new corners keep away from the points already tracked
+	detectMask.create(grey.size(), CV_8UC1);
+	detectMask = cv::Scalar(255);
+	for (size_t i = 0; i < points.size(); i ++)
+		cv::circle(detectMask, points[i], (int) ceil(minDistance), cv::Scalar(0), -1);
+	for (int cy = 0; cy < TRACKER_GRID_ROWS; cy ++) {
+		for (int cx = 0; cx < TRACKER_GRID_COLS; cx ++) {
+			const int c = cy * TRACKER_GRID_COLS + cx;
+			const int room = min(share - counts[c], budget - (int) points.size());
+			if (counts[c] >= share * TRACKER_REFILL_RATIO || room <= 0) continue;
+			const cv::Rect cell(cx * grey.cols / TRACKER_GRID_COLS, cy * grey.rows / TRACKER_GRID_ROWS,
+								(cx + 1) * grey.cols / TRACKER_GRID_COLS - cx * grey.cols / TRACKER_GRID_COLS,
+								(cy + 1) * grey.rows / TRACKER_GRID_ROWS - cy * grey.rows / TRACKER_GRID_ROWS);
+			double cellMax = 0;
+			cv::minMaxLoc(cornerResponse(cell), NULL, &cellMax, NULL, NULL, detectMask(cell));
+			// no corner of the cell would pass the frame threshold
+			if (cellMax < minResponse) continue;
+			cv::goodFeaturesToTrack(grey(cell), corners, room, minResponse / cellMax, minDistance, detectMask(cell));
+			for (size_t i = 0; i < corners.size(); i ++)
+				points.push_back(corners[i] + cv::Point2f((float) cell.x, (float) cell.y));
+			lastDetected += (int) corners.size();
+		}
+	}
+}
+
+void FeatureTracker::track(const cv::Mat &lastGrey, const vector<cv::Mat> &lastPyramid, const vector<cv::Mat> &currPyramid,
+						   cv::Size winSize, int maxLevel, vector<cv::Point2f> &from, vector<cv::Point2f> &to, vector<float> &errors) {
+	refill(lastGrey);
+	vector<uchar> status;
+	from.clear();
+	to.clear();
+	errors.clear();
+	if (!points.empty())
+		cv::calcOpticalFlowPyrLK(lastPyramid, currPyramid, points, to, status, errors, winSize, maxLevel);
+	// keep the points tracked inside of the frame
+	int k = 0;
+	for (size_t i = 0; i < to.size(); i ++) {
+		if (status[i] == 1 && to[i].x >= 0 && to[i].y >= 0 && to[i].x < lastGrey.cols && to[i].y < lastGrey.rows) {
+			points[k] = points[i];
+			errors[k] = errors[i];
+			to[k ++] = to[i];
+		}
+	}
+	points.resize(k);
+	to.resize(k);
+	errors.resize(k);
+	// the pairs are returned, and the tracked points become the last frame points of the next call
+	from.swap(points);
+	points = to;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+#include <vector>
+
+using namespace std;
+
+// default number of points tracked per frame
+const int TRACKER_DEFAULT_BUDGET = 2000;
+// grid used to keep the points spread over the frame
+const int TRACKER_GRID_COLS = 8;
+const int TRACKER_GRID_ROWS = 6;
+// a cell is topped up once it holds less than this fraction of its share of the budget
+const double TRACKER_REFILL_RATIO = 0.5;
+
+// keeps feature points alive across frames: points tracked successfully are carried forward,
+// and new corners are only detected in the grid cells that ran short of points
+class FeatureTracker {
+public:
+	FeatureTracker(int budget = TRACKER_DEFAULT_BUDGET, double qualityLevel = 0.05, double minDistance = 2);
+	// forget all points
+	void reset();
+	// top up the points of the last frame and track them into the current one (pyramids built by cv::buildOpticalFlowPyramid)
+	// from / to receive the successfully tracked pairs, which are carried forward to the next call, and errors their LK errors
+	void track(const cv::Mat &lastGrey, const vector<cv::Mat> &lastPyramid, const vector<cv::Mat> &currPyramid,
+			   cv::Size winSize, int maxLevel, vector<cv::Point2f> &from, vector<cv::Point2f> &to, vector<float> &errors);
+	void setBudget(int budget);
+	int getBudget() const;
+	// number of corners detected during the last call
+	int getLastDetectedCount() const;
+
+private:
+	// detect corners in the cells holding too few points (with one quality threshold for the whole frame)
+	void refill(const cv::Mat &grey);
+
+	int budget;
+	double qualityLevel;
+	double minDistance;
+	int lastDetected;
+	// points in the last frame
+	vector<cv::Point2f> points;
+	// detection buffers
+	cv::Mat detectMask;
+	cv::Mat cornerResponse;
+	vector<cv::Point2f> corners;
+};
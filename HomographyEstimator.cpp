@@ -0,0 +1,255 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "HomographyEstimator.h"
+
+using namespace std;
+
+const double sprtModelCost = 200;		// cost of a hypothesis (generation) in pair verifications
+const double sprtInitialDelta = 0.05;	// initial probability of a pair being consistent with a bad model
+const double sprtInitialEpsilon = 0.2;	// initial inlier ratio guess
+const double loThresholdScale = 3;		// local optimization starts at this multiple of the threshold
+const int loSteps = 4;					// local optimization refits
+
+// ranks pairs by their quality value
+struct RankLess {
+	const vector<float> &rank;
+	RankLess(const vector<float> &r): rank(r) {}
+	bool operator()(int a, int b) const { return rank[a] < rank[b]; }
+};
+
+HomographyEstimator::HomographyEstimator(double threshold, double confidence, int maxIterations): threshold(threshold), confidence(confidence), maxIterations(maxIterations),
+	prosacN(0), prosacTn(0), prosacTnPrime(0), sprtDelta(sprtInitialDelta), sprtEpsilon(sprtInitialEpsilon), sprtA(0), rng(), lastIterations(0), lastInlierRatio(0) {
+	CV_Assert(threshold > 0 && confidence > 0 && confidence < 1 && maxIterations > 0);
+}
+
+int HomographyEstimator::getLastIterations() const {
+	return lastIterations;
+}
+
+double HomographyEstimator::getLastInlierRatio() const {
+	return lastInlierRatio;
+}
+
+cv::Mat HomographyEstimator::estimate(const vector<cv::Point2f> &from, const vector<cv::Point2f> &to, const vector<float> &rank, vector<uchar> &inliers) {
+	CV_Assert(from.size() == to.size() && (rank.empty() || rank.size() == from.size()));
+	const int n = (int) from.size();
+	lastIterations = 0;
+	lastInlierRatio = 0;
+	inliers.assign(n, 0);
+	if (n < 4) return cv::Mat();
+	// PROSAC works on the pairs sorted from the best to the worst
+	order.resize(n);
+	for (int i = 0; i < n; i ++)
+		order[i] = i;
+	if (!rank.empty())
+		stable_sort(order.begin(), order.end(), RankLess(rank));
+	src.resize(n);
+	dst.resize(n);
+	for (int i = 0; i < n; i ++) {
+		src[i] = from[order[i]];
+		dst[i] = to[order[i]];
+	}
+	// PROSAC schedule: T_4 = T_N * C(4, 4) / C(N, 4), with T_N = maxIterations
+	prosacN = 4;
+	prosacTn = maxIterations;
+	for (int i = 0; i < 4; i ++)
+		prosacTn *= (double) (4 - i) / (n - i);
+	prosacTnPrime = 1;
+	sprtDelta = sprtInitialDelta;
+	sprtEpsilon = sprtInitialEpsilon;
+	updateSprt();
+
+	double best[9];
+	int bestCount = 0, iterationLimit = maxIterations, iteration = 0;
+	for (; iteration < iterationLimit; iteration ++) {
+		int sample[4];
+		drawSample(iteration + 1, n, sample);
+		double h[9];
+		if (!solveMinimal(sample, h)) continue;
+		int count, tested;
+		if (!verify(h, count, tested)) {
+			// rejected models tell how many pairs a bad model agrees with
+			const double delta = max(0.01, min(0.5, (double) count / tested));
+			const double updated = 0.95 * sprtDelta + 0.05 * delta;
+			if (fabs(updated - sprtDelta) > 0.05 * sprtDelta) {
+				sprtDelta = updated;
+				updateSprt();
+			}
+			else sprtDelta = updated;
+			continue;
+		}
+		if (count <= bestCount) continue;
+		count = optimize(h, count);
+		if (count <= bestCount) continue;
+		copy(h, h + 9, best);
+		bestCount = count;
+		sprtEpsilon = (double) bestCount / n;
+		updateSprt();
+		// adaptive stopping: enough hypotheses to draw an all-inlier sample with the wanted confidence
+		const double allInliers = pow(sprtEpsilon, 4);
+		if (allInliers > 1 - DBL_EPSILON)
+			iterationLimit = iteration + 1;
+		else
+			iterationLimit = min(maxIterations, (int) ceil(log(1 - confidence) / log(1 - allInliers)));
+	}
+	lastIterations = iteration;
+	if (!bestCount) return cv::Mat();
+	// final least squares fit on all the inliers
+	double refined[9];
+	if (refit(best, threshold, refined) && score(refined, threshold, NULL) >= bestCount)
+		copy(refined, refined + 9, best);
+	vector<uchar> sortedMask;
+	bestCount = score(best, threshold, &sortedMask);
+	for (int i = 0; i < n; i ++)
+		inliers[order[i]] = sortedMask[i];
+	lastInlierRatio = (double) bestCount / n;
+	return cv::Mat(3, 3, CV_64F, best).clone();
+}
+
+void HomographyEstimator::drawSample(int iteration, int n, int sample[4]) {
+	// grow the pool once the schedule says the current one has been sampled enough
+	if (iteration > prosacTnPrime && prosacN < n) {
+		const double next = prosacTn * (prosacN + 1) / (prosacN + 1 - 4);
+		prosacTnPrime += (int) ceil(next - prosacTn);
+		prosacTn = next;
+		prosacN ++;
+	}
+	// the newest pair of the pool is always part of the sample, until the pool covers all pairs
+	const bool withNewest = prosacTnPrime >= iteration;
+	const int pool = withNewest ? prosacN - 1 : prosacN;
+	const int random = withNewest ? 3 : 4;
+	for (int i = 0; i < random; i ++) {
+		bool unique;
+		do {
+			sample[i] = (int) rng((unsigned int) pool);
+			unique = true;
+			for (int j = 0; j < i; j ++)
+				unique = unique && sample[j] != sample[i];
+		} while (!unique);
+	}
+	if (withNewest) sample[3] = prosacN - 1;
+}
+
+bool HomographyEstimator::solveMinimal(const int sample[4], double h[9]) const {
+	static const int triangles[4][3] = {{0, 1, 2}, {0, 1, 3}, {0, 2, 3}, {1, 2, 3}};
+	cv::Point2f a[4], b[4];
+	for (int i = 0; i < 4; i ++) {
+		a[i] = src[sample[i]];
+		b[i] = dst[sample[i]];
+	}
+	// degenerate (3 collinear points) or orientation-flipping samples cannot come from a camera motion
+	for (int t = 0; t < 4; t ++) {
+		const cv::Point2f &a0 = a[triangles[t][0]], &a1 = a[triangles[t][1]], &a2 = a[triangles[t][2]];
+		const cv::Point2f &b0 = b[triangles[t][0]], &b1 = b[triangles[t][1]], &b2 = b[triangles[t][2]];
+		const double crossA = (double) (a1.x - a0.x) * (a2.y - a0.y) - (double) (a1.y - a0.y) * (a2.x - a0.x);
+		const double crossB = (double) (b1.x - b0.x) * (b2.y - b0.y) - (double) (b1.y - b0.y) * (b2.x - b0.x);
+		if (fabs(crossA) < 1e-3 || fabs(crossB) < 1e-3 || (crossA > 0) != (crossB > 0)) return false;
+	}
+	const cv::Mat model = cv::getPerspectiveTransform(a, b);
+	const double* p = model.ptr<double>(0);
+	if (fabs(p[8]) < DBL_EPSILON) return false;
+	for (int i = 0; i < 9; i ++)
+		h[i] = p[i] / p[8];
+	return true;
+}
+
+inline double HomographyEstimator::residual(const double h[9], int i) const {
+	const double x = src[i].x, y = src[i].y;
+	const double w = h[6] * x + h[7] * y + h[8];
+	if (fabs(w) < DBL_EPSILON) return DBL_MAX;
+	const double dx = (h[0] * x + h[1] * y + h[2]) / w - dst[i].x, dy = (h[3] * x + h[4] * y + h[5]) / w - dst[i].y;
+	return dx * dx + dy * dy;
+}
+
+bool HomographyEstimator::verify(const double h[9], int &inlierCount, int &tested) const {
+	const int n = (int) src.size();
+	const double threshold2 = threshold * threshold;
+	const double inlierRatio = sprtDelta / sprtEpsilon, outlierRatio = (1 - sprtDelta) / (1 - sprtEpsilon);
+	// the pairs are sorted by rank, so they are checked with a fixed stride to mix good and bad ones
+	const int stride = n > 7 ? 7 : 1;
+	double lambda = 1;
+	inlierCount = 0;
+	tested = 0;
+	for (int start = 0; start < stride; start ++) {
+		for (int i = start; i < n; i += stride) {
+			tested ++;
+			if (residual(h, i) <= threshold2) {
+				inlierCount ++;
+				lambda *= inlierRatio;
+			}
+			else
+				lambda *= outlierRatio;
+			if (lambda > sprtA) return false;
+		}
+	}
+	return true;
+}
+
+int HomographyEstimator::score(const double h[9], double threshold, vector<uchar> *mask) const {
+	const int n = (int) src.size();
+	const double threshold2 = threshold * threshold;
+	if (mask) mask->assign(n, 0);
+	int count = 0;
+	for (int i = 0; i < n; i ++) {
+		if (residual(h, i) <= threshold2) {
+			count ++;
+			if (mask) (*mask)[i] = 1;
+		}
+	}
+	return count;
+}
+
+bool HomographyEstimator::refit(const double h[9], double threshold, double refined[9]) const {
+	const int n = (int) src.size();
+	const double threshold2 = threshold * threshold;
+	vector<cv::Point2f> a, b;
+	for (int i = 0; i < n; i ++) {
+		if (residual(h, i) <= threshold2) {
+			a.push_back(src[i]);
+			b.push_back(dst[i]);
+		}
+	}
+	if (a.size() < 4) return false;
+	// method 0 = plain least squares over all the given pairs
+	const cv::Mat model = cv::findHomography(cv::Mat(a), cv::Mat(b), 0);
+	if (model.empty()) return false;
+	const double* p = model.ptr<double>(0);
+	if (fabs(p[8]) < DBL_EPSILON) return false;
+	for (int i = 0; i < 9; i ++)
+		refined[i] = p[i] / p[8];
+	return true;
+}
+
+int HomographyEstimator::optimize(double h[9], int inlierCount) const {
+	// refits with a threshold shrinking from loThresholdScale * threshold down to threshold, as long as they do not lose inliers
+	for (int step = 0; step < loSteps; step ++) {
+		const double stepThreshold = threshold * (loThresholdScale - (loThresholdScale - 1) * step / (loSteps - 1));
+		double refined[9];
+		if (!refit(h, stepThreshold, refined)) break;
+		const int count = score(refined, threshold, NULL);
+		if (count < inlierCount) break;
+		copy(refined, refined + 9, h);
+		inlierCount = count;
+	}
+	return inlierCount;
+}
+
+void HomographyEstimator::updateSprt() {
+	// no test possible while good models are not expected to agree with more pairs than bad ones
+	if (sprtEpsilon <= sprtDelta * 1.05) {
+		sprtA = DBL_MAX;
+		return;
+	}
+	// A is the fixed point of A = K1 + 1 + log(A), K1 = t_M * C (Chum & Matas, 2008)
+	const double c = (1 - sprtDelta) * log((1 - sprtDelta) / (1 - sprtEpsilon)) + sprtDelta * log(sprtDelta / sprtEpsilon);
+	const double k1 = sprtModelCost * c;
+	double a = k1 + 1;
+	for (int i = 0; i < 10; i ++)
+		a = k1 + 1 + log(a);
+	sprtA = a;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+#include "RandUtils.h"
+
+using namespace std;
+
+// default reprojection threshold (in pixels)
+const double HOMOGRAPHY_DEFAULT_THRESHOLD = 0.1;
+// default confidence of the adaptive stopping criterion
+const double HOMOGRAPHY_DEFAULT_CONFIDENCE = 0.995;
+// default hard limit on the number of hypotheses
+const int HOMOGRAPHY_DEFAULT_MAX_ITERATIONS = 2000;
+
+// RANSAC homography estimator tuned for the per-frame camera motion:
+// - PROSAC sampling: hypotheses are drawn from the best ranked pairs first (e.g. lowest LK error), the pool growing over time
+// - SPRT (Wald's sequential test): a hypothesis is abandoned as soon as the pairs checked so far make it unlikely to be good
+// - local optimization: each new best model is refit on its inliers with a shrinking threshold
+// - adaptive stopping: the iteration count follows the best inlier ratio found so far
+class HomographyEstimator {
+public:
+	HomographyEstimator(double threshold = HOMOGRAPHY_DEFAULT_THRESHOLD, double confidence = HOMOGRAPHY_DEFAULT_CONFIDENCE, int maxIterations = HOMOGRAPHY_DEFAULT_MAX_ITERATIONS);
+	// fits the homography mapping from onto to; rank gives the pair ordering (lower is better)
+	// returns an empty matrix if no model could be found, inliers receives the inlier mask
+	cv::Mat estimate(const vector<cv::Point2f> &from, const vector<cv::Point2f> &to, const vector<float> &rank, vector<uchar> &inliers);
+	// number of hypotheses drawn by the last call
+	int getLastIterations() const;
+	// inlier ratio of the model returned by the last call
+	double getLastInlierRatio() const;
+
+private:
+	// draw the 4 indices of the next PROSAC sample
+	void drawSample(int iteration, int n, int sample[4]);
+	// minimal model from 4 pairs, false if degenerate
+	bool solveMinimal(const int sample[4], double h[9]) const;
+	// squared reprojection error of a pair
+	inline double residual(const double h[9], int i) const;
+	// verify a model with the SPRT, false if rejected early; counts the inliers otherwise
+	bool verify(const double h[9], int &inlierCount, int &tested) const;
+	// count the inliers of a model (no early exit), optionally filling the mask
+	int score(const double h[9], double threshold, vector<uchar> *mask) const;
+	// least squares refit on the inliers at the given threshold, false if degenerate
+	bool refit(const double h[9], double threshold, double refined[9]) const;
+	// local optimization of a new best model, returns its (possibly improved) inlier count
+	int optimize(double h[9], int inlierCount) const;
+	// decision threshold of the SPRT for the current delta / epsilon
+	void updateSprt();
+
+	double threshold;
+	double confidence;
+	int maxIterations;
+	// sorted pairs
+	vector<cv::Point2f> src, dst;
+	vector<int> order;
+	// PROSAC schedule
+	int prosacN;
+	double prosacTn;
+	int prosacTnPrime;
+	// SPRT state: delta = probability of a pair being consistent with a bad model, epsilon = inlier ratio
+	double sprtDelta, sprtEpsilon, sprtA;
+	RandEngine rng;
+	// stats
+	int lastIterations;
+	double lastInlierRatio;
+};
@@ -11,162 +11,324 @@
 
 using namespace std;
 
-const int max_count = 50000;		// maximum number of features to detect
 const double qlevel = 0.05;			// quality level for feature detection
 const double minDist = 2;			// minimum distance between two feature points
+const cv::Size lkWinSize(21, 21);	// LK search window (pyramids are built for it)
+const int lkMaxLevel = 3;			// LK pyramid levels
+const double voteLimit = 3.8;		// affine votes keep the coefficients between the 1/limit and 1-1/limit quantiles
+const int voteMinTriples = 8;		// triples kept by the fallback when no vote passes all the quantile ranges
+const int refineWinSize = 9;		// LK window of the full resolution refinement
+const double budgetLowRatio = 0.4;	// the motion level is lowered when the motion estimation takes less than this share of its budget
 
-MovingSubtractor::MovingSubtractor(bool flag, string path): suBSENSE(), detailInformation(flag), mLastFrame(), t(), frameIdx(1), sSaveP(path) {
+MovingSubtractor::MovingSubtractor(bool flag, string path, cv::Size canvas, size_t canvasBudgetMB): suBSENSE(), detailInformation(flag), mLastFrame(), t(), frameIdx(1), tracker(TRACKER_DEFAULT_BUDGET, qlevel, minDist), estimator(), motionLevel(0), minMotionLevel(0), motionBudgetMs(0), motionRefinePoints(0), sparseMatchMargin(-1), lastMotionMs(0), lastMotionLevel(0), lastRansacIterations(0), lastInlierRatio(0), lastMotionTier(MOTION_TIER_PERSPECTIVE), panoramic(false), canvasSize(canvas), canvasBudget(canvasBudgetMB), diagnostics(path), pipelined(false), stopPipeline(false), framesInFlight(0), droppedFrames(0) {
+	for (int i = 0; i < MOTION_TIER_COUNT; i ++)
+		motionTierCounts[i] = 0;
+	if (detailInformation) {
+		const char* probes[] = {"compare", "match", "AResult", "BResult", "CResult"};
+		for (int i = 0; i < 5; i ++)
+			diagnostics.subscribe(probes[i]);
+	}
+	suBSENSE.setDiagnostics(&diagnostics);
+}
+
+MovingSubtractor::~MovingSubtractor() {
+	stopWorker();
+}
+
+void MovingSubtractor::setPipelined(bool enabled) {
+	CV_Assert(!motionThread.joinable());
+	pipelined = enabled;
+}
+
+bool MovingSubtractor::isPipelined() const {
+	return pipelined;
+}
+
+int MovingSubtractor::getDroppedFrames() const {
+	return droppedFrames;
+}
+
+void MovingSubtractor::stopWorker() {
+	if (!motionThread.joinable()) return ;
+	{
+		std::lock_guard<std::mutex> lock(pipelineMutex);
+		stopPipeline = true;
+	}
+	pipelineCond.notify_all();
+	motionThread.join();
 }
 
 void MovingSubtractor::initialize(const cv::Mat& oInitImg, const cv::Mat& oROI) {
 	outputInformation("initialize started\n");
 	t.reset();
-	suBSENSE.initialize(oInitImg, oROI);
+	// the worker owns the motion stage state reset below, so it is stopped first (it estimates the frames it was given before leaving)
+	stopWorker();
+	droppedFrames = framesInFlight;
+	if (droppedFrames > 0)
+		cout << endl << "\tMovingSubtractor : Warning, " << droppedFrames << " frame(s) still in the pipeline were dropped by initialize() (flush() them first to get their masks)." << endl;
+	framesInFlight = 0;
+	motionInput.clear();
+	motionOutput.clear();
+	panoramic = canvasSize.area() > 0 && fitCanvas(oInitImg);
+	if (panoramic) {
+		// the ROI is given in camera coordinates, so it cannot be used on the canvas: the whole canvas is relevant
+		outputInformation("panoramic canvas width = ", canvasSize.width);
+		outputInformation("panoramic canvas height = ", canvasSize.height);
+		canvasInput = cv::Mat::zeros(canvasSize, oInitImg.type());
+		canvasMask = cv::Mat::zeros(canvasSize, CV_8UC1);
+		suBSENSE.initialize(canvasInput, cv::Mat(canvasSize, CV_8UC1, cv::Scalar(255)));
+		anchorCanvas(oInitImg.size());
+		const cv::Rect window = canvasFootprint(oInitImg.size());
+		oInitImg.copyTo(canvasInput(window));
+		suBSENSE.setValidRegion(worldFromCam, oInitImg.size());
+		suBSENSE.reinitExposedRegion(canvasInput);
+	}
+	else
+		suBSENSE.initialize(oInitImg, oROI);
 	mLastFrame = oInitImg.clone();
+	motionLastFrame = mLastFrame;
+	// the grey image & LK pyramid of a frame are built once, and serve as the previous ones on the next frame
+	motionGrey(motionLastFrame, mLastGrey);
+	cv::buildOpticalFlowPyramid(mLastGrey, mLastPyramid, lkWinSize, lkMaxLevel);
+	tracker.reset();
+	if (pipelined) {
+		stopPipeline = false;
+		motionThread = std::thread(&MovingSubtractor::motionWorker, this);
+	}
 	outputInformation("initialize finished with time : ", t.getTime());
 }
 
-void MovingSubtractor::work(cv::InputArray _newFrame, cv::OutputArray fgmask, double learningRateOverride) {
+bool MovingSubtractor::work(cv::InputArray _newFrame, cv::OutputArray fgmask, double learningRateOverride) {
 	// Id count
-	frameIdx ++;
-	char num[100];
-	sprintf(num, "%d", frameIdx);
-	sNum = string(num);
+	MotionJob job;
+	job.idx = ++ frameIdx;
+	job.learningRateOverride = learningRateOverride;
+	// the frame is kept as the last frame of both stages, and the caller may reuse its buffer
+	job.frame = _newFrame.getMat().clone();
+	if (!pipelined) {
+		estimateMotion(job);
+		segment(job, fgmask);
+		return true;
+	}
+	// pipelined: the worker estimates the motion of this frame while the previous one is segmented here
+	{
+		std::unique_lock<std::mutex> lock(pipelineMutex);
+		pipelineCond.wait(lock, [this] { return motionInput.size() < PIPELINE_QUEUE_SIZE; });
+		motionInput.push_back(job);
+	}
+	pipelineCond.notify_all();
+	if (++ framesInFlight <= PIPELINE_LATENCY) return false;
+	segmentNext(fgmask);
+	return true;
+}
 
-	outputInformation("operate started\n");
-	t.reset();
-	cv::Mat newFrame = _newFrame.getMat();
-	vector<uchar> status; 	// status of tracked features
-	vector<float> err;    	// error in tracking
-	vector<cv::Point2f> features1,features2;
-	
-	// to grey
-	cv::Mat grey0, grey1;
-	cv::cvtColor(mLastFrame, grey0, CV_RGB2GRAY);
-	cv::cvtColor(newFrame, grey1, CV_RGB2GRAY);
-	// detect the features
-	cv::goodFeaturesToTrack(grey0, 		// the image 
-							features1,   		// the output detected features
-							max_count,  		// the maximum number of features 
-							qlevel,     		// quality level
-							minDist);   		// min distance between two features
-	outputInformation("features got:", t.getTime());
-	t.reset();
-	// track features
-	cv::calcOpticalFlowPyrLK(grey0, grey1,	// 2 consecutive images
-							features1, 			// input point position in first image
-							features2, 			// output point postion in the second image
-							status,    			// tracking success
-							err);      			// tracking error
-	outputInformation("features traced:", t.getTime());
-	
-	// remove tracking failed features
-	int k=0;
-	for( int i= 0; i < (int) features1.size(); i++ ) 
+bool MovingSubtractor::flush(cv::OutputArray fgmask) {
+	if (!pipelined || !framesInFlight) return false;
+	segmentNext(fgmask);
+	return true;
+}
+
+void MovingSubtractor::segmentNext(cv::OutputArray fgmask) {
+	MotionJob job;
 	{
-		// do we keep this point?
-		if (status[i] == 1) 
+		std::unique_lock<std::mutex> lock(pipelineMutex);
+		pipelineCond.wait(lock, [this] { return !motionOutput.empty(); });
+		job = motionOutput.front();
+		motionOutput.pop_front();
+	}
+	framesInFlight --;
+	if (job.error) std::rethrow_exception(job.error);
+	segment(job, fgmask);
+}
+
+void MovingSubtractor::motionWorker() {
+	for (;;) {
+		MotionJob job;
+		{
+			std::unique_lock<std::mutex> lock(pipelineMutex);
+			pipelineCond.wait(lock, [this] { return !motionInput.empty() || stopPipeline; });
+			if (motionInput.empty()) return ;
+			job = motionInput.front();
+			motionInput.pop_front();
+		}
+		pipelineCond.notify_all();
+		try {
+			estimateMotion(job);
+		}
+		catch (...) {
+			// handed over to the caller thread
+			job.error = std::current_exception();
+		}
 		{
-			// keep this point in vector
-			features1[k] = features1[i];
-			features2[k++] = features2[i];
+			std::lock_guard<std::mutex> lock(pipelineMutex);
+			motionOutput.push_back(job);
 		}
+		pipelineCond.notify_all();
 	}
-	features1.resize(k);
-	features2.resize(k);
+}
+
+void MovingSubtractor::estimateMotion(MotionJob &job) {
+	// only touches the motion stage state (grey & pyramid cache, tracker, estimator, motionLastFrame)
+	Timer motionTimer;	// own timer, the segmentation may be running on another thread
+	motionTimer.reset();
+	const cv::Mat &newFrame = job.frame;
+	vector<cv::Point2f> features1,features2;
+	vector<float> errors;	// LK errors of the tracked features
+	const int64 motionStart = cv::getTickCount();
+	
+	// to grey, at the motion estimation level (the last frame's grey image & pyramid are cached)
+	motionGrey(newFrame, mCurrGrey);
+	cv::buildOpticalFlowPyramid(mCurrGrey, mCurrPyramid, lkWinSize, lkMaxLevel);
+	// track the features carried from the last frame (new ones are only detected where they ran short)
+	tracker.track(mLastGrey, mLastPyramid, mCurrPyramid, lkWinSize, lkMaxLevel, features1, features2, errors);
+	outputInformation("features detected: ", tracker.getLastDetectedCount());
+	outputInformation("features traced:", motionTimer.getTime());
+	const int k = (int) features1.size();
 	outputInformation("featrues selected: k = ", k);
 	
-	t.reset();
-	// calculate result with vote based on cv::getAffineTransform()
-	cv::Point2f pInput[3], pOuput[3];
-	vector<double> dTransforms[2][3], dSortedTransforms[2][3];
-	int isegLength = k / 3;
-	double* pdata;
-	for (int i = 0; i < isegLength; i ++) {
-		pInput[0] = features1[i];
-		pOuput[0] = features2[i];
-		pInput[1] = features1[i + isegLength];
-		pOuput[1] = features2[i + isegLength];
-		pInput[2] = features1[k - i - 1];
-		pOuput[2] = features2[k - i - 1];
-		// get transform
-		cv::Mat mTransform = cv::getAffineTransform(pInput, pOuput);
-		for (int ii = 0; ii < 2; ii ++) {
-			pdata = mTransform.ptr<double>(ii);
-			for (int jj = 0; jj<3; jj ++) {
-				dTransforms[ii][jj].push_back(pdata[jj]);
-				dSortedTransforms[ii][jj].push_back(pdata[jj]);
-			}
-		}
+	motionTimer.reset();
+	// pre-filter the pairs with a vote on the affine transforms of point triples
+	vector<cv::Point2f> selectedFeaturesI, selectedFeaturesO;
+	vector<float> selectedErrors;
+	voteAffineTriples(features1, features2, errors, selectedFeaturesI, selectedFeaturesO, selectedErrors);
+	outputInformation("voted got k = ", selectedFeaturesI.size());
+	// count result, the pairs with the lowest LK errors are tried first
+	std::vector<uchar> inliers;
+	cv::Mat result = estimator.estimate(selectedFeaturesI, selectedFeaturesO, selectedErrors, inliers);
+	// the stats of the frame's RANSAC (the refinement refits the estimator on its own points)
+	job.ransacIterations = estimator.getLastIterations();
+	job.inlierRatio = estimator.getLastInlierRatio();
+	outputInformation("ransac iterations = ", job.ransacIterations);
+	outputInformation("ransac inlier ratio = ", job.inlierRatio);
+	if (!result.empty() && motionLevel > 0) {
+		// back to full resolution: S^-1 * H * S, with S = diag(1 / 2^level, 1 / 2^level, 1)
+		const double scale = 1 << motionLevel;
+		double* h = result.ptr<double>(0);
+		h[2] *= scale;
+		h[5] *= scale;
+		h[6] /= scale;
+		h[7] /= scale;
+		if (motionRefinePoints > 0)
+			refineMotion(motionLastFrame, newFrame, selectedFeaturesI, inliers, result);
 	}
-	outputInformation("matrix got k = ", (int) dTransforms[0][0].size());
+	if (result.empty()) {
+		// not enough features (e.g. a textureless frame): assume the camera did not move
+		outputInformation("not enough features, no motion assumed\n");
+		result = cv::Mat::eye(3, 3, CV_64F);
+	}
+	job.motionMs = (cv::getTickCount() - motionStart) * 1000. / cv::getTickFrequency();
+	job.motionLevel = motionLevel;
+	outputInformation("motion level = ", motionLevel);
+	outputInformation("motion time (ms) = ", job.motionMs);
+	// use the cheapest motion model that fits
+	job.tier = selectMotionTier(result, newFrame.size());
+	job.result = result;
+	outputInformation("tansform matrix :\n", -1, &result);
+	outputInformation("motion tier (0 = shift, 1 = affine, 2 = perspective): ", job.tier);
+	outputInformation("with time: ", motionTimer.getTime());
 
-	// sort values
-	for (int i = 0; i < 2; i ++)
-		for (int j = 0; j < 3; j ++)
-			sort(dSortedTransforms[i][j].begin(), dSortedTransforms[i][j].end());
-	// find features
-	vector<cv::Point2f> selectedFeaturesI, selectedFeaturesO;
-	// to limit the range
-	double limit = 3.8;
-	for (; !selectedFeaturesI.size(); limit *= 1.1) {
-		int iS = (int) isegLength / limit, iE = isegLength - iS;
-		outputInformation("range iS = ", iS);
-		outputInformation("range iE = ", iE);
-		for (int i = 0; i < isegLength; i ++) {
-			bool flag = true;
-			for (int ii = 0; ii < 2; ii ++)
-				if (flag) for (int jj = 0; jj < 3; jj ++)
-					if (!(dTransforms[ii][jj][i] > dSortedTransforms[ii][jj][iS] && dTransforms[ii][jj][i] < dSortedTransforms[ii][jj][iE])) {
-						flag = false;
-						break;
-					}
-			if (flag) {
-				selectedFeaturesI.push_back(features1[i]);
-				selectedFeaturesO.push_back(features2[i]);
-				selectedFeaturesI.push_back(features1[i + isegLength]);
-				selectedFeaturesO.push_back(features2[i + isegLength]);
-				selectedFeaturesI.push_back(features1[k - i - 1]);
-				selectedFeaturesO.push_back(features2[k - i - 1]);
-			}
+	// rotate the cache: current -> last (buffers are swapped, the old ones get reused on the next frame)
+	motionLastFrame = job.frame;
+	cv::swap(mLastGrey, mCurrGrey);
+	mLastPyramid.swap(mCurrPyramid);
+	if (motionBudgetMs > 0) {
+		// keep the motion estimation within its budget
+		const int level = job.motionMs > motionBudgetMs ? min(motionLevel + 1, MOTION_MAX_LEVEL)
+						: job.motionMs < motionBudgetMs * budgetLowRatio ? max(motionLevel - 1, minMotionLevel) : motionLevel;
+		if (level != motionLevel) {
+			// the cached grey image, pyramid & tracks belong to the old level
+			motionLevel = level;
+			motionGrey(motionLastFrame, mLastGrey);
+			cv::buildOpticalFlowPyramid(mLastGrey, mLastPyramid, lkWinSize, lkMaxLevel);
+			tracker.reset();
 		}
-		outputInformation("voted got k = ", selectedFeaturesI.size());
-	}
-	// count result
-	std::vector<uchar> inliers(selectedFeaturesI.size());
-	cv::Mat result = cv::findHomography(	cv::Mat(selectedFeaturesI),		// corresponding
-											cv::Mat(selectedFeaturesO),		// points
-											inliers,				// outputted inliers matches
-											CV_RANSAC,				// RANSAC method
-											0.1);					// max distance to reprojection point
-	outputInformation("tansform matrix :\n", -1, &result);
-	outputInformation("with time: ", t.getTime());
+	}
+}
+
+void MovingSubtractor::segment(const MotionJob &job, cv::OutputArray fgmask) {
+	diagnostics.setFrame(job.idx);
+	outputInformation("operate started\n");
+	cv::Mat newFrame = job.frame;
+	const cv::Mat &result = job.result;
+	lastMotionTier = job.tier;
+	motionTierCounts[lastMotionTier] ++;
+	lastRansacIterations = job.ransacIterations;
+	lastInlierRatio = job.inlierRatio;
+	lastMotionMs = job.motionMs;
+	lastMotionLevel = job.motionLevel;
 	// use the transform matrix
-	cv::Mat mAfterTransform;
-	cv::warpPerspective(mLastFrame, mAfterTransform, result, newFrame.size());
 	cv::Mat mBeforTransform, resultInvert;
 	cv::invert(result, resultInvert, cv::DECOMP_LU);
-	cv::warpPerspective(newFrame, mBeforTransform, resultInvert, newFrame.size());
-	cv::Mat grey2;
-	cv::cvtColor(mAfterTransform, grey2, CV_RGB2GRAY);
-	cv::Mat delta = grey2 - grey1;
-	savePath("compare", delta);
+	if (!panoramic)
+		warpWithTier(newFrame, mBeforTransform, resultInvert, lastMotionTier, newFrame.size());
+	if (diagnostics.enabled("compare")) {
+		// only needed for the comparison output
+		cv::Mat mAfterTransform, grey1, grey2;
+		warpWithTier(mLastFrame, mAfterTransform, result, lastMotionTier, newFrame.size());
+		cv::cvtColor(mAfterTransform, grey2, CV_RGB2GRAY);
+		cv::cvtColor(newFrame, grey1, CV_RGB2GRAY);
+		cv::Mat delta = grey2 - grey1;
+		savePath("compare", delta);
+	}
 
 	// use the result
 	outputInformation("() operate :");
 	t.reset();
-	suBSENSE(mBeforTransform, fgmask, learningRateOverride);
-	cv::warpPerspective(fgmask, fgmask, result, newFrame.size());
+	cv::Rect window;
+	cv::Mat camToWindow;
+	if (panoramic) {
+		// chain the camera motion: new camera -> last camera -> canvas
+		worldFromCam = worldFromCam * resultInvert;
+		const cv::Rect canvasRect(0, 0, canvasSize.width, canvasSize.height);
+		window = canvasFootprint(newFrame.size());
+		if (window.area() > 0 && window.width <= canvasSize.width && window.height <= canvasSize.height && (window & canvasRect) != window) {
+			// the camera is leaving the canvas: move the model to center it again (what falls off the canvas is lost)
+			const int dx = (canvasSize.width - window.width) / 2 - window.x, dy = (canvasSize.height - window.height) / 2 - window.y;
+			const cv::Mat shift = (cv::Mat_<double>(3,3) << 1, 0, dx, 0, 1, dy, 0, 0, 1);
+			suBSENSE.shiftModel(dx, dy);
+			warpWithTier(canvasInput, canvasInput, shift, MOTION_TIER_SHIFT, canvasSize);
+			warpWithTier(canvasMask, canvasMask, shift, MOTION_TIER_SHIFT, canvasSize);
+			worldFromCam = shift * worldFromCam;
+			window = canvasFootprint(newFrame.size());
+			outputInformation("panoramic model recentered\n");
+		}
+		if (window.area() <= 0 || (window & canvasRect) != window) {
+			// degenerate footprint, or the camera zoomed out beyond the canvas: start over around the current view
+			anchorCanvas(newFrame.size());
+			window = canvasFootprint(newFrame.size());
+			outputInformation("panoramic model reset\n");
+		}
+		camToWindow = windowFromCam(window);
+		// only the footprint of the frame is written, the rest of the canvas keeps the last seen content
+		cv::Mat inputWindow = canvasInput(window);
+		cv::warpPerspective(newFrame, inputWindow, camToWindow, window.size(), cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+		suBSENSE.setValidRegion(worldFromCam, newFrame.size());
+		suBSENSE.reinitExposedRegion(canvasInput);
+		suBSENSE(canvasInput, canvasMask, job.learningRateOverride);
+		cv::warpPerspective(canvasMask(window), fgmask, camToWindow, newFrame.size(), cv::INTER_NEAREST | cv::WARP_INVERSE_MAP);
+	}
+	else {
+		// only the footprint of the warped frame is analyzed, pixels outside of it keep their model untouched
+		suBSENSE.setValidRegion(resultInvert);
+		suBSENSE(mBeforTransform, fgmask, job.learningRateOverride);
+		warpWithTier(fgmask, fgmask, result, lastMotionTier, newFrame.size());
+	}
 		
 	savePath("AResult", fgmask.getMat());
 	outputInformation("", t.getTime());
-	if (frameIdx > STARTMATCH) {
+	if (job.idx > STARTMATCH) {
 		t.reset();
 		outputInformation("patch match :");
 		vector<cv::Point2i> ans;
 		cv::Mat ansMat;
-		suBSENSE.patch_match(newFrame, mLastFrame, ans, ansMat, resultInvert);
+		if (sparseMatchMargin >= 0)
+			BackgroundSubtractorSuBSENSE::getPatchMatchActivity(fgmask.getMat(), sparseMatchMargin, matchActivity);
+		else
+			matchActivity.release();
+		suBSENSE.patch_match(newFrame, mLastFrame, ans, ansMat, resultInvert, matchActivity);
 		outputInformation("", t.getTime());
+		outputInformation("patch match passes = ", (double) suBSENSE.getLastPatchMatchIters());
+		outputInformation("patch match evaluations = ", (double) suBSENSE.getLastPatchMatchEvals());
 		/*
 		cv::Mat Rpatch;
 		Rpatch.create(newFrame.size(), CV_8UC1);
@@ -187,26 +349,329 @@ void MovingSubtractor::work(cv::InputArray _newFrame, cv::OutputArray fgmask, do
 		savePath("match", ansMat);
 		
 		t.reset();
-		cv::warpPerspective(mLastMask, mLastMask, result, newFrame.size());
+		warpWithTier(mLastMask, mLastMask, result, lastMotionTier, newFrame.size());
 		outputInformation("max flow :");
 		suBSENSE.randomField(newFrame, ansMat, mLastMask, fgmask);
 		savePath("BResult", fgmask.getMat());
 		outputInformation("", t.getTime());
 	}
-	t.reset();
-	outputInformation("model update :");
-	suBSENSE.update(newFrame, result);
-	outputInformation("", t.getTime());
-	if (frameIdx > 5) {
-		suBSENSE.complete(fgmask);
+	if (!panoramic) {
+		// the panoramic model does not move with the camera
+		t.reset();
+		outputInformation("model update :");
+		suBSENSE.update(newFrame, result);
+		outputInformation("", t.getTime());
+	}
+	if (job.idx > 5) {
+		if (panoramic) {
+			cv::Mat maskWindow = canvasMask(window);
+			maskWindow = cv::Scalar(0);
+			cv::warpPerspective(fgmask, maskWindow, camToWindow, window.size(), cv::INTER_NEAREST, cv::BORDER_TRANSPARENT);
+			suBSENSE.complete(canvasMask, window);
+			cv::warpPerspective(canvasMask(window), fgmask, camToWindow, newFrame.size(), cv::INTER_NEAREST | cv::WARP_INVERSE_MAP);
+		}
+		else
+			suBSENSE.complete(fgmask);
 		savePath("CResult", fgmask.getMat());
 	}
-	mLastFrame = newFrame.clone();
+	mLastFrame = newFrame;
 	mLastMask = fgmask.getMat().clone();
 }
 
+MotionTier MovingSubtractor::selectMotionTier(cv::Mat &transform, const cv::Size &size) {
+	cv::Mat h;
+	transform.convertTo(h, CV_64F);
+	h /= h.at<double>(2, 2);
+	const double* p = h.ptr<double>(0);
+	// compare the models where they diverge the most, i.e. at the frame corners
+	const double cornerX[4] = {0, (double) size.width - 1, (double) size.width - 1, 0};
+	const double cornerY[4] = {0, 0, (double) size.height - 1, (double) size.height - 1};
+	const double shiftX = cvRound(p[2] + p[0] * (size.width - 1) / 2 + p[1] * (size.height - 1) / 2 - (size.width - 1) / 2.0);
+	const double shiftY = cvRound(p[5] + p[3] * (size.width - 1) / 2 + p[4] * (size.height - 1) / 2 - (size.height - 1) / 2.0);
+	double shiftDist = 0, affineDist = 0;
+	for (int i = 0; i < 4; i ++) {
+		const double w = p[6] * cornerX[i] + p[7] * cornerY[i] + 1;
+		const double ax = p[0] * cornerX[i] + p[1] * cornerY[i] + p[2], ay = p[3] * cornerX[i] + p[4] * cornerY[i] + p[5];
+		if (w <= 0) return MOTION_TIER_PERSPECTIVE;
+		const double hx = ax / w, hy = ay / w;
+		shiftDist = max(shiftDist, max(fabs(hx - cornerX[i] - shiftX), fabs(hy - cornerY[i] - shiftY)));
+		affineDist = max(affineDist, max(fabs(hx - ax), fabs(hy - ay)));
+	}
+	if (shiftDist <= MOTION_TIER_TOLERANCE) {
+		transform = (cv::Mat_<double>(3,3) << 1, 0, shiftX, 0, 1, shiftY, 0, 0, 1);
+		return MOTION_TIER_SHIFT;
+	}
+	if (affineDist <= MOTION_TIER_TOLERANCE) {
+		transform = (cv::Mat_<double>(3,3) << p[0], p[1], p[2], p[3], p[4], p[5], 0, 0, 1);
+		return MOTION_TIER_AFFINE;
+	}
+	return MOTION_TIER_PERSPECTIVE;
+}
+
+void MovingSubtractor::warpWithTier(cv::InputArray src, cv::OutputArray dst, const cv::Mat &transform, MotionTier tier, const cv::Size &size) {
+	if (tier == MOTION_TIER_SHIFT) {
+		// dst(x, y) = src(x - dx, y - dy), exposed pixels are black
+		const cv::Mat image = src.getMat();
+		const int dx = cvRound(transform.at<double>(0, 2)), dy = cvRound(transform.at<double>(1, 2));
+		cv::Mat shifted = cv::Mat::zeros(size, image.type());
+		const cv::Rect dstRect = cv::Rect(dx, dy, image.cols, image.rows) & cv::Rect(0, 0, size.width, size.height);
+		if (dstRect.area() > 0)
+			image(dstRect - cv::Point(dx, dy)).copyTo(shifted(dstRect));
+		shifted.copyTo(dst);
+	}
+	else if (tier == MOTION_TIER_AFFINE)
+		cv::warpAffine(src, dst, transform.rowRange(0, 2), size);
+	else
+		cv::warpPerspective(src, dst, transform, size);
+}
+
+MotionTier MovingSubtractor::getLastMotionTier() const {
+	return lastMotionTier;
+}
+
+int MovingSubtractor::getMotionTierCount(MotionTier tier) const {
+	return motionTierCounts[tier];
+}
+
+void MovingSubtractor::voteAffineTriples(const vector<cv::Point2f> &from, const vector<cv::Point2f> &to, const vector<float> &errors,
+										 vector<cv::Point2f> &selectedFrom, vector<cv::Point2f> &selectedTo, vector<float> &selectedErrors) {
+	selectedFrom.clear();
+	selectedTo.clear();
+	selectedErrors.clear();
+	// triples (i, i + n, k - i - 1), affine coefficients solved in closed form, stored coefficient by coefficient
+	const int k = (int) from.size(), n = k / 3;
+	voteTriples.clear();
+	voteCoeffs.resize(6 * (size_t) n);
+	for (int i = 0; i < n; i ++) {
+		const int idx[3] = {i, i + n, k - i - 1};
+		const double dx1 = from[idx[1]].x - from[idx[0]].x, dy1 = from[idx[1]].y - from[idx[0]].y;
+		const double dx2 = from[idx[2]].x - from[idx[0]].x, dy2 = from[idx[2]].y - from[idx[0]].y;
+		const double det = dx1 * dy2 - dx2 * dy1;
+		// collinear triples carry no affine information
+		if (fabs(det) < 1e-6) continue;
+		const int m = (int) voteTriples.size();
+		for (int row = 0; row < 2; row ++) {
+			const double u0 = row ? to[idx[0]].y : to[idx[0]].x;
+			const double du1 = (row ? to[idx[1]].y : to[idx[1]].x) - u0, du2 = (row ? to[idx[2]].y : to[idx[2]].x) - u0;
+			const double a = (du1 * dy2 - du2 * dy1) / det, b = (dx1 * du2 - dx2 * du1) / det;
+			voteCoeffs[(row * 3) * n + m] = a;
+			voteCoeffs[(row * 3 + 1) * n + m] = b;
+			voteCoeffs[(row * 3 + 2) * n + m] = u0 - a * from[idx[0]].x - b * from[idx[0]].y;
+		}
+		voteTriples.push_back(i);
+	}
+	const int m = (int) voteTriples.size();
+	if (!m) return ;
+	// the quantile bounds of each coefficient, with nth_element (linear) instead of full sorts
+	double lower[6], upper[6];
+	const int iS = (int) (m / voteLimit), iE = max(iS, m - iS - 1);
+	for (int c = 0; c < 6; c ++) {
+		voteScratch.assign(voteCoeffs.begin() + c * n, voteCoeffs.begin() + c * n + m);
+		nth_element(voteScratch.begin(), voteScratch.begin() + iS, voteScratch.end());
+		lower[c] = voteScratch[iS];
+		nth_element(voteScratch.begin() + iS, voteScratch.begin() + iE, voteScratch.end());
+		upper[c] = voteScratch[iE];
+	}
+	// single pass: keep the triples within all the ranges; when none is, keep those that stray the least out of them
+	voteScores.resize(m);
+	int kept = 0;
+	for (int j = 0; j < m; j ++) {
+		double score = 0;
+		for (int c = 0; c < 6; c ++) {
+			const double v = voteCoeffs[c * n + j], range = max(upper[c] - lower[c], 1e-9);
+			score = max(score, max(lower[c] - v, v - upper[c]) / range);
+		}
+		voteScores[j] = score;
+		if (score <= 0) kept ++;
+	}
+	double maxScore = 0;
+	if (!kept) {
+		voteScratch.assign(voteScores.begin(), voteScores.end());
+		const int best = min(m, voteMinTriples) - 1;
+		nth_element(voteScratch.begin(), voteScratch.begin() + best, voteScratch.end());
+		maxScore = voteScratch[best];
+	}
+	for (int j = 0; j < m; j ++) {
+		if (voteScores[j] > maxScore) continue;
+		const int i = voteTriples[j];
+		const int idx[3] = {i, i + n, k - i - 1};
+		for (int p = 0; p < 3; p ++) {
+			selectedFrom.push_back(from[idx[p]]);
+			selectedTo.push_back(to[idx[p]]);
+			selectedErrors.push_back(errors[idx[p]]);
+		}
+	}
+}
+
+void MovingSubtractor::setFeatureBudget(int budget) {
+	CV_Assert(!motionThread.joinable());
+	tracker.setBudget(budget);
+}
+
+void MovingSubtractor::setMotionEstimation(int level, double budgetMs, int refinePoints) {
+	CV_Assert(level >= 0 && level <= MOTION_MAX_LEVEL && budgetMs >= 0 && refinePoints >= 0);
+	// the motion stage state belongs to the worker while the pipeline runs
+	CV_Assert(!motionThread.joinable());
+	minMotionLevel = level;
+	motionBudgetMs = budgetMs;
+	motionRefinePoints = refinePoints;
+	if (motionLevel != level && !motionLastFrame.empty()) {
+		motionGrey(motionLastFrame, mLastGrey);
+		cv::buildOpticalFlowPyramid(mLastGrey, mLastPyramid, lkWinSize, lkMaxLevel);
+		tracker.reset();
+	}
+	motionLevel = lastMotionLevel = level;
+}
+
+void MovingSubtractor::setPatchMatch(int iterations, double budgetMs) {
+	CV_Assert(iterations >= 0 && budgetMs >= 0);
+	suBSENSE.setPatchMatchParams((size_t) iterations, budgetMs);
+}
+
+void MovingSubtractor::setSparsePatchMatch(int margin) {
+	sparseMatchMargin = margin;
+}
+
+int MovingSubtractor::getMotionLevel() const {
+	return lastMotionLevel;
+}
+
+double MovingSubtractor::getLastMotionTime() const {
+	return lastMotionMs;
+}
+
+void MovingSubtractor::motionGrey(const cv::Mat &frame, cv::Mat &grey) const {
+	if (!motionLevel) {
+		cv::cvtColor(frame, grey, CV_RGB2GRAY);
+		return;
+	}
+	// downscale first, so that the color conversion only runs on the small image
+	cv::Mat small;
+	const double scale = 1. / (1 << motionLevel);
+	cv::resize(frame, small, cv::Size(), scale, scale, cv::INTER_AREA);
+	cv::cvtColor(small, grey, CV_RGB2GRAY);
+}
+
+void MovingSubtractor::refineMotion(const cv::Mat &lastFrame, const cv::Mat &newFrame, const vector<cv::Point2f> &from, const vector<uchar> &inliers, cv::Mat &transform) {
+	const double scale = 1 << motionLevel;
+	// a few inliers, evenly picked over the inlier set
+	vector<cv::Point2f> candidates;
+	for (size_t i = 0; i < from.size(); i ++)
+		if (inliers[i]) candidates.push_back(from[i] * (float) scale);
+	if ((int) candidates.size() < 4) return ;
+	const int count = min(motionRefinePoints, (int) candidates.size());
+	vector<cv::Point2f> pointsFrom, pointsTo;
+	vector<float> pointsErr;
+	const double* h = transform.ptr<double>(0);
+	// the search only has to absorb the coarse level error, so each point is tracked in a small crop (cost independent of the frame size)
+	const int half = refineWinSize + (int) scale;
+	const cv::Rect frameRect(0, 0, newFrame.cols, newFrame.rows);
+	cv::Mat greyLast, greyNew;
+	for (int j = 0; j < count; j ++) {
+		const cv::Point2f p = candidates[(size_t) j * candidates.size() / count];
+		const double w = h[6] * p.x + h[7] * p.y + h[8];
+		const cv::Point2f q((float) ((h[0] * p.x + h[1] * p.y + h[2]) / w), (float) ((h[3] * p.x + h[4] * p.y + h[5]) / w));
+		const cv::Rect cropLast = cv::Rect(cvRound(p.x) - half, cvRound(p.y) - half, 2 * half + 1, 2 * half + 1) & frameRect;
+		const cv::Rect cropNew = cv::Rect(cvRound(q.x) - half, cvRound(q.y) - half, 2 * half + 1, 2 * half + 1) & frameRect;
+		if (cropLast.area() <= 0 || cropNew.area() <= 0) continue;
+		cv::cvtColor(lastFrame(cropLast), greyLast, CV_RGB2GRAY);
+		cv::cvtColor(newFrame(cropNew), greyNew, CV_RGB2GRAY);
+		vector<cv::Point2f> in(1, p - cv::Point2f((float) cropLast.x, (float) cropLast.y)), out(1, q - cv::Point2f((float) cropNew.x, (float) cropNew.y));
+		vector<uchar> status;
+		vector<float> err;
+		cv::calcOpticalFlowPyrLK(greyLast, greyNew, in, out, status, err, cv::Size(refineWinSize, refineWinSize), 0,
+								 cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 10, 0.01), cv::OPTFLOW_USE_INITIAL_FLOW);
+		if (!status[0]) continue;
+		pointsFrom.push_back(p);
+		pointsTo.push_back(out[0] + cv::Point2f((float) cropNew.x, (float) cropNew.y));
+		pointsErr.push_back(err[0]);
+	}
+	vector<uchar> refinedInliers;
+	cv::Mat refined = estimator.estimate(pointsFrom, pointsTo, pointsErr, refinedInliers);
+	// the coarse estimate is kept unless most of the refined points agree
+	if (!refined.empty() && estimator.getLastInlierRatio() >= 0.5) {
+		refined.copyTo(transform);
+		outputInformation("motion refined with points: ", (int) pointsFrom.size());
+	}
+}
+
+int MovingSubtractor::getLastRansacIterations() const {
+	return lastRansacIterations;
+}
+
+double MovingSubtractor::getLastInlierRatio() const {
+	return lastInlierRatio;
+}
+
+bool MovingSubtractor::isPanoramic() const {
+	return panoramic;
+}
+
+cv::Size MovingSubtractor::getCanvasSize() const {
+	return panoramic ? canvasSize : mLastFrame.size();
+}
+
+DiagnosticsSink& MovingSubtractor::getDiagnostics() {
+	return diagnostics;
+}
+
+bool MovingSubtractor::fitCanvas(const cv::Mat &frame) {
+	// model + canvas input & mask
+	const size_t pxFootprint = suBSENSE.getPxModelFootprint(frame.channels()) + frame.channels() + 1;
+	const double maxArea = (double) canvasBudget * (1 << 20) / pxFootprint;
+	if ((double) frame.cols * frame.rows > maxArea) return false;
+	canvasSize.width = max(canvasSize.width, frame.cols);
+	canvasSize.height = max(canvasSize.height, frame.rows);
+	if ((double) canvasSize.width * canvasSize.height > maxArea) {
+		// keep the aspect ratio as far as possible, the canvas is never smaller than a frame
+		const double scale = sqrt(maxArea / ((double) canvasSize.width * canvasSize.height));
+		canvasSize.width = max(frame.cols, (int) (canvasSize.width * scale));
+		canvasSize.height = max(frame.rows, (int) (canvasSize.height * scale));
+		if ((double) canvasSize.width * canvasSize.height > maxArea) {
+			if (canvasSize.width == frame.cols) canvasSize.height = max(frame.rows, (int) (maxArea / canvasSize.width));
+			else canvasSize.width = max(frame.cols, (int) (maxArea / canvasSize.height));
+		}
+	}
+	return true;
+}
+
+void MovingSubtractor::anchorCanvas(const cv::Size &frameSize) {
+	worldFromCam = (cv::Mat_<double>(3,3) << 1, 0, (canvasSize.width - frameSize.width) / 2, 0, 1, (canvasSize.height - frameSize.height) / 2, 0, 0, 1);
+	suBSENSE.clearPxModel(cv::Mat(canvasSize, CV_8UC1, cv::Scalar(255)));
+}
+
+cv::Rect MovingSubtractor::canvasFootprint(const cv::Size &frameSize) const {
+	const double* h = worldFromCam.ptr<double>(0);
+	const double cornerX[4] = {0, (double) frameSize.width - 1, (double) frameSize.width - 1, 0};
+	const double cornerY[4] = {0, 0, (double) frameSize.height - 1, (double) frameSize.height - 1};
+	double x[4], y[4];
+	for (int i = 0; i < 4; i ++) {
+		const double w = h[6] * cornerX[i] + h[7] * cornerY[i] + h[8];
+		if (w <= 0) return cv::Rect();
+		x[i] = (h[0] * cornerX[i] + h[1] * cornerY[i] + h[2]) / w;
+		y[i] = (h[3] * cornerX[i] + h[4] * cornerY[i] + h[5]) / w;
+		// far outside of any canvas, and would overflow the rectangle
+		if (fabs(x[i]) > 1e6 || fabs(y[i]) > 1e6) return cv::Rect();
+	}
+	const int x0 = (int) floor(*min_element(x, x + 4)), x1 = (int) floor(*max_element(x, x + 4));
+	const int y0 = (int) floor(*min_element(y, y + 4)), y1 = (int) floor(*max_element(y, y + 4));
+	return cv::Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+cv::Mat MovingSubtractor::windowFromCam(const cv::Rect &window) const {
+	const cv::Mat toWindow = (cv::Mat_<double>(3,3) << 1, 0, -window.x, 0, 1, -window.y, 0, 0, 1);
+	return toWindow * worldFromCam;
+}
+
 void MovingSubtractor::getBackgroundImage(cv::Mat oBackground) const {
-	suBSENSE.getBackgroundImage(oBackground);
+	if (!panoramic) {
+		suBSENSE.getBackgroundImage(oBackground);
+		return;
+	}
+	// the current view of the panoramic background
+	cv::Mat canvasBackground;
+	suBSENSE.getBackgroundImage(canvasBackground);
+	cv::warpPerspective(canvasBackground, oBackground, worldFromCam, mLastFrame.size(), cv::INTER_LINEAR | cv::WARP_INVERSE_MAP);
 }
 
 inline void MovingSubtractor::outputInformation(const string &sInfo, double num, cv::Mat* matrix) const {
@@ -215,9 +680,8 @@ inline void MovingSubtractor::outputInformation(const string &sInfo, double num,
 	if (num >= 0) printf("%.3lf\n", num);
 	if (matrix) cout << *matrix << endl;
 }
-inline void MovingSubtractor::savePath(const string &sInfo, cv::Mat & pic) const {
-	if (!detailInformation) return ;
-	cv::imwrite(sSaveP + sInfo + sNum + ".jpg", pic);
+inline void MovingSubtractor::savePath(const string &sInfo, const cv::Mat & pic) {
+	diagnostics.post(sInfo, pic);
 }
 
 void MovingSubtractor::patchmatch(const cv::Mat image, std::vector<cv::Point2i> &ans) {
@@ -7,28 +7,142 @@
 #include <opencv2/highgui/highgui.hpp>
 
 #include "BackgroundSubtractorSuBSENSE.h"
+#include "FeatureTracker.h"
+#include "HomographyEstimator.h"
+#include "Diagnostics.h"
 #include "Timer.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 using namespace std;
 
 // patch match from this frame
 const int STARTMATCH = 2;
 // whether is all black
 const double COVERRATE = 0.95;
+// max distance (in pixels, at the frame corners) allowed between the estimated homography and a cheaper motion model
+const double MOTION_TIER_TOLERANCE = 0.25;
+// coarsest pyramid level the motion can be estimated on
+const int MOTION_MAX_LEVEL = 4;
+// default memory budget of the panoramic model (in MB), the canvas is shrunk to fit in it
+const size_t PANORAMA_DEFAULT_BUDGET_MB = 1024;
+// pipelined mode: frames waiting for the motion stage, and frames of latency of the output mask
+const size_t PIPELINE_QUEUE_SIZE = 2;
+const int PIPELINE_LATENCY = 1;
+
+// motion models, from the cheapest to the most general
+enum MotionTier {
+	MOTION_TIER_SHIFT = 0,		// integer translation: frames & model planes are moved by offset
+	MOTION_TIER_AFFINE,			// translation/similarity/affine: warpAffine, no perspective division
+	MOTION_TIER_PERSPECTIVE,	// full homography: warpPerspective
+	MOTION_TIER_COUNT
+};
 
 class MovingSubtractor {
 public:
-	MovingSubtractor(bool flag = false, string path = "");
+	// a non-empty canvas size enables the panoramic mode: the model lives on a fixed canvas (world coordinates)
+	// and each frame only classifies & updates its own footprint, instead of resampling the whole model every frame
+	MovingSubtractor(bool flag = false, string path = "", cv::Size canvas = cv::Size(), size_t canvasBudgetMB = PANORAMA_DEFAULT_BUDGET_MB);
+	~MovingSubtractor();
+	// pipelined mode (to be set before initialize): the motion of frame N+1 is estimated on a worker thread while frame N is segmented
+	void setPipelined(bool enabled);
+	bool isPipelined() const;
+	// number of frames still in the pipeline (not flushed) that the last initialize dropped
+	int getDroppedFrames() const;
+	// pipelined mode: the frames still in flight are dropped (see getDroppedFrames), flush() them first to get their masks
 	void initialize(const cv::Mat& oInitImg, const cv::Mat& oROI);
-	void work(cv::InputArray image, cv::OutputArray fgmask, double learningRateOverride=0);
+	// returns false if no mask is ready yet (pipelined mode, first PIPELINE_LATENCY frames): fgmask then belongs to an older frame
+	bool work(cv::InputArray image, cv::OutputArray fgmask, double learningRateOverride=0);
+	// pipelined mode: segment the next frame still in flight, returns false once all of them are out
+	bool flush(cv::OutputArray fgmask);
 	void getBackgroundImage(cv::Mat oBackground) const;
 	void patchmatch(const cv::Mat image, std::vector<cv::Point2i> &ans);
 	void recover(cv::OutputArray &a, const cv::Mat &b, std::vector<cv::Point2i> &ans, double coverRate = 0.95);
+	// maximum number of feature points tracked per frame (the motion settings cannot change while the pipeline runs)
+	void setFeatureBudget(int budget);
+	// estimate the global motion on the given pyramid level (0 = full resolution) and rescale it to full resolution;
+	// with a time budget (in ms, 0 = none), the level is raised / lowered (never below the given one) to fit in it;
+	// refinePoints > 0 refines the coarse homography by tracking that many of its inliers at full resolution (in small crops)
+	void setMotionEstimation(int level, double budgetMs = 0, int refinePoints = 0);
+	// PatchMatch refinement passes of the match stage, and their time budget (in ms, 0 = none)
+	void setPatchMatch(int iterations, double budgetMs = 0);
+	// sparse patch matching: only the blocks within margin pixels of the SuBSENSE foreground are matched, the rest counts as matched
+	// (a negative margin matches the whole frame)
+	void setSparsePatchMatch(int margin);
+	// pyramid level the motion of the last frame was estimated on
+	int getMotionLevel() const;
+	// motion estimation time of the last frame (ms)
+	double getLastMotionTime() const;
+	// number of RANSAC hypotheses drawn for the last frame
+	int getLastRansacIterations() const;
+	// inlier ratio of the last frame homography
+	double getLastInlierRatio() const;
+	// motion model chosen for the last frame
+	MotionTier getLastMotionTier() const;
+	// number of frames processed with the given motion model
+	int getMotionTierCount(MotionTier tier) const;
+	// whether the model is panoramic (false if disabled, or if not even a frame fits in the memory budget)
+	bool isPanoramic() const;
+	// canvas size actually used by the panoramic model
+	cv::Size getCanvasSize() const;
+	// debug images (see DiagnosticsSink for the probes), saved under the save path; the detail mode subscribes the MovingSubtractor ones
+	DiagnosticsSink& getDiagnostics();
 
 private:
+	// a frame going through the motion stage, and what the motion stage found for the segmentation stage
+	struct MotionJob {
+		int idx;
+		cv::Mat frame;
+		double learningRateOverride;
+		// last frame -> frame homography, and its motion model
+		cv::Mat result;
+		MotionTier tier;
+		// motion stats
+		int ransacIterations;
+		double inlierRatio;
+		double motionMs;
+		int motionLevel;
+		// exception thrown by the motion stage, rethrown by the segmentation stage
+		std::exception_ptr error;
+	};
+	// motion stage: only touches the tracker, estimator, grey / pyramid caches & motionLastFrame
+	void estimateMotion(MotionJob &job);
+	// segmentation stage: only touches the model, the last frame / mask & the stats
+	void segment(const MotionJob &job, cv::OutputArray fgmask);
+	// pipelined mode: wait for the next motion result and segment it
+	void segmentNext(cv::OutputArray fgmask);
+	void motionWorker();
+	void stopWorker();
+
 	// output detail information
 	bool detailInformation;
 	inline void outputInformation(const string &sInfo, double num = -1, cv::Mat* matrix = NULL) const;
-	inline void savePath(const string &sInfo, cv::Mat & pic) const;
+	inline void savePath(const string &sInfo, const cv::Mat & pic);
+
+	// pre-filter the tracked pairs: affine transforms of point triples vote, and the triples whose coefficients all lie within
+	// quantile ranges are kept (bounded work: a few nth_element calls and linear passes)
+	void voteAffineTriples(const vector<cv::Point2f> &from, const vector<cv::Point2f> &to, const vector<float> &errors,
+						   vector<cv::Point2f> &selectedFrom, vector<cv::Point2f> &selectedTo, vector<float> &selectedErrors);
+	// pick the cheapest motion model that stays within MOTION_TIER_TOLERANCE of the homography, and snap the matrix to it
+	static MotionTier selectMotionTier(cv::Mat &transform, const cv::Size &size);
+	// grey image of a frame at the motion estimation level
+	void motionGrey(const cv::Mat &frame, cv::Mat &grey) const;
+	// refine a full resolution homography by tracking a few inliers (coarse coordinates) at full resolution, around their predicted position
+	void refineMotion(const cv::Mat &lastFrame, const cv::Mat &newFrame, const vector<cv::Point2f> &from, const vector<uchar> &inliers, cv::Mat &transform);
+	// warp with the motion model of the given tier (same convention as cv::warpPerspective)
+	static void warpWithTier(cv::InputArray src, cv::OutputArray dst, const cv::Mat &transform, MotionTier tier, const cv::Size &size);
+
+	// panoramic mode helpers
+	// shrink the requested canvas to the memory budget, returns false if not even a frame fits
+	bool fitCanvas(const cv::Mat &frame);
+	// clear the whole canvas model and put the camera back at the center of the canvas
+	void anchorCanvas(const cv::Size &frameSize);
+	// bounding box of the camera footprint on the canvas (empty if the footprint is degenerate)
+	cv::Rect canvasFootprint(const cv::Size &frameSize) const;
+	// camera -> canvas window homography
+	cv::Mat windowFromCam(const cv::Rect &window) const;
 
 	// subsense
 	BackgroundSubtractorSuBSENSE suBSENSE;
@@ -36,11 +150,54 @@ private:
 	cv::Mat mLastFrame;
 	// last fgmask
 	cv::Mat mLastMask;
+	// grey images & LK pyramids of the last and current frames
+	cv::Mat mLastGrey, mCurrGrey;
+	vector<cv::Mat> mLastPyramid, mCurrPyramid;
 	// time counter
 	Timer t;
 	// count frame
 	int frameIdx;
+	// feature points carried across frames
+	FeatureTracker tracker;
+	// homography fitting
+	HomographyEstimator estimator;
+	// coarse motion estimation
+	int motionLevel, minMotionLevel;
+	double motionBudgetMs;
+	int motionRefinePoints;
+	// sparse patch matching margin (< 0 = dense) & activity mask
+	int sparseMatchMargin;
+	cv::Mat matchActivity;
+	double lastMotionMs;
+	int lastMotionLevel;
+	int lastRansacIterations;
+	double lastInlierRatio;
+	// affine vote buffers
+	vector<int> voteTriples;
+	vector<double> voteCoeffs, voteScratch, voteScores;
+	// motion model stats
+	MotionTier lastMotionTier;
+	int motionTierCounts[MOTION_TIER_COUNT];
+	// panoramic model
+	bool panoramic;
+	cv::Size canvasSize;
+	size_t canvasBudget;
+	// camera -> canvas homography
+	cv::Mat worldFromCam;
+	// last frame & fgmask, in canvas coordinates
+	cv::Mat canvasInput;
+	cv::Mat canvasMask;
 	// to save info
-	string sSaveP;
-	string sNum;
+	DiagnosticsSink diagnostics;
+	// pipeline
+	bool pipelined;
+	bool stopPipeline;
+	int framesInFlight;
+	int droppedFrames;
+	std::thread motionThread;
+	std::mutex pipelineMutex;
+	std::condition_variable pipelineCond;
+	deque<MotionJob> motionInput, motionOutput;
+	// last frame seen by the motion stage (mLastFrame belongs to the segmentation stage)
+	cv::Mat motionLastFrame;
 };
\ No newline at end of file
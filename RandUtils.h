@@ -1,5 +1,49 @@
 #pragma once
 
+//! default seed used by RandEngine instances (any value gives a valid sequence)
+#define RANDENGINE_DEFAULT_SEED (0x853C49E6748FEA9BULL)
+
+/*!
+    Small PCG32 random engine (see O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically
+    Good Algorithms for Random Number Generation", 2014); unlike the C library's rand(), it has no hidden
+    global state, so each thread/model can own its own instance, and it gives the same sequence for the
+    same (seed,stream) pair on every platform.
+ */
+class RandEngine {
+public:
+    //! seeds the engine; engines with different streams give independent sequences even for the same seed
+    explicit RandEngine(uint64 nSeed=RANDENGINE_DEFAULT_SEED, uint64 nStream=0) {
+        seed(nSeed,nStream);
+    }
+    //! (re)seeds the engine; see constructor
+    inline void seed(uint64 nSeed, uint64 nStream=0) {
+        m_nState = 0;
+        m_nInc = (nStream<<1)|1;
+        next();
+        m_nState += nSeed;
+        next();
+    }
+    //! returns a uniformly distributed 32-bit value
+    inline unsigned int next() {
+        const uint64 nOldState = m_nState;
+        m_nState = nOldState*6364136223846793005ULL+m_nInc;
+        const unsigned int nXorShifted = (unsigned int)(((nOldState>>18)^nOldState)>>27);
+        const unsigned int nRot = (unsigned int)(nOldState>>59);
+        return (nXorShifted>>nRot)|(nXorShifted<<((32-nRot)&31));
+    }
+    //! returns a uniformly distributed 32-bit value
+    inline operator unsigned int() {
+        return next();
+    }
+    //! returns a uniformly distributed value in [0,nRange) (multiply-shift reduction, no division)
+    inline unsigned int operator()(unsigned int nRange) {
+        return (unsigned int)(((uint64)next()*nRange)>>32);
+    }
+private:
+    uint64 m_nState;
+    uint64 m_nInc;
+};
+
 /*// gaussian 3x3 pattern, based on 'floor(fspecial('gaussian', 3, 1)*256)'
 static const int s_nSamplesInitPatternWidth = 3;
 static const int s_nSamplesInitPatternHeight = 3;
@@ -25,8 +69,8 @@ static const int s_anSamplesInitPattern[s_nSamplesInitPatternHeight][s_nSamplesI
 };
 
 //! returns a random init/sampling position for the specified pixel position; also guards against out-of-bounds values via image/border size check.
-static inline void getRandSamplePosition(int& x_sample, int& y_sample, const int x_orig, const int y_orig, const int border, const cv::Size& imgsize) {
-    int r = 1+rand()%s_nSamplesInitPatternTot;
+static inline void getRandSamplePosition(int& x_sample, int& y_sample, const int x_orig, const int y_orig, const int border, const cv::Size& imgsize, RandEngine& rng) {
+    int r = 1+(int)rng((unsigned int)s_nSamplesInitPatternTot);
     for(x_sample=0; x_sample<s_nSamplesInitPatternWidth; ++x_sample) {
         for(y_sample=0; y_sample<s_nSamplesInitPatternHeight; ++y_sample) {
             r -= s_anSamplesInitPattern[y_sample][x_sample];
@@ -49,9 +93,9 @@ static inline void getRandSamplePosition(int& x_sample, int& y_sample, const int
 
 static const int s_nSamplesCloseInitPatternWidth = 5;
 static const int s_nSamplesCloseInitPatternHeight = 5;
-static inline void getCloseRandSamplePosition(int& x_sample, int& y_sample, const int x_orig, const int y_orig, const int border, const cv::Size& imgsize) {
-    x_sample = rand()%s_nSamplesCloseInitPatternWidth + x_orig-s_nSamplesCloseInitPatternWidth/2;
-    y_sample = rand()%s_nSamplesCloseInitPatternHeight + y_orig-s_nSamplesCloseInitPatternHeight/2;
+static inline void getCloseRandSamplePosition(int& x_sample, int& y_sample, const int x_orig, const int y_orig, const int border, const cv::Size& imgsize, RandEngine& rng) {
+    x_sample = (int)rng((unsigned int)s_nSamplesCloseInitPatternWidth) + x_orig-s_nSamplesCloseInitPatternWidth/2;
+    y_sample = (int)rng((unsigned int)s_nSamplesCloseInitPatternHeight) + y_orig-s_nSamplesCloseInitPatternHeight/2;
     if(x_sample<border)
         x_sample = border;
     else if(x_sample>=imgsize.width-border)
@@ -71,8 +115,8 @@ static const int s_anNeighborPattern_3x3[8][2] = {
 };
 
 //! returns a random neighbor position for the specified pixel position; also guards against out-of-bounds values via image/border size check.
-static inline void getRandNeighborPosition_3x3(int& x_neighbor, int& y_neighbor, const int x_orig, const int y_orig, const int border, const cv::Size& imgsize) {
-    int r = rand()%s_anNeighborPatternSize_3x3;
+static inline void getRandNeighborPosition_3x3(int& x_neighbor, int& y_neighbor, const int x_orig, const int y_orig, const int border, const cv::Size& imgsize, RandEngine& rng) {
+    int r = (int)rng((unsigned int)s_anNeighborPatternSize_3x3);
     x_neighbor = x_orig+s_anNeighborPattern_3x3[r][0];
     y_neighbor = y_orig+s_anNeighborPattern_3x3[r][1];
     if(x_neighbor<border)
@@ -96,8 +140,8 @@ static const int s_anNeighborPattern_5x5[24][2] = {
 };
 
 //! returns a random neighbor position for the specified pixel position; also guards against out-of-bounds values via image/border size check.
-static inline void getRandNeighborPosition_5x5(int& x_neighbor, int& y_neighbor, const int x_orig, const int y_orig, const int border, const cv::Size& imgsize) {
-    int r = rand()%s_anNeighborPatternSize_5x5;
+static inline void getRandNeighborPosition_5x5(int& x_neighbor, int& y_neighbor, const int x_orig, const int y_orig, const int border, const cv::Size& imgsize, RandEngine& rng) {
+    int r = (int)rng((unsigned int)s_anNeighborPatternSize_5x5);
     x_neighbor = x_orig+s_anNeighborPattern_5x5[r][0];
     y_neighbor = y_orig+s_anNeighborPattern_5x5[r][1];
     if(x_neighbor<border)
@@ -109,3 +153,4 @@ static inline void getRandNeighborPosition_5x5(int& x_neighbor, int& y_neighbor,
     else if(y_neighbor>=imgsize.height-border)
         y_neighbor = imgsize.height-border-1;
 }
+
@@ -1,4 +1,8 @@
+#pragma once
+
 #include <vector>
+#include <deque>
+#include <climits>
 
 class Graph {
 public:
@@ -71,4 +75,234 @@ public:
 	std::vector<int> son, next, point, d, q, pre, preE;
 	std::vector<double> len;
 	double flowS;
-};
\ No newline at end of file
+};
+
+// max-flow / min-cut on a 8-connected grid (Boykov & Kolmogorov, "An experimental comparison of min-cut/max-flow
+// algorithms for energy minimization in vision", 2004): search trees grown from both terminals are reused between
+// augmentations instead of being rebuilt like Dinic's levels; neighbours are implicit (no edge lists), capacities are
+// floats, and growth, augmentation & adoption are all iterative
+class GridGraph {
+public:
+	GridGraph(const int width = 0, const int height = 0) { reset(width, height); }
+	// resizes the grid and clears all capacities (the memory is kept)
+	void reset(const int width, const int height) {
+		w = width; h = height; n = width * height;
+		cap.assign(n * 8, 0);
+		tcap.assign(n, 0);
+		tree.assign(n, FREE);
+		parent.assign(n, NONE);
+		ts.assign(n, 0);
+		dist.assign(n, 0);
+		active.assign(n, 0);
+		activeQueue.clear();
+		orphans.clear();
+		flow = 0;
+		time = 0;
+	}
+	inline int getWidth() const {return w;}
+	inline int getHeight() const {return h;}
+	// capacities from the source & to the sink (only their difference matters for the cut)
+	void add_tweights(const int u, float capSource, float capSink) {
+		if (tcap[u] > 0) capSource += tcap[u];
+		else capSink -= tcap[u];
+		flow += capSource < capSink ? capSource : capSink;
+		tcap[u] = capSource - capSink;
+	}
+	// capacities of the edge from u to its neighbour at (dx, dy) (-1..1) and back
+	void add_edge(const int u, const int dx, const int dy, const float c1, const float c2) {
+		const int k = (dy + 1) * 3 + dx + 1;
+		const int dir = k > 4 ? k - 1 : k;
+		const int v = u + dy * w + dx;
+		cap[u * 8 + dir] += c1;
+		cap[v * 8 + 7 - dir] += c2;
+	}
+	double maxflow() {
+		init();
+		int u;
+		while ((u = nextActive()) >= 0) {
+			// grow the tree of u until it touches the other one
+			int s = -1, t = -1, dir = -1;
+			for (int k = 0; k < 8 && dir < 0; k++) {
+				int v;
+				if (!neighbor(u, k, v)) continue;
+				if (tree[u] == SOURCE) {
+					if (cap[u * 8 + k] <= 0) continue;
+					if (tree[v] == FREE) attach(v, SOURCE, 7 - k, u);
+					else if (tree[v] == SINK) { s = u; t = v; dir = k; }
+					else if (ts[v] <= ts[u] && dist[v] > dist[u]) { parent[v] = 7 - k; ts[v] = ts[u]; dist[v] = dist[u] + 1; }
+				}
+				else {
+					if (cap[v * 8 + 7 - k] <= 0) continue;
+					if (tree[v] == FREE) attach(v, SINK, 7 - k, u);
+					else if (tree[v] == SOURCE) { s = v; t = u; dir = 7 - k; }
+					else if (ts[v] <= ts[u] && dist[v] > dist[u]) { parent[v] = 7 - k; ts[v] = ts[u]; dist[v] = dist[u] + 1; }
+				}
+			}
+			if (dir < 0) continue;
+			time++;
+			augment(s, t, dir);
+			adopt();
+			// u may still touch the other tree
+			if (tree[u] != FREE && !active[u]) { active[u] = 1; activeQueue.push_front(u); }
+		}
+		return flow;
+	}
+	// whether u is on the source side of the minimum cut
+	bool check_type(const int u) const {
+		return tree[u] == SOURCE;
+	}
+
+private:
+	enum {FREE = 0, SOURCE = 1, SINK = 2};
+	// parent values besides the 8 directions
+	enum {TERMINAL = 8, ORPHAN = 9, NONE = 10};
+
+	// neighbour of u in direction k (0..7, row-major around u, the reverse of k being 7 - k)
+	inline bool neighbor(const int u, const int k, int &v) const {
+		static const int dxs[8] = {-1, 0, 1, -1, 1, -1, 0, 1}, dys[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
+		const int x = u % w + dxs[k], y = u / w + dys[k];
+		if (x < 0 || x >= w || y < 0 || y >= h) return false;
+		v = y * w + x;
+		return true;
+	}
+	inline int parentOf(const int u) const {
+		int v = -1;
+		neighbor(u, parent[u], v);
+		return v;
+	}
+	inline void activate(const int u) {
+		if (!active[u]) { active[u] = 1; activeQueue.push_back(u); }
+	}
+	inline void attach(const int v, const unsigned char t, const int dirToParent, const int p) {
+		tree[v] = t; parent[v] = (signed char) dirToParent;
+		ts[v] = ts[p]; dist[v] = dist[p] + 1;
+		activate(v);
+	}
+	int nextActive() {
+		while (!activeQueue.empty()) {
+			const int u = activeQueue.front();
+			activeQueue.pop_front();
+			active[u] = 0;
+			if (tree[u] != FREE) return u;
+		}
+		return -1;
+	}
+	void init() {
+		activeQueue.clear();
+		orphans.clear();
+		time = 0;
+		for (int u = 0; u < n; u++) {
+			active[u] = 0;
+			ts[u] = 0;
+			if (tcap[u] > 0) { tree[u] = SOURCE; parent[u] = TERMINAL; dist[u] = 1; activate(u); }
+			else if (tcap[u] < 0) { tree[u] = SINK; parent[u] = TERMINAL; dist[u] = 1; activate(u); }
+			else { tree[u] = FREE; parent[u] = NONE; dist[u] = 0; }
+		}
+	}
+	// push the bottleneck along source -> s -> t -> sink, s -> t being the edge of direction dir
+	void augment(const int s, const int t, const int dir) {
+		float bottleneck = cap[s * 8 + dir];
+		for (int u = s; parent[u] != TERMINAL; ) {
+			const int p = parentOf(u);
+			const float c = cap[p * 8 + 7 - parent[u]];
+			if (c < bottleneck) bottleneck = c;
+			u = p;
+			if (parent[u] == TERMINAL && tcap[u] < bottleneck) bottleneck = tcap[u];
+		}
+		if (parent[s] == TERMINAL && tcap[s] < bottleneck) bottleneck = tcap[s];
+		for (int u = t; parent[u] != TERMINAL; ) {
+			const float c = cap[u * 8 + parent[u]];
+			if (c < bottleneck) bottleneck = c;
+			u = parentOf(u);
+			if (parent[u] == TERMINAL && -tcap[u] < bottleneck) bottleneck = -tcap[u];
+		}
+		if (parent[t] == TERMINAL && -tcap[t] < bottleneck) bottleneck = -tcap[t];
+
+		cap[s * 8 + dir] -= bottleneck;
+		cap[t * 8 + 7 - dir] += bottleneck;
+		for (int u = s; ; ) {
+			if (parent[u] == TERMINAL) {
+				tcap[u] -= bottleneck;
+				if (tcap[u] <= 0) makeOrphan(u);
+				break;
+			}
+			const int p = parentOf(u);
+			cap[p * 8 + 7 - parent[u]] -= bottleneck;
+			cap[u * 8 + parent[u]] += bottleneck;
+			if (cap[p * 8 + 7 - parent[u]] <= 0) makeOrphan(u);
+			u = p;
+		}
+		for (int u = t; ; ) {
+			if (parent[u] == TERMINAL) {
+				tcap[u] += bottleneck;
+				if (tcap[u] >= 0) makeOrphan(u);
+				break;
+			}
+			const int p = parentOf(u);
+			cap[u * 8 + parent[u]] -= bottleneck;
+			cap[p * 8 + 7 - parent[u]] += bottleneck;
+			if (cap[u * 8 + parent[u]] <= 0) makeOrphan(u);
+			u = p;
+		}
+		flow += bottleneck;
+	}
+	inline void makeOrphan(const int u) {
+		parent[u] = ORPHAN;
+		orphans.push_back(u);
+	}
+	// find new parents for the orphans (in their own tree), or free them
+	void adopt() {
+		while (!orphans.empty()) {
+			const int u = orphans.front();
+			orphans.pop_front();
+			const unsigned char t = tree[u];
+			int best = -1, bestDist = INT_MAX;
+			for (int k = 0; k < 8; k++) {
+				int v;
+				if (!neighbor(u, k, v) || tree[v] != t) continue;
+				if (t == SOURCE ? cap[v * 8 + 7 - k] <= 0 : cap[u * 8 + k] <= 0) continue;
+				// v is a valid parent if it still has an origin, i.e. if it is connected to the terminal
+				int d = 0, x = v;
+				for (;;) {
+					if (ts[x] == time) { d += dist[x]; break; }
+					const int a = parent[x];
+					d++;
+					if (a == TERMINAL) { ts[x] = time; dist[x] = 1; break; }
+					if (a == ORPHAN || a == NONE) { d = INT_MAX; break; }
+					x = parentOf(x);
+				}
+				if (d == INT_MAX) continue;
+				if (d < bestDist) { best = k; bestDist = d; }
+				// cache the distances of the path
+				for (x = v; ts[x] != time; x = parentOf(x)) { ts[x] = time; dist[x] = d--; }
+			}
+			if (best >= 0) {
+				parent[u] = (signed char) best;
+				ts[u] = time;
+				dist[u] = bestDist + 1;
+				continue;
+			}
+			// no parent: u becomes free, its children become orphans and its neighbours that could reach it are activated
+			for (int k = 0; k < 8; k++) {
+				int v;
+				if (!neighbor(u, k, v) || tree[v] != t) continue;
+				if (t == SOURCE ? cap[v * 8 + 7 - k] > 0 : cap[u * 8 + k] > 0) activate(v);
+				if (parent[v] == 7 - k) makeOrphan(v);
+			}
+			tree[u] = FREE;
+			parent[u] = NONE;
+		}
+	}
+
+	int w, h, n;
+	// residual capacities: 8 per node (edge towards each neighbour), terminal ones (> 0 from the source, < 0 to the sink)
+	std::vector<float> cap, tcap;
+	std::vector<unsigned char> tree, active;
+	// direction of the edge to the parent (in the parent -> child direction for the source tree, child -> parent for the sink one)
+	std::vector<signed char> parent;
+	// timestamps & distances to the terminal, used to keep the trees shallow
+	std::vector<int> ts, dist;
+	std::deque<int> activeQueue, orphans;
+	double flow;
+	int time;
+};
@@ -24,6 +24,18 @@ const char* keys = {
     "{p  |filepath |         | file path		}"
 	"{s  |savepath |         | save path		}"
 	"{i  |info     |true    | whether output   }"
+	"{cw |canvaswidth  |0       | panoramic canvas width (0 = no panorama) }"
+	"{ch |canvasheight |0       | panoramic canvas height }"
+	"{cb |canvasbudget |1024    | panoramic model memory budget (MB) }"
+	"{fb |features     |2000    | feature points tracked per frame }"
+	"{ml |motionlevel  |0       | pyramid level of the motion estimation (0 = full resolution) }"
+	"{mb |motionbudget |0       | motion estimation time budget (ms, 0 = none) }"
+	"{mr |motionrefine |0       | points refining the coarse motion at full resolution }"
+	"{pl |pipeline     |false   | estimate the motion of the next frame while segmenting the current one }"
+	"{pi |pmiters      |5       | PatchMatch refinement passes }"
+	"{pb |pmbudget     |0       | PatchMatch time budget (ms, 0 = none) }"
+	"{sm |sparsematch  |-1      | only patch match within this margin (px) of the foreground (-1 = whole frame) }"
+	"{dp |probes       |        | debug images to save (comma separated probe names, * = all) }"
 };
 
 // show the Mat
@@ -31,6 +43,17 @@ void test(cv::Mat aa, string _filename = "show Picture") {
 	cv::imshow(_filename, aa);
 	cv::waitKey(0);
 }
+// save the mask & background of a frame
+void saveResult(const MovingSubtractor &oSubtractor, const string &sSavePath, int i, const cv::Mat &oSegmMask, cv::Mat &oBGImg) {
+	char num[100];
+	oSubtractor.getBackgroundImage(oBGImg);
+	printf("Save %d\n", i);
+	sprintf(num, "%d", i);
+	string ss = string(num) + ".jpg";
+	cv::imwrite(sSavePath + "ou" + ss, oSegmMask);
+	cv::imwrite(sSavePath + "bg" + ss, oBGImg);
+//	cv::imwrite(sSavePath + "compare" + ss, oDeltaImg);
+}
 int main(int argc, char* argv[]) {
 	help();
 	// pass the ccommand line
@@ -38,6 +61,17 @@ int main(int argc, char* argv[]) {
 	const string sFilePath = parser.get<string>("filepath");
 	const string sSavePath = parser.get<string>("savepath");
 	const bool bOutputInfo = parser.get<bool>("info");
+	const cv::Size oCanvasSize(parser.get<int>("canvaswidth"), parser.get<int>("canvasheight"));
+	const int nCanvasBudget = parser.get<int>("canvasbudget");
+	const int nFeatureBudget = parser.get<int>("features");
+	const int nMotionLevel = parser.get<int>("motionlevel");
+	const double dMotionBudget = parser.get<double>("motionbudget");
+	const int nMotionRefine = parser.get<int>("motionrefine");
+	const bool bPipeline = parser.get<bool>("pipeline");
+	const string sProbes = parser.get<string>("probes");
+	const int nPatchMatchIters = parser.get<int>("pmiters");
+	const double dPatchMatchBudget = parser.get<double>("pmbudget");
+	const int nSparseMatchMargin = parser.get<int>("sparsematch");
 	if (bOutputInfo) cout << "^.^" << endl;
 	cout << bOutputInfo << endl; 
 
@@ -60,11 +94,23 @@ int main(int argc, char* argv[]) {
 	oDeltaImg = oCurrReconstrBGImg.clone();
 	oROI = cv::Mat(oCurrInputFrame.size(),CV_8UC1,cv::Scalar_<uchar>(255));
 	
-	MovingSubtractor oSubtractor(bOutputInfo, sSavePath);
+	MovingSubtractor oSubtractor(bOutputInfo, sSavePath, oCanvasSize, (size_t) nCanvasBudget);
+	oSubtractor.setFeatureBudget(nFeatureBudget);
+	oSubtractor.setMotionEstimation(nMotionLevel, dMotionBudget, nMotionRefine);
+	oSubtractor.setPipelined(bPipeline);
+	oSubtractor.setPatchMatch(nPatchMatchIters, dPatchMatchBudget);
+	oSubtractor.setSparsePatchMatch(nSparseMatchMargin);
+	for (size_t nStart = 0; nStart < sProbes.size(); ) {
+		size_t nEnd = sProbes.find(',', nStart);
+		if (nEnd == string::npos) nEnd = sProbes.size();
+		if (nEnd > nStart) oSubtractor.getDiagnostics().subscribe(sProbes.substr(nStart, nEnd - nStart));
+		nStart = nEnd + 1;
+	}
 	cv::blur( oCurrInputFrame, oCurrInputFrame, cv::Size( 4, 4 ), cv::Point(-1,-1));
 	oSubtractor.initialize(oCurrInputFrame, oROI);
-	char num[100];
 	Timer timer;
+	// index of the next frame to be saved (the pipelined mode outputs the masks PIPELINE_LATENCY frames late)
+	int nSaved = 2;
 	for (int i = 2; ; i ++ ) {
 		printf("Start %d\n", i);
 		timer.reset();
@@ -74,16 +120,15 @@ int main(int argc, char* argv[]) {
 		if (oCurrInputFrame.empty() || (!oCurrInputFrame.data)) break;
 		// subtractor work with new frame
 		cv::blur( oCurrInputFrame, oCurrInputFrame, cv::Size( 4, 4 ), cv::Point(-1,-1));
-		oSubtractor.work(oCurrInputFrame, oCurrSegmMask);
-		oSubtractor.getBackgroundImage(oCurrReconstrBGImg);
 		// save result
-		printf("Save %d\n", i);
-		sprintf(num, "%d", i);
-		string ss = string(num) + ".jpg";
-		cv::imwrite(sSavePath + "ou" + ss, oCurrSegmMask);
-		cv::imwrite(sSavePath + "bg" + ss, oCurrReconstrBGImg);
-//		cv::imwrite(sSavePath + "compare" + ss, oDeltaImg);
+		if (oSubtractor.work(oCurrInputFrame, oCurrSegmMask))
+			saveResult(oSubtractor, sSavePath, nSaved ++, oCurrSegmMask, oCurrReconstrBGImg);
 		printf("\nframe%d use %.3lfs in total.\n\n", i, timer.getTime());
 	}
+	// frames still in the pipeline
+	while (oSubtractor.flush(oCurrSegmMask))
+		saveResult(oSubtractor, sSavePath, nSaved ++, oCurrSegmMask, oCurrReconstrBGImg);
+	printf("motion models: %d shift, %d affine, %d perspective\n", oSubtractor.getMotionTierCount(MOTION_TIER_SHIFT),
+		oSubtractor.getMotionTierCount(MOTION_TIER_AFFINE), oSubtractor.getMotionTierCount(MOTION_TIER_PERSPECTIVE));
 	return 0;
 }
\ No newline at end of file
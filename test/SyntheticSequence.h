@@ -0,0 +1,48 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <cstdlib>
+
+// synthetic sequence shared by the test programs: a blurred random texture seen through a camera window (panning by
+// pan pixels per frame, or static), with sensor noise, a square moving over it and an optional flickering region
+// (e.g. water, redrawn with random noise each frame); each test sets the parts it needs
+struct SyntheticSequence {
+	SyntheticSequence(const cv::Size& frameSize, int type, cv::RNG& rng, int frameCount = 1, const cv::Point& pan = cv::Point())
+		:	 frameSize(frameSize)
+			,pan(pan)
+			,noiseSigma(4)
+			,squareSize(80)
+			,squareSpeed(4)
+			,squareY(frameSize.height / 3)
+			,scene(frameSize.height + std::abs(pan.y) * frameCount, frameSize.width + std::abs(pan.x) * frameCount, type) {
+		rng.fill(scene, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+		cv::GaussianBlur(scene, scene, cv::Size(9, 9), 3);
+	}
+
+	// frame idx (the camera window must stay within the frameCount frames the scene was made for)
+	void makeFrame(cv::Mat& frame, int idx, cv::RNG& rng) const {
+		const int x0 = pan.x >= 0 ? idx * pan.x : scene.cols - frameSize.width + idx * pan.x;
+		const int y0 = pan.y >= 0 ? idx * pan.y : scene.rows - frameSize.height + idx * pan.y;
+		scene(cv::Rect(x0, y0, frameSize.width, frameSize.height)).copyTo(frame);
+		cv::Mat noise(frame.size(), frame.type());
+		rng.fill(noise, cv::RNG::NORMAL, cv::Scalar::all(0), cv::Scalar::all(noiseSigma));
+		frame += noise;
+		const int x = (idx * squareSpeed) % (frameSize.width - squareSize);
+		cv::rectangle(frame, cv::Rect(x, squareY, squareSize, squareSize), cv::Scalar(30, 200, 60), CV_FILLED);
+		if (flickerRect.area() > 0) {
+			cv::Mat flicker = frame(flickerRect);
+			rng.fill(flicker, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+		}
+	}
+
+	const cv::Size frameSize;
+	// camera pan, in pixels per frame
+	const cv::Point pan;
+	double noiseSigma;
+	// the square moves right by squareSpeed pixels per frame, wrapping around
+	int squareSize, squareSpeed, squareY;
+	cv::Rect flickerRect;
+	cv::Mat scene;
+};
@@ -0,0 +1,140 @@
+#include "graph.h"
+#include "BackgroundSubtractorSuBSENSE.h"
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+// compares the Dinic (Graph) & Boykov-Kolmogorov (GridGraph) max-flow solvers on the block graphs randomField() builds
+// from real frames & their saved masks (in%06d.jpg / ou%d.jpg, as in the random field test):
+// solving time, flow value and labels agreement
+
+const int FIRST_FRAME = 3;
+const int LAST_FRAME = 28;
+// solves of each graph, to time more than the clock resolution
+const int REPEAT = 20;
+
+// the unary & pairwise capacities of randomField(), with the blocks numbered row by row
+struct BlockGraph {
+	int ww, hh;
+	// > 0 from the source, < 0 to the sink
+	vector<double> terminal;
+	// edges to the (0,-1), (-1,0), (-1,-1) & (1,-1) neighbours (0 = none)
+	vector<double> edges;
+};
+
+static double patchDist(const cv::Mat& image, int ax, int ay, int bx, int by) {
+	const cv::Mat a = image(cv::Rect(ax, ay, patch_w, patch_w)), b = image(cv::Rect(bx, by, patch_w, patch_w));
+	return cv::norm(a, b, cv::NORM_L2SQR);
+}
+
+static void buildBlockGraph(const cv::Mat& image, const cv::Mat& mask, BlockGraph& graph) {
+	const int aew = mask.cols - patch_w + 1, aeh = mask.rows - patch_w + 1;
+	graph.ww = (aew - 1) / patch_w + 1;
+	graph.hh = (aeh - 1) / patch_w + 1;
+	graph.terminal.clear();
+	graph.edges.assign(graph.ww * graph.hh * 4, 0);
+	const int dx[4] = {0, -1, -1, 1}, dy[4] = {-1, 0, -1, -1};
+	double avgDistance = 0;
+	int edgeCount = 0;
+	for (int ay = 0; ay < aeh; ay += patch_w)
+		for (int ax = 0; ax < aew; ax += patch_w) {
+			float ss = 0;
+			for (int ii = 0; ii < patch_w; ii ++)
+				for (int jj = 0; jj < patch_w; jj ++)
+					ss += 1 - mask.at<uchar>(ay + ii, ax + jj) / 255.0;
+			float d = MIN(1.0f, ss / patch_area * 2);
+			const float d1 = -log(MAX(1e-20f, d)), d2 = -log(MAX(1e-20f, 1 - d));
+			graph.terminal.push_back(d1 - d2);
+			const int idx = ay / patch_w * graph.ww + ax / patch_w;
+			for (int k = 0; k < 4; k ++) {
+				const int bx = ax + dx[k] * patch_w, by = ay + dy[k] * patch_w;
+				if (bx < 0 || by < 0 || bx >= aew) continue;
+				graph.edges[idx * 4 + k] = patchDist(image, ax, ay, bx, by);
+				avgDistance += graph.edges[idx * 4 + k];
+				edgeCount ++;
+			}
+		}
+	avgDistance /= edgeCount;
+	for (int idx = 0; idx < graph.ww * graph.hh; idx ++)
+		for (int k = 0; k < 4; k ++) {
+			const int x = idx % graph.ww + dx[k], y = idx / graph.ww + dy[k];
+			if (x < 0 || y < 0 || x >= graph.ww) continue;
+			graph.edges[idx * 4 + k] = 0.3 + 0.3 * exp(-graph.edges[idx * 4 + k] / 2 / avgDistance);
+		}
+}
+
+int main(int argc, char* argv[]) {
+	const int dx[4] = {0, -1, -1, 1}, dy[4] = {-1, 0, -1, -1};
+	BlockGraph block;
+	GridGraph grid;
+	double dinicTicks = 0, gridTicks = 0;
+	size_t blocks = 0, diffBlocks = 0;
+	int frames = 0;
+	char name[100];
+	for (int idx = FIRST_FRAME; idx <= LAST_FRAME; idx ++) {
+		sprintf(name, "in%06d.jpg", idx + 2);
+		const cv::Mat image = cv::imread(name);
+		sprintf(name, "ou%d.jpg", idx);
+		const cv::Mat mask = cv::imread(name, CV_LOAD_IMAGE_GRAYSCALE);
+		if (image.empty() || mask.empty() || image.size() != mask.size()) {
+			cout << "skipped frame " << idx << endl;
+			continue;
+		}
+		buildBlockGraph(image, mask, block);
+		const int n = block.ww * block.hh;
+
+		double dinicFlow = 0;
+		vector<bool> dinicLabels(n);
+		int64 t0 = cv::getTickCount();
+		for (int r = 0; r < REPEAT; r ++) {
+			Graph dinic(n);
+			for (int i = 0; i < n; i ++) {
+				if (block.terminal[i] > 0) dinic.add_edge(dinic.getS(), i, block.terminal[i], 0);
+				else dinic.add_edge(i, dinic.getT(), -block.terminal[i], 0);
+				for (int k = 0; k < 4; k ++)
+					if (block.edges[i * 4 + k] > 0)
+						dinic.add_edge(i, i + dy[k] * block.ww + dx[k], block.edges[i * 4 + k], block.edges[i * 4 + k]);
+			}
+			dinicFlow = dinic.maxflow();
+			if (r == 0)
+				for (int i = 0; i < n; i ++) dinicLabels[i] = dinic.check_type(i);
+		}
+		int64 t1 = cv::getTickCount();
+		double gridFlow = 0;
+		for (int r = 0; r < REPEAT; r ++) {
+			grid.reset(block.ww, block.hh);
+			for (int i = 0; i < n; i ++) {
+				if (block.terminal[i] > 0) grid.add_tweights(i, (float) block.terminal[i], 0);
+				else grid.add_tweights(i, 0, (float) -block.terminal[i]);
+				for (int k = 0; k < 4; k ++)
+					if (block.edges[i * 4 + k] > 0)
+						grid.add_edge(i, dx[k], dy[k], (float) block.edges[i * 4 + k], (float) block.edges[i * 4 + k]);
+			}
+			gridFlow = grid.maxflow();
+		}
+		int64 t2 = cv::getTickCount();
+		dinicTicks += (double) (t1 - t0);
+		gridTicks += (double) (t2 - t1);
+		for (int i = 0; i < n; i ++)
+			if (dinicLabels[i] != grid.check_type(i)) diffBlocks ++;
+		blocks += n;
+		frames ++;
+		printf("frame %d: %dx%d blocks, flow dinic = %.3f, grid = %.3f\n", idx, block.ww, block.hh, dinicFlow, gridFlow);
+	}
+	if (!frames) {
+		cout << "no frame / mask pair found" << endl;
+		return 1;
+	}
+
+	const double solves = (double) frames * REPEAT;
+	printf("time per graph  : dinic = %.3f ms, grid = %.3f ms\n",
+		dinicTicks * 1000 / cv::getTickFrequency() / solves, gridTicks * 1000 / cv::getTickFrequency() / solves);
+	printf("labels agreement: %.4f%% of the blocks differ\n", 100.0 * diffBlocks / blocks);
+	return 0;
+}
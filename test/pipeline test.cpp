@@ -0,0 +1,92 @@
+#include "MovingSubtractor.h"
+#include "SyntheticSequence.h"
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// compares the sequential & pipelined modes of MovingSubtractor on a synthetic panning sequence, with the camera model
+// and with a panoramic canvas wider & taller than the frames: the pipelined masks (PIPELINE_LATENCY frames late) must be
+// frame-sized & identical to the sequential ones, also after a re-initialization in the middle of the sequence, and the
+// frames left in flight by an initialize without flush must be reported
+
+const int FRAME_WIDTH = 320;
+const int FRAME_HEIGHT = 240;
+const int FRAME_COUNT = 60;
+// the sequence is re-initialized at this frame
+const int REINIT_FRAME = 30;
+// camera pan, in pixels per frame
+const int PAN_X = 2;
+const int PAN_Y = 1;
+// canvas of the panoramic runs
+const cv::Size CANVAS_SIZE(FRAME_WIDTH * 2, FRAME_HEIGHT * 3 / 2);
+
+// runs the sequence (re-initialized at REINIT_FRAME), returns the mask of every frame and the time per frame in ms
+static double run(bool pipelined, const cv::Size& canvas, const vector<cv::Mat>& frames, vector<cv::Mat>& masks) {
+	int64 t0 = cv::getTickCount();
+	MovingSubtractor subtractor(false, "", canvas);
+	subtractor.setPipelined(pipelined);
+	masks.clear();
+	cv::Mat mask;
+	for (size_t i = 0; i < frames.size(); i ++) {
+		if (i == 0 || (int) i == REINIT_FRAME) {
+			// the frames still in flight are segmented before the re-initialization
+			while (subtractor.flush(mask)) masks.push_back(mask.clone());
+			subtractor.initialize(frames[i], cv::Mat(frames[i].size(), CV_8UC1, cv::Scalar(255)));
+			continue;
+		}
+		if (subtractor.work(frames[i], mask)) masks.push_back(mask.clone());
+	}
+	while (subtractor.flush(mask)) masks.push_back(mask.clone());
+	return (double) (cv::getTickCount() - t0) * 1000 / cv::getTickFrequency() / frames.size();
+}
+
+int main(int argc, char* argv[]) {
+	// panning camera, with a smaller & faster square
+	cv::RNG rng(12345);
+	SyntheticSequence sequence(cv::Size(FRAME_WIDTH, FRAME_HEIGHT), CV_8UC3, rng, FRAME_COUNT, cv::Point(PAN_X, PAN_Y));
+	sequence.noiseSigma = 3;
+	sequence.squareSize = 40;
+	sequence.squareSpeed = 5;
+	sequence.squareY = FRAME_HEIGHT / 2;
+	vector<cv::Mat> frames(FRAME_COUNT);
+	for (int i = 0; i < FRAME_COUNT; i ++)
+		sequence.makeFrame(frames[i], i, rng);
+
+	bool identical = true;
+	for (int panoramic = 0; panoramic < 2; panoramic ++) {
+		const cv::Size canvas = panoramic ? CANVAS_SIZE : cv::Size();
+		vector<cv::Mat> sequentialMasks, pipelinedMasks;
+		const double sequentialTime = run(false, canvas, frames, sequentialMasks);
+		const double pipelinedTime = run(true, canvas, frames, pipelinedMasks);
+		bool same = sequentialMasks.size() == pipelinedMasks.size();
+		size_t diffPixels = 0;
+		for (size_t i = 0; same && i < sequentialMasks.size(); i ++) {
+			same = sequentialMasks[i].size() == frames[0].size() && pipelinedMasks[i].size() == frames[0].size();
+			if (same) diffPixels += cv::countNonZero(sequentialMasks[i] != pipelinedMasks[i]);
+		}
+		identical = identical && same && diffPixels == 0;
+		printf("%s: time per frame sequential = %.2f ms, pipelined = %.2f ms\n", panoramic ? "panoramic" : "camera", sequentialTime, pipelinedTime);
+		printf("%s: masks %u sequential, %u pipelined, %s, %u pixels differ\n", panoramic ? "panoramic" : "camera", (unsigned) sequentialMasks.size(),
+			(unsigned) pipelinedMasks.size(), same ? "frame-sized" : "size mismatch", (unsigned) diffPixels);
+	}
+
+	// an initialize with frames in flight drops them, and says so
+	MovingSubtractor subtractor;
+	subtractor.setPipelined(true);
+	cv::Mat mask;
+	subtractor.initialize(frames[0], cv::Mat(frames[0].size(), CV_8UC1, cv::Scalar(255)));
+	for (int i = 1; i <= PIPELINE_LATENCY; i ++)
+		subtractor.work(frames[i], mask);
+	subtractor.initialize(frames[0], cv::Mat(frames[0].size(), CV_8UC1, cv::Scalar(255)));
+	const bool reported = subtractor.getDroppedFrames() == PIPELINE_LATENCY;
+	printf("frames dropped by initialize: %d (expected %d)\n", subtractor.getDroppedFrames(), PIPELINE_LATENCY);
+
+	cout << (identical && reported ? "OK" : "FAILED") << endl;
+	return identical && reported ? 0 : 1;
+}
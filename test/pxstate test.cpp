@@ -0,0 +1,86 @@
+#include "BackgroundSubtractorSuBSENSE.h"
+#include "SyntheticSequence.h"
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+// compares the float & lean (fixed-point) per-pixel state modes of SuBSENSE on a synthetic sequence:
+// state footprint, processing time and foreground mask agreement; a flickering region drives v(x) past the
+// point (~82) where the lean R(x) decrements fall below half a Q4.12 LSB, and its R(x) values are compared
+
+const int FRAME_WIDTH = 640;
+const int FRAME_HEIGHT = 480;
+const int FRAME_COUNT = 200;
+// dynamic background region (e.g. water), redrawn with random noise each frame
+const cv::Rect FLICKER_RECT(FRAME_WIDTH-160, FRAME_HEIGHT-120, 120, 80);
+// v(x) above which the R(x) decrements are below half a Q4.12 LSB
+const float LEAN_R_BOUND_V = 0.01f*2*4096;
+
+// gives access to the state planes
+class InspectedSuBSENSE : public BackgroundSubtractorSuBSENSE {
+public:
+	InspectedSuBSENSE(bool leanPxState = false): BackgroundSubtractorSuBSENSE(BGSSUBSENSE_DEFAULT_LBSP_REL_SIMILARITY_THRESHOLD,
+																			 BGSSUBSENSE_DEFAULT_DESC_DIST_THRESHOLD_OFFSET,
+																			 BGSSUBSENSE_DEFAULT_MIN_COLOR_DIST_THRESHOLD,
+																			 BGSSUBSENSE_DEFAULT_NB_BG_SAMPLES,
+																			 BGSSUBSENSE_DEFAULT_REQUIRED_NB_BG_SAMPLES,
+																			 BGSSUBSENSE_DEFAULT_N_SAMPLES_FOR_MV_AVGS,
+																			 BGSSUBSENSE_DEFAULT_NB_THREADS,
+																			 leanPxState) {}
+	cv::Mat getDistThresholdPlane() const {return getPxStatePlane(offsetof(PxState,fDistThresholdFactor));}
+	cv::Mat getVariationPlane() const {return getPxStatePlane(offsetof(PxState,fVariationFactor));}
+};
+
+int main(int argc, char* argv[]) {
+	// static camera, with the flickering region
+	cv::RNG rng(12345);
+	SyntheticSequence sequence(cv::Size(FRAME_WIDTH, FRAME_HEIGHT), CV_8UC3, rng);
+	sequence.flickerRect = FLICKER_RECT;
+	const cv::Mat roi(sequence.frameSize, CV_8UC1, cv::Scalar_<uchar>(255));
+
+	InspectedSuBSENSE floatBGS;
+	InspectedSuBSENSE leanBGS(true);
+	cv::Mat frame, floatMask, leanMask;
+	sequence.makeFrame(frame, 0, rng);
+	floatBGS.initialize(frame, roi);
+	leanBGS.initialize(frame, roi);
+
+	double floatTicks = 0, leanTicks = 0;
+	size_t diffPixels = 0, fgPixels = 0;
+	for (int idx = 1; idx < FRAME_COUNT; idx++) {
+		sequence.makeFrame(frame, idx, rng);
+		int64 t0 = cv::getTickCount();
+		floatBGS(frame, floatMask);
+		int64 t1 = cv::getTickCount();
+		leanBGS(frame, leanMask);
+		int64 t2 = cv::getTickCount();
+		floatTicks += (double)(t1-t0);
+		leanTicks += (double)(t2-t1);
+		diffPixels += cv::countNonZero(floatMask != leanMask);
+		fgPixels += cv::countNonZero(floatMask);
+	}
+
+	const double totalPixels = (double)FRAME_WIDTH*FRAME_HEIGHT;
+	printf("state footprint : float = %u bytes/px (%.1f MB), lean = %u bytes/px (%.1f MB)\n",
+		(unsigned)floatBGS.getPxStateFootprint(), floatBGS.getPxStateFootprint()*totalPixels/(1<<20),
+		(unsigned)leanBGS.getPxStateFootprint(), leanBGS.getPxStateFootprint()*totalPixels/(1<<20));
+	printf("time per frame  : float = %.2f ms, lean = %.2f ms\n",
+		floatTicks*1000/cv::getTickFrequency()/(FRAME_COUNT-1), leanTicks*1000/cv::getTickFrequency()/(FRAME_COUNT-1));
+	printf("mask agreement  : %.4f%% of pixels differ (%u foreground pixels in float mode)\n",
+		100.0*diffPixels/(totalPixels*(FRAME_COUNT-1)), (unsigned)fgPixels);
+	// R(x) in the flickering region, where v(x) grows by 1 per blink frame
+	const cv::Mat floatR = floatBGS.getDistThresholdPlane()(FLICKER_RECT), leanR = leanBGS.getDistThresholdPlane()(FLICKER_RECT);
+	const cv::Mat floatV = floatBGS.getVariationPlane()(FLICKER_RECT), leanV = leanBGS.getVariationPlane()(FLICKER_RECT);
+	double maxV;
+	cv::minMaxLoc(floatV, NULL, &maxV);
+	printf("dynamic region  : v(x) > %.1f for %.1f%% (float) / %.1f%% (lean) of the pixels, max %.1f\n", LEAN_R_BOUND_V,
+		100.0*cv::countNonZero(floatV > LEAN_R_BOUND_V)/FLICKER_RECT.area(), 100.0*cv::countNonZero(leanV > LEAN_R_BOUND_V)/FLICKER_RECT.area(), maxV);
+	printf("                  mean R(x) float = %.4f, lean = %.4f\n", cv::mean(floatR)[0], cv::mean(leanR)[0]);
+	return 0;
+}
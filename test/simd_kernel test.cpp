@@ -0,0 +1,57 @@
+#include "BackgroundSubtractorSuBSENSE.h"
+#include "SyntheticSequence.h"
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+// compares the SIMD & scalar paths of the SuBSENSE sample group prefilters on synthetic color & grayscale sequences:
+// the foreground masks must be identical, and the processing times show what the SIMD paths save
+
+const int FRAME_WIDTH = 640;
+const int FRAME_HEIGHT = 480;
+const int FRAME_COUNT = 100;
+
+// returns the number of mask pixels that differ between the two paths
+static size_t compare(int type) {
+	// static camera, the prefilters only see the noise & the moving square
+	cv::RNG rng(12345);
+	const SyntheticSequence sequence(cv::Size(FRAME_WIDTH, FRAME_HEIGHT), type, rng);
+	const cv::Mat roi(sequence.frameSize, CV_8UC1, cv::Scalar_<uchar>(255));
+
+	BackgroundSubtractorSuBSENSE simdBGS, scalarBGS;
+	scalarBGS.setSIMDKernelsEnabled(false);
+	cv::Mat frame, simdMask, scalarMask;
+	sequence.makeFrame(frame, 0, rng);
+	simdBGS.initialize(frame, roi);
+	scalarBGS.initialize(frame, roi);
+
+	double simdTicks = 0, scalarTicks = 0;
+	size_t diffPixels = 0, fgPixels = 0;
+	for (int idx = 1; idx < FRAME_COUNT; idx++) {
+		sequence.makeFrame(frame, idx, rng);
+		int64 t0 = cv::getTickCount();
+		simdBGS(frame, simdMask);
+		int64 t1 = cv::getTickCount();
+		scalarBGS(frame, scalarMask);
+		int64 t2 = cv::getTickCount();
+		simdTicks += (double)(t1-t0);
+		scalarTicks += (double)(t2-t1);
+		diffPixels += cv::countNonZero(simdMask != scalarMask);
+		fgPixels += cv::countNonZero(simdMask);
+	}
+	printf("%d channel(s): time per frame simd = %.2f ms, scalar = %.2f ms; %u pixels differ (%u foreground pixels)\n", CV_MAT_CN(type),
+		simdTicks*1000/cv::getTickFrequency()/(FRAME_COUNT-1), scalarTicks*1000/cv::getTickFrequency()/(FRAME_COUNT-1),
+		(unsigned)diffPixels, (unsigned)fgPixels);
+	return diffPixels;
+}
+
+int main(int argc, char* argv[]) {
+	const size_t diffPixels = compare(CV_8UC3) + compare(CV_8UC1);
+	cout << (diffPixels ? "FAILED: the SIMD & scalar masks differ" : "OK: identical masks") << endl;
+	return diffPixels ? 1 : 0;
+}